@@ -20,21 +20,40 @@
  * MT-Unsafe
  */
 
+#define _GNU_SOURCE
+
 #include "microtcp.h"
 #include "../utils/crc32.h"
 #include "../utils/log.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 
 
 #define MICROTCP_HEADER_SIZE sizeof(microtcp_header_t)
 #define MIN2(x, y) ( (x > y) ? y : x )
+#define MAX2(x, y) ( (x > y) ? x : y )
+
+// sequence number comparisons (modulo 2^32)
+#define SEQ_LT(a, b)  ( (int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0 )
+#define SEQ_LEQ(a, b) ( (int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0 )
+#define SEQ_GT(a, b)  SEQ_LT(b, a)
+#define SEQ_GEQ(a, b) SEQ_LEQ(b, a)
 #define _ntoh_recvd_tcph(microtcp_header)  \
 								{\
 									microtcp_header.seq_number = ntohl(tcph.seq_number);\
@@ -42,13 +61,301 @@
 									microtcp_header.control    = ntohs(tcph.control);\
 									microtcp_header.window     = ntohs(tcph.window);\
 									microtcp_header.data_len   = ntohl(tcph.data_len);\
+									microtcp_header.future_use0 = ntohl(tcph.future_use0);\
+									microtcp_header.future_use1 = ntohl(tcph.future_use1);\
+									microtcp_header.future_use2 = ntohl(tcph.future_use2);\
 									microtcp_header.checksum   = ntohl(tcph.checksum);\
 								}
 
-#define TIOUT_DISABLE  0
-#define TIOUT_ENABLE   1
+#define DUP_ACK_THRESHOLD 3U
+#define SACK_MAX_BLOCKS   16U
+#define IO_BATCH          16U   // datagrams per sendmmsg() / recvmmsg()
+#define ZC_HDR_SLOTS      1024U // headers of MSG_ZEROCOPY datagrams in flight
+#define SENDFILE_WINDOW   (8U << 20)  // bytes of a file mapped at a time, a power of 2
+#define SEND_CHUNK        (1U << 30)  // bytes of a send() in one pass, far below the 2^31 sequence space
+
+/**
+ * A range [left, right) of sequence numbers that the peer has received out of order
+ */
+typedef struct
+{
+	uint32_t left;
+	uint32_t right;
+} sack_block_t;
+
+/**
+ * A batch of whole segments (header + payload), filled by a single recvmmsg(). The buffers
+ * are those of the socket, sized to the MSS it advertises.
+ */
+typedef struct
+{
+	struct mmsghdr msgs[IO_BATCH];
+	struct iovec   iovs[IO_BATCH];
+	uint8_t *      bufs;    // IO_BATCH buffers of 'stride' bytes
+	size_t         stride;
+	unsigned int   count;
+} seg_batch_t;
+
+/**
+ * A batch of outgoing segments, sent with a single sendmmsg(). Every datagram is gathered
+ * from its header and a pointer into the caller's buffer, so the payload is never copied.
+ */
+typedef struct
+{
+	struct mmsghdr    msgs[IO_BATCH];
+	struct iovec      iovs[IO_BATCH][2];
+	microtcp_header_t hdrs[IO_BATCH];
+	unsigned int      count;
+} iov_batch_t;
+
+/**
+ * A batch of bare headers (ACKs)
+ */
+typedef struct
+{
+	struct mmsghdr    msgs[IO_BATCH];
+	struct iovec      iovs[IO_BATCH];
+	microtcp_header_t hdrs[IO_BATCH];
+	unsigned int      count;
+} hdr_batch_t;
+
+/**
+ * The state of a transfer: its data, the window and the SACK scoreboard. The byte 'seq'
+ * is at buf[(seq - base) & mask], so 'buf' is either the caller's buffer (mask ~0U), the
+ * send ring of an asynchronous socket or the file windows of microtcp_sendfile().
+ */
+typedef struct
+{
+	iov_batch_t tx;     // segments to be sent with one syscall
+	hdr_batch_t rx;     // ACKs received with one syscall
+
+	const uint8_t * buf;
+	const uint64_t * eom;  // one bit per byte of 'buf': last byte of a message, or NULL
+	uint32_t mask;
+	int txflags;        // MSG_ZEROCOPY or 0
+	int more;           // the message goes on past 'end' (without 'eom')
+
+	sack_block_t sacked[SACK_MAX_BLOCKS];  // scoreboard: what the peer holds out of order
+	uint32_t nsacked;
+
+	uint32_t base;      // sequence number of buf[0]
+	uint32_t end;       // sequence number right after the last byte to be sent
+	uint32_t una;       // oldest unacknowledged byte
+	uint32_t nxt;       // next byte to be sent
+	uint32_t max;       // highest byte sent so far
+	uint32_t recover;   // 'max' at the time fast recovery was entered
+	uint32_t rtx_nxt;   // next hole to be retransmitted during fast recovery
+	uint32_t nak_nxt;   // next hole to be retransmitted on a NAK
+
+	uint64_t deadline;  // when the retransmission timer expires
+	uint64_t dacks;     // duplicate ACKs in a row
+	uint64_t pace_next; // when the next segment is due, if the congestion control paces
+	int paced;          // the last _snd_fill() stopped early, to pace
+} snd_state_t;
+
+/**
+ * The send ring of a socket in asynchronous mode (MICROTCP_SO_SNDRING), and the thread that
+ * transmits it. Everything below 'lock' is shared with the application.
+ */
+struct microtcp_async
+{
+	pthread_t thread;
+	int wakefd;         // eventfd: the application has queued data, or wants the thread to stop
+	uint8_t * ring;
+	uint64_t * eom;     // one bit per byte of 'ring': last byte of a message
+	uint32_t mask;      // ring length - 1
+	int started;
+
+	pthread_mutex_t lock;
+	pthread_cond_t acked;  // 'una' has moved
+	uint32_t base;      // sequence number of ring[0]
+	uint32_t una;       // oldest byte not acknowledged yet: below it the ring is free
+	uint32_t end;       // sequence number right after the last byte queued
+	uint32_t push;      // microtcp_flush(): the data below it is sent at once
+	int cork;           // MICROTCP_SO_CORK
+	int stop;
+};
+
+/**
+ * What a corked synchronous socket holds back: small sends, joined until they fill the
+ * buffer. Its thread sends them once they are due.
+ */
+struct microtcp_cork
+{
+	pthread_t thread;
+	pthread_mutex_t lock;  // held while the socket sends
+	pthread_cond_t held;   // a tail is held back, or the thread has to stop
+	uint8_t buf[MICROTCP_CORK_LEN];
+	uint32_t len;
+	uint64_t due;       // when the tail goes out (monotonic clock, microseconds)
+	int stop;
+};
+
+/**
+ * A datagram waiting in the queue of a listener connection, or in the backlog of a listener
+ */
+struct microtcp_dgram
+{
+	struct microtcp_dgram * next;
+	struct sockaddr_storage addr;  // sender
+	socklen_t addrlen;
+	uint32_t len;
+	uint8_t data[];
+};
+
+/**
+ * A thread blocked on a listener, waiting for a datagram of 'sock' or, if 'sock' is NULL,
+ * for a SYN in the backlog. It lives on the stack of the thread for as long as it waits.
+ */
+struct microtcp_waiter
+{
+	struct microtcp_waiter * next;
+	struct microtcp_waiter * prev;
+	microtcp_sock_t * sock;
+	pthread_cond_t cond;  // on the monotonic clock
+};
+
+/**
+ * The trace ring of a socket. Each record claims its slot with an atomic increment of 'head',
+ * so the application and the thread of an asynchronous socket may both write to it.
+ */
+struct microtcp_trace
+{
+	uint64_t head;      // records written so far
+	uint64_t mask;      // number of records - 1
+	uint64_t tsc0;      // clock readings at the creation of the ring
+	uint64_t ns0;
+	microtcp_trace_rec_t recs[];
+};
+
+/**
+ * A batch of datagrams read by a listener, along with their senders
+ */
+struct microtcp_rxbatch
+{
+	struct mmsghdr          msgs[IO_BATCH];
+	struct iovec            iovs[IO_BATCH];
+	struct sockaddr_storage names[IO_BATCH];
+	uint8_t                 bufs[IO_BATCH][MICROTCP_HEADER_SIZE + MICROTCP_MAX_MSS];
+};
+
+
+
+/**
+ * @brief Current time of the monotonic clock in microseconds
+ */
+static inline uint64_t _now_us(void)
+{
+	struct timespec ts;
+
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)(ts.tv_sec) * 1000000UL + (uint64_t)(ts.tv_nsec) / 1000UL;
+}
+
+/**
+ * @brief Clock of the trace records: the cycle counter where there is one, else _now_us() in ns
+ */
+static inline uint64_t _trace_clock(void)
+{
+	#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+	#else
+	struct timespec ts;
+
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)(ts.tv_sec) * 1000000000UL + (uint64_t)(ts.tv_nsec);
+	#endif
+}
+
+/**
+ * @brief Records an event in the trace ring of the socket, if it has one.
+ * 
+ * @param tcph the segment, in network byte order, or NULL
+ * @param seq the sequence number recorded when there is no segment
+ */
+static inline void _trace(microtcp_sock_t * __restrict__ sock, microtcp_trace_event_t event,
+						const microtcp_header_t * __restrict__ tcph, uint32_t seq)
+{
+	struct microtcp_trace * tr = sock->trace;
+	microtcp_trace_rec_t * rec;
+
+
+	if ( __builtin_expect(!tr, 1) )
+		return;
+
+	rec = tr->recs + (__atomic_fetch_add(&tr->head, 1UL, __ATOMIC_RELAXED) & tr->mask);
+
+	rec->tsc   = _trace_clock();
+	rec->cwnd  = MIN2(sock->cwnd, UINT32_MAX);
+	rec->event = event;
+
+	if ( tcph ) {
+
+		rec->seq_number = ntohl(tcph->seq_number);
+		rec->ack_number = ntohl(tcph->ack_number);
+		rec->data_len   = ntohl(tcph->data_len);
+		rec->checksum   = ntohl(tcph->checksum);
+		rec->window     = ntohs(tcph->window);
+		rec->control    = ntohs(tcph->control);
+	}
+	else {
+
+		rec->seq_number = seq;
+		rec->ack_number = 0U;
+		rec->data_len   = 0U;
+		rec->checksum   = 0U;
+		rec->window     = 0U;
+		rec->control    = 0U;
+	}
+}
+
+/**
+ * @brief Timestamp carried in future_use2 of data segments (0 is reserved for 'none')
+ */
+static inline uint32_t _tstamp(void)
+{
+	uint32_t ts = (uint32_t)(_now_us());
+
+
+	return ( ts ) ? ts : 1U;
+}
+
+/**
+ * @brief CRC-32 of a segment: the header, in network byte order with the checksum
+ * field taken as 0, followed by the payload.
+ */
+static uint32_t _segment_crc(const microtcp_header_t * __restrict__ tcph, const void * __restrict__ payld, uint32_t paysz)
+{
+	microtcp_header_t hdr = *tcph;
+	uint32_t crc;
+
+
+	hdr.checksum = 0U;
+	crc = update_crc32(0xffffffff, (const uint8_t *)(&hdr), MICROTCP_HEADER_SIZE);
 
+	return update_crc32(crc, payld, paysz) ^ 0xffffffff;
+}
+
+/**
+ * @brief Checks a received segment (header still in network byte order): the payload must
+ * be complete and the checksum must match.
+ * 
+ * @param tcph header of the segment
+ * @param payld the bytes that followed the header in the datagram
+ * @param avail how many they were
+ * @return 1 if the segment is intact, else 0
+ */
+static int _valid_segment(const microtcp_header_t * __restrict__ tcph, const void * __restrict__ payld, int64_t avail)
+{
+	if ( (avail < 0) || (ntohl(tcph->data_len) > (uint64_t)(avail)) )  // truncated
+		return 0;
 
+	return ( ntohl(tcph->checksum) == _segment_crc(tcph, payld, ntohl(tcph->data_len)) );
+}
 
 /**
  * @brief Initializes the microTCP header for a packet to get send over the network. By giving FRAGMENT
@@ -57,12 +364,13 @@
  * 
  * @param sock a valid microTCP socket handle
  * @param tcph microTCP header
+ * @param seq sequence number of the packet
  * @param ctrl control bits
  * @param paysz payload size
  * @param payld payload
  */
-static void _preapre_send_tcph(microtcp_sock_t * __restrict__ sock, microtcp_header_t * __restrict__ tcph, uint16_t ctrlb,
-						const void * __restrict__ payld, uint32_t paysz)
+static void _preapre_send_tcph(microtcp_sock_t * __restrict__ sock, microtcp_header_t * __restrict__ tcph, uint32_t seq,
+						uint16_t ctrlb, const void * __restrict__ payld, uint32_t paysz)
 {
 
 	#ifdef ENABLE_DEBUG_MSG
@@ -79,552 +387,3801 @@ static void _preapre_send_tcph(microtcp_sock_t * __restrict__ sock, microtcp_hea
 	}
 	#endif
 
-	if ( (ctrlb == 3) ) {  // [SYN, FIN] together
+	if ( (ctrlb == 3) ) {  // [SYN, FIN] together
+
+		LOG_DEBUG("'ctrlb' ---> [SYN][FIN]\n");
+		check(-1);
+	}
+
+	tcph->seq_number = htonl(seq);
+	tcph->ack_number = htonl(sock->ack_number);
+	tcph->control    = htons(ctrlb);
+	tcph->window     = htons( MIN2((sock->rcvbuf_len - sock->buf_fill_level) >> ( (ctrlb & CTRL_SYN) ? 0U : sock->rcv_wscale ),
+								0xFFFFUL) );  // the window of a SYN is never scaled
+	tcph->data_len   = htonl(paysz);
+	tcph->future_use0 = htonl( (ctrlb & CTRL_SYN) ? sock->rcv_mss : (ctrlb & CTRL_ACK) ? sock->sack_left : 0U );
+	tcph->future_use1 = htonl( (ctrlb & CTRL_SYN) ? sock->rcv_wscale : (ctrlb & CTRL_ACK) ? sock->sack_right : 0U );
+	tcph->future_use2 = htonl( (paysz) ? _tstamp() : (ctrlb & CTRL_ACK) ? sock->ts_recent : 0U );
+	tcph->checksum   = 0U;
+	tcph->checksum   = htonl(_segment_crc(tcph, payld, paysz));
+}
+
+/**
+ * @brief Hash of the sender of a datagram (family, port and address), for the connection table.
+ */
+static uint64_t _addr_hash(const struct sockaddr_storage * addr)
+{
+	const uint8_t * key;
+	uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a
+	size_t len;
+	size_t i;
+
+
+	if ( addr->ss_family == AF_INET6 ) {
+
+		key = (const uint8_t *)(&((const struct sockaddr_in6 *)(addr))->sin6_addr);
+		len = sizeof(struct in6_addr);
+		hash = (hash ^ ((const struct sockaddr_in6 *)(addr))->sin6_port) * 0x100000001b3ULL;
+	}
+	else {
+
+		key = (const uint8_t *)(&((const struct sockaddr_in *)(addr))->sin_addr);
+		len = sizeof(struct in_addr);
+		hash = (hash ^ ((const struct sockaddr_in *)(addr))->sin_port) * 0x100000001b3ULL;
+	}
+
+	for ( i = 0UL; i < len; ++i )
+		hash = (hash ^ key[i]) * 0x100000001b3ULL;
+
+	return hash ^ (hash >> 29);
+}
+
+static int _addr_equal(const struct sockaddr_storage * a, const struct sockaddr_storage * b)
+{
+	const struct sockaddr_in6 * a6 = (const struct sockaddr_in6 *)(a);
+	const struct sockaddr_in6 * b6 = (const struct sockaddr_in6 *)(b);
+	const struct sockaddr_in * a4  = (const struct sockaddr_in *)(a);
+	const struct sockaddr_in * b4  = (const struct sockaddr_in *)(b);
+
+
+	if ( a->ss_family != b->ss_family )
+		return 0;
+
+	if ( a->ss_family == AF_INET6 )
+		return (a6->sin6_port == b6->sin6_port) && !memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+
+	return (a4->sin_port == b4->sin_port) && (a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+}
+
+/**
+ * @brief The slot of the connection table where the connection with 'addr' lives, or the
+ * empty slot where it would be inserted (linear probing).
+ */
+static size_t _conn_slot(const microtcp_listener_t * l, const struct sockaddr_storage * addr)
+{
+	size_t mask = l->conns_len - 1UL;
+	size_t i    = _addr_hash(addr) & mask;
+
+
+	while ( l->conns[i] && !_addr_equal(&l->conns[i]->peer, addr) )
+		i = (i + 1UL) & mask;
+
+	return i;
+}
+
+static int _conn_insert(microtcp_listener_t * l, microtcp_sock_t * sock)
+{
+	microtcp_sock_t ** old = l->conns;
+	size_t old_len = l->conns_len;
+	size_t i;
+
+
+	if ( 4UL * (l->nconns + 1UL) > 3UL * l->conns_len ) {  // keep the load under 3/4
+
+		if ( !(l->conns = calloc(2UL * old_len, sizeof(*l->conns))) ) {
+
+			l->conns = old;
+			errno = ENOMEM;
+			return -(EXIT_FAILURE);
+		}
+
+		l->conns_len = 2UL * old_len;
+
+		for ( i = 0UL; i < old_len; ++i )
+			if ( old[i] )
+				l->conns[_conn_slot(l, &old[i]->peer)] = old[i];
+
+		free(old);
+	}
+
+	l->conns[_conn_slot(l, &sock->peer)] = sock;
+	++l->nconns;
+
+	return EXIT_SUCCESS;
+}
+
+static void _conn_remove(microtcp_listener_t * l, microtcp_sock_t * sock)
+{
+	size_t mask = l->conns_len - 1UL;
+	size_t hole = _conn_slot(l, &sock->peer);
+	size_t i;
+	size_t home;
+
+
+	if ( l->conns[hole] != sock )
+		return;
+
+	l->conns[hole] = NULL;
+	--l->nconns;
+
+	// shift back the entries that probed past the hole
+	for ( i = (hole + 1UL) & mask; l->conns[i]; i = (i + 1UL) & mask ) {
+
+		home = _addr_hash(&l->conns[i]->peer) & mask;
+
+		if ( ((i - home) & mask) >= ((i - hole) & mask) ) {
+
+			l->conns[hole] = l->conns[i];
+			l->conns[i]    = NULL;
+			hole = i;
+		}
+	}
+}
+
+static void _dgram_push(struct microtcp_dgram ** head, struct microtcp_dgram ** tail, struct microtcp_dgram * d)
+{
+	d->next = NULL;
+
+	if ( *tail )
+		(*tail)->next = d;
+	else
+		*head = d;
+
+	*tail = d;
+}
+
+static struct microtcp_dgram * _dgram_pop(struct microtcp_dgram ** head, struct microtcp_dgram ** tail)
+{
+	struct microtcp_dgram * d = *head;
+
+
+	if ( d && !(*head = d->next) )
+		*tail = NULL;
+
+	return d;
+}
+
+static struct microtcp_dgram * _dgram_new(const struct sockaddr_storage * addr, socklen_t addrlen, const uint8_t * data, uint32_t len)
+{
+	struct microtcp_dgram * d;
+
+
+	if ( !(d = malloc(sizeof(*d) + len)) )
+		return NULL;
+
+	memcpy(&d->addr, addr, sizeof(d->addr));
+	memcpy(d->data, data, len);
+	d->addrlen = addrlen;
+	d->len     = len;
+
+	return d;
+}
+
+/**
+ * @brief Wakes the threads waiting in microtcp_listener_accept(). Called with the lock.
+ */
+static void _listener_wake_acceptors(microtcp_listener_t * l)
+{
+	struct microtcp_waiter * w;
+
+
+	for ( w = l->waiters; w; w = w->next )
+		if ( !w->sock )
+			pthread_cond_signal(&w->cond);
+}
+
+/**
+ * @brief Routes a datagram received by a listener: to the queue of the connection of its
+ * sender, or to the backlog if it is a SYN from a new peer. Anything else is dropped.
+ * Called with the lock; the thread waiting for the datagram is woken up.
+ */
+static void _listener_dispatch(microtcp_listener_t * l, const struct sockaddr_storage * addr, socklen_t addrlen,
+						const uint8_t * data, uint32_t len)
+{
+	struct microtcp_dgram * d;
+	microtcp_sock_t * conn;
+
+
+	if ( (conn = l->conns[_conn_slot(l, addr)]) ) {
+
+		if ( (conn->rxq_len < MICROTCP_CONN_RXQ_LEN) && (d = _dgram_new(addr, addrlen, data, len)) ) {
+
+			_dgram_push(&conn->rxq_head, &conn->rxq_tail, d);
+			++conn->rxq_len;
+
+			if ( conn->rxq_waiter )
+				pthread_cond_signal(&conn->rxq_waiter->cond);
+		}
+
+		return;
+	}
+
+	if ( (len < MICROTCP_HEADER_SIZE) || (ntohs(((const microtcp_header_t *)(data))->control) != CTRL_SYN)
+		|| (l->backlog_len >= MICROTCP_LISTEN_BACKLOG) )
+		return;
+
+	for ( d = l->backlog; d; d = d->next )
+		if ( _addr_equal(&d->addr, addr) )  // SYN retransmission
+			return;
+
+	if ( (d = _dgram_new(addr, addrlen, data, len)) ) {
+
+		_dgram_push(&l->backlog, &l->backlog_tail, d);
+		++l->backlog_len;
+		_listener_wake_acceptors(l);
+	}
+}
+
+/**
+ * @brief Reads a batch of datagrams from the socket of a listener, without blocking, and
+ * routes them. Called with the lock, which is dropped for the system call, by the thread
+ * that has set 'reading': 'rx' is its own until it clears it.
+ * 
+ * @return the number of datagrams read, else -1
+ */
+static int _listener_pump(microtcp_listener_t * l)
+{
+	struct microtcp_rxbatch * rx = l->rx;
+	unsigned int i;
+	int count;
+
+
+	for ( i = 0U; i < IO_BATCH; ++i )
+		rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->names[i]);
+
+	pthread_mutex_unlock(&l->lock);
+	count = recvmmsg(l->sd, rx->msgs, IO_BATCH, MSG_DONTWAIT, NULL);
+	pthread_mutex_lock(&l->lock);
+
+	if ( count < 0 )
+		return -(EXIT_FAILURE);
+
+	for ( i = 0U; i < (unsigned int)(count); ++i )
+		_listener_dispatch(l, rx->names + i, rx->msgs[i].msg_hdr.msg_namelen, rx->bufs[i], rx->msgs[i].msg_len);
+
+	return count;
+}
+
+/**
+ * @brief Reads the socket of a listener once, if no other thread is reading it. Called with
+ * the lock.
+ */
+static void _listener_poll(microtcp_listener_t * l)
+{
+	if ( l->reading )
+		return;
+
+	l->reading = 1;
+	_listener_pump(l);
+	l->reading = 0;
+}
+
+/**
+ * @brief Hands the socket of a listener over to one of the threads that wait on it, once
+ * the one that was reading it has stopped. Called with the lock.
+ */
+static void _listener_handoff(microtcp_listener_t * l)
+{
+	if ( !l->reading && l->waiters )
+		pthread_cond_signal(&l->waiters->cond);
+}
+
+/**
+ * @brief Blocks, with the lock of a listener held, until a datagram is queued for 'sock'
+ * (or a SYN is in the backlog, if 'sock' is NULL), 'deadline' passes or 'stopfd' becomes
+ * readable. One of the waiting threads reads the socket and routes what it gets, waking up
+ * the threads it is for; the others sleep until then, or until it is their turn to read.
+ * 
+ * @param deadline absolute time in _now_us() time, UINT64_MAX for none
+ * @param stopfd an eventfd that ends the wait as well (it is not reset), or -1
+ * @return 1 if there is something to take, else 0
+ */
+static int _listener_wait(microtcp_listener_t * l, microtcp_sock_t * sock, uint64_t deadline, int stopfd)
+{
+	struct microtcp_waiter w;
+	pthread_condattr_t attr;
+	struct pollfd pfd[2];
+	struct timespec to;
+	uint64_t now;
+	int ready;
+	int ret;
+
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	w.sock = sock;
+	w.prev = NULL;
+
+	if ( (w.next = l->waiters) )
+		w.next->prev = &w;
+
+	l->waiters = &w;
+
+	if ( sock )
+		sock->rxq_waiter = &w;
+
+	pfd[0].fd     = l->sd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd     = stopfd;
+	pfd[1].events = POLLIN;
+
+	for ( ;; ) {
+
+		if ( (ready = ( sock ) ? ( sock->rxq_len != 0U ) : ( l->backlog != NULL )) )
+			break;
+
+		if ( ((now = _now_us()) >= deadline) || ((stopfd >= 0) && (poll(pfd + 1, 1, 0) > 0)) )
+			break;
+
+		if ( l->reading ) {  // sleep until something is routed here, or the reader stops
+
+			if ( deadline == UINT64_MAX )
+				pthread_cond_wait(&w.cond, &l->lock);
+			else {
+
+				to.tv_sec  = deadline / 1000000UL;
+				to.tv_nsec = (deadline % 1000000UL) * 1000UL;
+				pthread_cond_timedwait(&w.cond, &l->lock, &to);
+			}
+
+			continue;
+		}
+
+		l->reading = 1;
+		pthread_mutex_unlock(&l->lock);
+
+		to.tv_sec  = (deadline - now) / 1000000UL;
+		to.tv_nsec = ((deadline - now) % 1000000UL) * 1000UL;
+		ret = ppoll(pfd, ( stopfd < 0 ) ? 1 : 2, ( deadline == UINT64_MAX ) ? NULL : &to, NULL);
+
+		pthread_mutex_lock(&l->lock);
+
+		if ( (ret > 0) && (pfd[0].revents & POLLIN) )
+			_listener_pump(l);
+
+		l->reading = 0;
+	}
+
+	if ( w.prev )
+		w.prev->next = w.next;
+	else
+		l->waiters = w.next;
+
+	if ( w.next )
+		w.next->prev = w.prev;
+
+	if ( sock )
+		sock->rxq_waiter = NULL;
+
+	_listener_handoff(l);  // if this thread was the reader, somebody else takes over
+	pthread_cond_destroy(&w.cond);
+
+
+	return ready;
+}
+
+/**
+ * @brief Moves up to 'n' datagrams from the queue of a listener connection to 'msgs',
+ * the way recvmmsg() would. Called with the lock.
+ */
+static int _rxq_take(microtcp_sock_t * sock, struct mmsghdr * msgs, unsigned int n)
+{
+	struct microtcp_dgram * d;
+	struct iovec * iov;
+	unsigned int i;
+
+
+	for ( i = 0U; (i < n) && (d = _dgram_pop(&sock->rxq_head, &sock->rxq_tail)); ++i ) {
+
+		iov = msgs[i].msg_hdr.msg_iov;
+		msgs[i].msg_len = MIN2(d->len, iov->iov_len);
+		msgs[i].msg_hdr.msg_flags = ( d->len > iov->iov_len ) ? MSG_TRUNC : 0;
+		memcpy(iov->iov_base, d->data, msgs[i].msg_len);
+
+		--sock->rxq_len;
+		free(d);
+	}
+
+	return i;
+}
+
+/**
+ * @brief Detaches a connection from its listener: no more datagrams are routed to it.
+ */
+static void _listener_detach(microtcp_sock_t * sock)
+{
+	struct microtcp_dgram * d;
+
+
+	if ( !sock->listener )
+		return;
+
+	pthread_mutex_lock(&sock->listener->lock);
+	_conn_remove(sock->listener, sock);
+	pthread_mutex_unlock(&sock->listener->lock);
+
+	while ( (d = _dgram_pop(&sock->rxq_head, &sock->rxq_tail)) )
+		free(d);
+
+	sock->rxq_len  = 0U;
+	sock->listener = NULL;
+	sock->sd       = -1;
+}
+
+/**
+ * @brief recvmmsg() on the socket of a microTCP socket. A listener connection takes
+ * its datagrams from its queue, which the listener fills (see _listener_wait()).
+ * 
+ * @param flags 0 (block for 'n' datagrams, use with n = 1), MSG_WAITFORONE or MSG_DONTWAIT
+ */
+static int _sock_recvmmsg(microtcp_sock_t * sock, struct mmsghdr * msgs, unsigned int n, int flags)
+{
+	microtcp_listener_t * l = sock->listener;
+	int got;
+	int i;
+
+
+	if ( !l )
+		got = recvmmsg(sock->sd, msgs, n, flags, NULL);
+	else {
+
+		pthread_mutex_lock(&l->lock);
+
+		if ( flags & MSG_DONTWAIT )
+			_listener_poll(l);
+		else
+			_listener_wait(l, sock, UINT64_MAX, -1);
+
+		if ( (got = _rxq_take(sock, msgs, n)) && ((unsigned int)(got) < n) && (flags & MSG_WAITFORONE) ) {
+
+			_listener_poll(l);
+			got += _rxq_take(sock, msgs + got, n - got);
+		}
+
+		pthread_mutex_unlock(&l->lock);
+
+		if ( !got ) {
+
+			errno = EAGAIN;
+			return -(EXIT_FAILURE);
+		}
+	}
+
+	for ( i = 0; i < got; ++i )
+		sock->bytes_received += msgs[i].msg_len;
+
+	if ( got > 0 )
+		sock->packets_received += got;
+
+
+	return got;
+}
+
+/**
+ * @brief Blocking recv() of one datagram on a microTCP socket.
+ */
+static ssize_t _sock_recv(microtcp_sock_t * sock, void * buf, size_t len)
+{
+	struct mmsghdr msg;
+	struct iovec iov;
+
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+	msg.msg_hdr.msg_iov    = &iov;
+	msg.msg_hdr.msg_iovlen = 1;
+
+	if ( _sock_recvmmsg(sock, &msg, 1U, 0) < 0 )
+		return -(EXIT_FAILURE);
+
+	if ( msg.msg_len >= MICROTCP_HEADER_SIZE )
+		_trace(sock, MICROTCP_TRACE_RX, buf, 0U);
+
+	return msg.msg_len;
+}
+
+/**
+ * @brief send() of one datagram on a microTCP socket, to the peer of a listener connection.
+ */
+static ssize_t _sock_send(microtcp_sock_t * sock, const void * buf, size_t len)
+{
+	ssize_t ret;
+
+
+	if ( !sock->listener )
+		ret = send(sock->sd, buf, len, 0);
+	else
+		ret = sendto(sock->sd, buf, len, 0, (const struct sockaddr *)(&sock->peer), sock->peer_len);
+
+	if ( ret >= 0 ) {
+
+		++sock->packets_send;
+		sock->bytes_send += ret;
+		_trace(sock, MICROTCP_TRACE_TX, buf, 0U);
+	}
+
+
+	return ret;
+}
+
+/**
+ * @brief Blocks until there is something to read for 'sock', 'wakefd' is signalled or the
+ * 'deadline' (in _now_us() time) passes.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param deadline absolute time in microseconds
+ * @param wakefd an eventfd to watch as well (it is reset), or -1
+ * @return 1 if 'sock' is (probably) readable or 'wakefd' was signalled, 0 on timeout
+ */
+static int _wait_readable(microtcp_sock_t * sock, uint64_t deadline, int wakefd)
+{
+	struct pollfd pfd[2];
+	struct timespec to;
+	uint64_t now = _now_us();
+	eventfd_t ev;
+	int ret;
+
+
+	if ( sock->listener ) {  // asynchronous mode, and 'wakefd', are not supported there
+
+		pthread_mutex_lock(&sock->listener->lock);
+		ret = _listener_wait(sock->listener, sock, deadline, -1);
+		pthread_mutex_unlock(&sock->listener->lock);
+
+		return ret;
+	}
+
+	if ( now >= deadline )
+		return 0;
+
+	pfd[0].fd     = sock->sd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd     = wakefd;
+	pfd[1].events = POLLIN;
+	to.tv_sec  = (deadline - now) / 1000000UL;
+	to.tv_nsec = ((deadline - now) % 1000000UL) * 1000UL;
+
+	if ( ((ret = ppoll(pfd, ( wakefd < 0 ) ? 1 : 2, &to, NULL)) < 0) && (errno == EINTR) )
+		return 1;  // let the caller try again
+
+	check( ret );
+
+	if ( (wakefd >= 0) && (pfd[1].revents & POLLIN) )
+		eventfd_read(wakefd, &ev);
+
+	return ret;
+}
+
+/**
+ * @brief Feeds a round-trip time sample to the retransmission timer estimator (RFC 6298)
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param rtt the sample in microseconds
+ */
+static void _update_rto(microtcp_sock_t *sock, uint32_t rtt)
+{
+	uint32_t delta;
+
+
+	if ( !sock->srtt ) {  // first measurement
+
+		sock->srtt   = MAX2(rtt, 1U);
+		sock->rttvar = rtt / 2U;
+	}
+	else {
+
+		delta = ( sock->srtt > rtt ) ? sock->srtt - rtt : rtt - sock->srtt;
+		sock->rttvar = (3U * sock->rttvar + delta) / 4U;
+		sock->srtt   = MAX2((7U * sock->srtt + rtt) / 8U, 1U);
+	}
+
+	sock->rto = sock->srtt + 4U * sock->rttvar;
+	sock->rto = MAX2(sock->rto, MICROTCP_MIN_RTO_US);
+	sock->rto = MIN2(sock->rto, MICROTCP_MAX_RTO_US);
+}
+
+/**
+ * @brief Points every message of a batch to its own buffer of 'bufsz' bytes.
+ */
+static void _init_batch(struct mmsghdr * __restrict__ msgs, struct iovec * __restrict__ iovs, void * __restrict__ bufs,
+						size_t bufsz)
+{
+	unsigned int i;
+
+
+	memset(msgs, 0, IO_BATCH * sizeof(*msgs));
+
+	for ( i = 0U; i < IO_BATCH; ++i ) {
+
+		iovs[i].iov_base = (uint8_t *)(bufs) + i * bufsz;
+		iovs[i].iov_len  = bufsz;
+
+		msgs[i].msg_hdr.msg_iov    = iovs + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+/**
+ * @brief Points the two iovecs of every message of a transmission batch to the header of
+ * the message and (later) to its payload.
+ */
+static void _init_iov_batch(iov_batch_t * batch)
+{
+	unsigned int i;
+
+
+	memset(batch->msgs, 0, sizeof(batch->msgs));
+
+	for ( i = 0U; i < IO_BATCH; ++i ) {
+
+		batch->iovs[i][0].iov_base = batch->hdrs + i;
+		batch->iovs[i][0].iov_len  = MICROTCP_HEADER_SIZE;
+
+		batch->msgs[i].msg_hdr.msg_iov    = batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	batch->count = 0U;
+}
+
+/**
+ * @brief Sends the first 'count' messages of a batch, with as few sendmmsg() calls as possible.
+ * If the kernel runs out of memory for MSG_ZEROCOPY notifications, the rest of the batch is
+ * sent the ordinary way.
+ * 
+ * @return how many messages were sent with MSG_ZEROCOPY
+ */
+static unsigned int _flush_batch(microtcp_sock_t * sock, struct mmsghdr * msgs, unsigned int * count, int flags)
+{
+	unsigned int zc = 0U;
+	unsigned int sent;
+	unsigned int i;
+	int ret;
+
+
+	if ( sock->listener ) {  // the socket is shared: address every datagram to the peer
+
+		for ( i = 0U; i < *count; ++i ) {
+
+			msgs[i].msg_hdr.msg_name    = &sock->peer;
+			msgs[i].msg_hdr.msg_namelen = sock->peer_len;
+		}
+	}
+
+	for ( sent = 0U; sent < *count; sent += ret ) {
+
+		if ( ((ret = sendmmsg(sock->sd, msgs + sent, *count - sent, flags)) < 0)
+			&& (errno == ENOBUFS) && (flags & MSG_ZEROCOPY) ) {
+
+			flags &= ~MSG_ZEROCOPY;
+			ret = 0;
+			continue;
+		}
+
+		check( ret );
+
+		if ( flags & MSG_ZEROCOPY )
+			zc += ret;
+
+		for ( i = sent; i < sent + (unsigned int)(ret); ++i )
+			sock->bytes_send += msgs[i].msg_len;
+	}
+
+	sock->packets_send += *count;
+	*count = 0U;
+
+
+	return zc;
+}
+
+/**
+ * @brief Reads the MSG_ZEROCOPY completions from the error queue of the socket, without
+ * blocking. Each one releases a range of datagrams, after which the kernel no longer
+ * references their payload.
+ */
+static void _reap_zerocopy(microtcp_sock_t * sock)
+{
+	struct sock_extended_err * serr;
+	struct cmsghdr * cm;
+	struct msghdr msg;
+	uint8_t control[64];
+
+
+	for ( ;; ) {
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		if ( recvmsg(sock->sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 ) {
+
+			if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) )
+				check( -1 );
+
+			if ( errno == EINTR )
+				continue;
+
+			return;
+		}
+
+		for ( cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm) ) {
+
+			if ( !((cm->cmsg_level == SOL_IP) && (cm->cmsg_type == IP_RECVERR))
+				&& !((cm->cmsg_level == SOL_IPV6) && (cm->cmsg_type == IPV6_RECVERR)) )
+				continue;
+
+			serr = (struct sock_extended_err *)(CMSG_DATA(cm));
+
+			if ( (serr->ee_errno == 0) && (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY) )
+				sock->zc_done += serr->ee_data - serr->ee_info + 1U;  // [ee_info, ee_data] released
+		}
+	}
+}
+
+/**
+ * @brief Blocks until the kernel has released every datagram sent with MSG_ZEROCOPY, so
+ * that the caller may modify the buffer again.
+ */
+static void _drain_zerocopy(microtcp_sock_t * sock)
+{
+	struct pollfd pfd;
+
+
+	pfd.fd     = sock->sd;
+	pfd.events = 0;  // POLLERR is always reported
+
+	for ( _reap_zerocopy(sock); sock->zc_done != sock->zc_sent; _reap_zerocopy(sock) )
+		if ( (poll(&pfd, 1, -1) < 0) && (errno != EINTR) )
+			check( -1 );
+}
+
+/**
+ * @brief Adds the 'seglen' bytes of 'buffer' starting at sequence number 'seq' to the
+ * transmission batch, sending the batch first if it is full. The segment is marked with
+ * FRAGMENT, unless it carries the last byte of the message.
+ * 
+ * @param sock a valid microTCP socket handle
+ * @param batch the transmission batch
+ * @param payld the payload
+ * @param seq sequence number of the first byte of the segment
+ * @param seglen payload size (at most the MSS of the socket)
+ * @param eom whether the segment ends a message (else it is marked FRAGMENT)
+ * @param flags sendmmsg() flags (0 or MSG_ZEROCOPY)
+ * @return the header of the segment
+ */
+static const microtcp_header_t * _queue_segment(microtcp_sock_t * __restrict__ sock, iov_batch_t * __restrict__ batch,
+						const uint8_t * __restrict__ payld, uint32_t seq, uint32_t seglen, int eom, int flags)
+{
+	microtcp_header_t * tcph;
+	struct iovec * iov;
+
+
+	if ( batch->count == IO_BATCH )
+		sock->zc_sent += _flush_batch(sock, batch->msgs, &batch->count, flags);
+
+	tcph = batch->hdrs + batch->count;
+
+	if ( flags & MSG_ZEROCOPY ) {  // the header is sent by reference too: it must outlive the batch
+
+		if ( sock->zc_slot == ZC_HDR_SLOTS ) {
+
+			sock->zc_sent += _flush_batch(sock, batch->msgs, &batch->count, flags);
+			_drain_zerocopy(sock);
+			sock->zc_slot = 0U;
+		}
+
+		tcph = sock->zc_hdrs + sock->zc_slot++;
+	}
+
+	_preapre_send_tcph(sock, tcph, seq, ( eom ) ? CTRL_XXX : FRAGMENT, payld, seglen);
+
+	iov = batch->iovs[batch->count++];
+	iov[0].iov_base = tcph;
+	iov[1].iov_base = (void *)(payld);
+	iov[1].iov_len  = seglen;
+
+	return tcph;
+}
+
+/**
+ * @brief Sets (or clears) the bits [from, from + n) of 'map'. The range must not wrap.
+ */
+static void _bitmap_fill(uint64_t * map, uint32_t from, uint32_t n, int set)
+{
+	uint64_t mask;
+	uint32_t bit;
+	uint32_t cnt;
+
+
+	while ( n ) {
+
+		bit  = from & 63U;
+		cnt  = MIN2(64U - bit, n);
+		mask = ( cnt == 64U ) ? ~0ULL : ( ((1ULL << cnt) - 1ULL) << bit );
+
+		if ( set )
+			map[from >> 6] |= mask;
+		else
+			map[from >> 6] &= ~mask;
+
+		from += cnt;
+		n    -= cnt;
+	}
+}
+
+/**
+ * @brief Finds the first bit of 'map' in [from, from + n) that is set (or clear). The range
+ * must not wrap.
+ * 
+ * @return the offset of the bit from 'from', or 'n' if there is no such bit
+ */
+static uint32_t _bitmap_scan(const uint64_t * map, uint32_t from, uint32_t n, int set)
+{
+	uint64_t word;
+	uint32_t off;
+	uint32_t bit;
+
+
+	for ( off = 0U; off < n; off += 64U - bit ) {
+
+		bit  = (from + off) & 63U;
+		word = map[(from + off) >> 6];
+		word = ( ( set ) ? word : ~word ) >> bit;
+
+		if ( word )
+			return MIN2(off + (uint32_t)(__builtin_ctzll(word)), n);
+	}
+
+	return n;
+}
+
+/**
+ * @brief Same as _bitmap_fill() but the range is given in sequence numbers and may wrap
+ * around the end of the receive ring.
+ */
+static void _ring_fill(const microtcp_sock_t * sock, uint64_t * map, uint32_t seq, uint32_t n, int set)
+{
+	uint32_t pos = seq & (sock->rcvbuf_len - 1U);
+	uint32_t cnt = MIN2(n, sock->rcvbuf_len - pos);
+
+
+	_bitmap_fill(map, pos, cnt, set);
+	_bitmap_fill(map, 0U, n - cnt, set);
+}
+
+/**
+ * @brief Same as _bitmap_scan() but the range is given in sequence numbers and may wrap
+ * around the end of the receive ring.
+ */
+static uint32_t _ring_scan(const microtcp_sock_t * sock, const uint64_t * map, uint32_t seq, uint32_t n, int set)
+{
+	uint32_t pos = seq & (sock->rcvbuf_len - 1U);
+	uint32_t cnt = MIN2(n, sock->rcvbuf_len - pos);
+	uint32_t off;
+
+
+	if ( (off = _bitmap_scan(map, pos, cnt, set)) < cnt )
+		return off;
+
+	return cnt + _bitmap_scan(map, 0U, n - cnt, set);
+}
+
+/**
+ * @brief Copies 'n' bytes from/to the receive ring, starting at sequence number 'seq'.
+ */
+static void _ring_copy(microtcp_sock_t * __restrict__ sock, uint32_t seq, void * __restrict__ data, uint32_t n, int to_ring)
+{
+	uint32_t pos = seq & (sock->rcvbuf_len - 1U);
+	uint32_t cnt = MIN2(n, sock->rcvbuf_len - pos);
+
+
+	if ( to_ring ) {
+
+		memcpy(sock->recvbuf + pos, data, cnt);
+		memcpy(sock->recvbuf, (uint8_t *)(data) + cnt, n - cnt);
+	}
+	else {
+
+		memcpy(data, sock->recvbuf + pos, cnt);
+		memcpy((uint8_t *)(data) + cnt, sock->recvbuf, n - cnt);
+	}
+}
+
+/**
+ * @brief Moves 'ack_number' over the bytes that were received out of order and have
+ * just become contiguous.
+ */
+static void _advance_ack(microtcp_sock_t *socket)
+{
+	uint32_t limit = socket->rcv_head + socket->rcvbuf_len - socket->ack_number;
+	uint32_t run   = _ring_scan(socket, socket->rcvmap, socket->ack_number, limit, 0);
+
+
+	_ring_fill(socket, socket->rcvmap, socket->ack_number, run, 0);
+	socket->ack_number     += run;
+	socket->buf_fill_level += run;
+}
+
+/**
+ * @brief Stores a data segment into the receive ring. Bytes that fall outside of the
+ * window, or that were already received in order, are dropped.
+ * 
+ * @param socket a valid microTCP socket handle
+ * @param tcph received header (host-byte-order)
+ * @param payld the payload of the segment
+ */
+static void _update_recv_buf(microtcp_sock_t * __restrict__ socket, const microtcp_header_t * __restrict__ tcph,
+						const uint8_t * __restrict__ payld)
+{
+	uint32_t seq = tcph->seq_number;
+	uint32_t end = tcph->seq_number + tcph->data_len;
+	uint32_t wnd_end = socket->rcv_head + socket->rcvbuf_len;
+
+
+	if ( SEQ_LT(seq, socket->ack_number) ) {
+
+		payld += (uint32_t)(socket->ack_number - seq);
+		seq    = socket->ack_number;
+	}
+
+	if ( SEQ_GT(end, wnd_end) )
+		end = wnd_end;
+
+	if ( SEQ_GEQ(seq, end) )  // duplicate or no room
+		return;
+
+	_ring_copy(socket, seq, (void *)(payld), end - seq, 1);
+	_ring_fill(socket, socket->rcvmap, seq, end - seq, 1);
+
+	if ( !(tcph->control & FRAGMENT) && (end == tcph->seq_number + tcph->data_len) )
+		_ring_fill(socket, socket->eommap, end - 1U, 1U, 1);
+
+	if ( SEQ_GT(end, socket->rcv_high) )
+		socket->rcv_high = end;
+
+	_advance_ack(socket);
+}
+
+/**
+ * @brief Picks the SACK block that is reported with the next ACK: the block that contains
+ * 'seq' (the segment that was just received), else the lowest block above 'ack_number'.
+ * An empty block (left == right) means that nothing is held out of order.
+ * 
+ * @param socket a valid microTCP socket handle
+ * @param seq sequence number of the last received segment
+ */
+static void _update_sack(microtcp_sock_t *socket, uint32_t seq)
+{
+	uint32_t limit;
+	uint32_t left;
+	uint32_t run;
+
+
+	socket->sack_left  = socket->ack_number;
+	socket->sack_right = socket->ack_number;
+
+	if ( SEQ_LEQ(socket->rcv_high, socket->ack_number) )
+		return;
+
+	limit = socket->rcv_high;
+	left  = socket->ack_number;
+
+	while ( SEQ_LT(left, limit) ) {
+
+		left += _ring_scan(socket, socket->rcvmap, left, limit - left, 1);
+
+		if ( !SEQ_LT(left, limit) )
+			break;
+
+		run = _ring_scan(socket, socket->rcvmap, left, limit - left, 0);
+
+		if ( (socket->sack_left == socket->sack_right) || (SEQ_GEQ(seq, left) && SEQ_LT(seq, left + run)) ) {
+
+			socket->sack_left  = left;
+			socket->sack_right = left + run;
+
+			if ( SEQ_GEQ(seq, left) )
+				return;
+		}
+
+		left += run;
+	}
+}
+
+/**
+ * @brief Queues a cumulative ACK (with the SACK block and the echoed timestamp) in 'tx'. It
+ * acknowledges the delayed segments too.
+ */
+static void _queue_ack(microtcp_sock_t * __restrict__ sock, hdr_batch_t * __restrict__ tx, uint16_t control)
+{
+	_preapre_send_tcph(sock, tx->hdrs + tx->count, sock->seq_number, control, NULL, 0U);
+	_trace(sock, MICROTCP_TRACE_TX, tx->hdrs + tx->count++, 0U);
+	sock->ack_pending = 0U;
+}
+
+/**
+ * @brief Adds the range [left, right) to the SACK scoreboard of the sender, keeping it
+ * sorted and merging overlapping blocks. If the scoreboard is full the block is ignored.
+ */
+static void _sack_add(sack_block_t * sb, uint32_t * n, uint32_t left, uint32_t right)
+{
+	uint32_t i;
+	uint32_t j;
+
+
+	for ( i = 0U; (i < *n) && SEQ_LT(sb[i].right, left); ++i )
+		;
+
+	if ( (i < *n) && SEQ_LEQ(sb[i].left, right) ) {  // overlaps or touches sb[i]
+
+		if ( SEQ_LT(left, sb[i].left) )
+			sb[i].left = left;
+
+		if ( SEQ_GT(right, sb[i].right) )
+			sb[i].right = right;
+
+		// swallow the blocks that the grown one now covers
+		for ( j = i + 1U; (j < *n) && SEQ_LEQ(sb[j].left, sb[i].right); ++j )
+			if ( SEQ_GT(sb[j].right, sb[i].right) )
+				sb[i].right = sb[j].right;
+
+		memmove(sb + i + 1U, sb + j, (*n - j) * sizeof(*sb));
+		*n -= j - i - 1U;
+
+		return;
+	}
+
+	if ( *n == SACK_MAX_BLOCKS )
+		return;
+
+	memmove(sb + i + 1U, sb + i, (*n - i) * sizeof(*sb));
+	sb[i].left  = left;
+	sb[i].right = right;
+	++*n;
+}
+
+/**
+ * @brief Drops from the scoreboard everything below the cumulative ACK 'una'.
+ */
+static void _sack_trim(sack_block_t * sb, uint32_t * n, uint32_t una)
+{
+	uint32_t i;
+
+
+	for ( i = 0U; (i < *n) && SEQ_LEQ(sb[i].right, una); ++i )
+		;
+
+	memmove(sb, sb + i, (*n - i) * sizeof(*sb));
+	*n -= i;
+
+	if ( *n && SEQ_LT(sb[0].left, una) )
+		sb[0].left = una;
+}
+
+/**
+ * @brief Finds the first byte at or after 'seq' that the peer has not SACKed.
+ * 
+ * @param hole_end in: where the search stops, out: the end of the hole (the next SACKed
+ * byte, or the given bound)
+ * @return the sequence number of the first byte not SACKed
+ */
+static uint32_t _sack_next_hole(const sack_block_t * sb, uint32_t n, uint32_t seq, uint32_t * hole_end)
+{
+	uint32_t i;
+
+
+	for ( i = 0U; (i < n) && SEQ_LEQ(sb[i].left, seq); ++i )
+		if ( SEQ_LT(seq, sb[i].right) )
+			seq = sb[i].right;
+
+	if ( (i < n) && SEQ_LT(sb[i].left, *hole_end) )
+		*hole_end = sb[i].left;
+
+	return seq;
+}
+
+/**
+ * @brief The number of SACKed bytes in [from, to).
+ */
+static uint32_t _sack_bytes(const sack_block_t * sb, uint32_t n, uint32_t from, uint32_t to)
+{
+	uint32_t bytes = 0U;
+	uint32_t left;
+	uint32_t right;
+	uint32_t i;
+
+
+	for ( i = 0U; i < n; ++i ) {
+
+		left  = SEQ_GT(sb[i].left, from) ? sb[i].left : from;
+		right = SEQ_LT(sb[i].right, to) ? sb[i].right : to;
+
+		if ( SEQ_LT(left, right) )
+			bytes += right - left;
+	}
+
+	return bytes;
+}
+
+/**
+ * @brief Moves in-order data from the receive ring to the application buffer. Never
+ * crosses a message boundary.
+ * 
+ * @param eom set to non zero, if the last byte delivered ends a message
+ * @return the number of bytes delivered
+ */
+static size_t _deliver_recv_buf(microtcp_sock_t * __restrict__ socket, uint8_t * __restrict__ buffer, size_t length,
+						int * __restrict__ eom)
+{
+	uint32_t n = MIN2(socket->buf_fill_level, length);
+	uint32_t off;
+
+
+	if ( (off = _ring_scan(socket, socket->eommap, socket->rcv_head, n, 1)) < n ) {
+
+		n = off + 1U;
+		_ring_fill(socket, socket->eommap, socket->rcv_head + off, 1U, 0);
+		*eom = 1;
+	}
+	else
+		*eom = 0;
+
+	_ring_copy(socket, socket->rcv_head, buffer, n, 0);
+	socket->rcv_head       += n;
+	socket->buf_fill_level -= n;
+
+	return n;
+}
+
+static void _free_recv_buf(microtcp_sock_t *socket)
+{
+	free(socket->recvbuf);
+	free(socket->rcvmap);
+	free(socket->eommap);
+	free(socket->segbufs);
+	free(socket->msgs);
+
+	socket->recvbuf = NULL;
+	socket->rcvmap  = NULL;
+	socket->eommap  = NULL;
+	socket->segbufs = NULL;
+	socket->msgs    = NULL;
+	socket->msg_head = socket->msg_tail = 0U;
+}
+
+/**
+ * @brief Largest payload that fits the MTU of the route to the peer, as far as the local
+ * host knows (the MTU of the interface, or a lower one learnt from ICMP), and at most
+ * MICROTCP_MAX_MSS.
+ */
+static uint32_t _route_mss(microtcp_sock_t * sock)
+{
+	struct sockaddr_storage local;
+	socklen_t len = sizeof(local);
+	socklen_t mtulen = sizeof(int);
+	uint32_t overhead;
+	int mtu = 0;
+	int fd = sock->sd;
+	int ret;
+
+
+	if ( getsockname(sock->sd, (struct sockaddr *)(&local), &len) )
+		return MICROTCP_MSS;
+
+	if ( sock->listener ) {  // 'sd' is not connected: ask a socket that is
+
+		if ( (fd = socket(local.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 )
+			return MICROTCP_MSS;
+
+		if ( connect(fd, (const struct sockaddr *)(&sock->peer), sock->peer_len) ) {
+
+			close(fd);
+			return MICROTCP_MSS;
+		}
+	}
+
+	if ( local.ss_family == AF_INET6 ) {
+
+		ret      = getsockopt(fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &mtulen);
+		overhead = 40U + 8U + MICROTCP_HEADER_SIZE;
+	}
+	else {
+
+		ret      = getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &mtulen);
+		overhead = 20U + 8U + MICROTCP_HEADER_SIZE;
+	}
+
+	if ( fd != sock->sd )
+		close(fd);
+
+	if ( ret || ((uint32_t)(mtu) <= overhead) )
+		return MICROTCP_MSS;
+
+	return MIN2((uint32_t)(mtu) - overhead, MICROTCP_MAX_MSS);
+}
+
+/**
+ * @brief Sets the MSS of a socket at the handshake: what it advertises (to be called before
+ * the SYN or SYN-ACK is built) and, once 'peer_mss' is known, what it sends. Segments start
+ * at MICROTCP_MSS at most; PMTU probes raise the MSS up to the smallest of both routes' MTUs.
+ *
+ * @param peer_mss the MSS advertised by the peer, 0 if not known yet or not advertised
+ */
+static void _init_mss(microtcp_sock_t * sock, uint32_t peer_mss)
+{
+	uint32_t route = _route_mss(sock);
+
+
+	sock->rcv_mss = MIN2(route, sock->rcvbuf_len / 4U);  // a window holds a few segments
+
+	if ( !peer_mss )
+		peer_mss = MICROTCP_MSS;
+
+	sock->mss_max     = MIN2(route, peer_mss);
+	sock->mss_hi      = sock->mss_max;
+	sock->mss         = MIN2(MICROTCP_MSS, sock->mss_max);
+	sock->probe_size  = 0U;
+	sock->probe_fails = 0U;
+	sock->cwnd        = MAX2(MICROTCP_INIT_CWND, 2UL * sock->mss);
+}
+
+/**
+ * @brief Size of the next PMTU probe, 0 if the search is over. The first probe tries the
+ * largest size at once; after a failure the search is a bisection between the MSS (known
+ * to work) and the largest size not known to fail.
+ */
+static uint32_t _pmtu_probe_size(const microtcp_sock_t * sock)
+{
+	if ( sock->mss_hi < sock->mss + MICROTCP_PMTU_STEP )
+		return 0U;
+
+	if ( sock->mss_hi == sock->mss_max )
+		return sock->mss_hi;
+
+	return (sock->mss + sock->mss_hi + 1U) / 2U;
+}
+
+/**
+ * @brief The PMTU probe in flight was acknowledged ('ok') or lost. A size is given up after
+ * MICROTCP_PMTU_PROBES losses, since a probe may be lost to congestion as well.
+ */
+static void _pmtu_probe_done(microtcp_sock_t * sock, int ok)
+{
+	if ( ok ) {
+
+		LOG_DEBUG("PMTU probe of %u bytes acknowledged\n", sock->probe_size);
+
+		sock->mss         = sock->probe_size;
+		sock->probe_fails = 0U;
+	}
+	else if ( ++sock->probe_fails >= MICROTCP_PMTU_PROBES ) {
+
+		sock->mss_hi      = sock->probe_size - 1U;
+		sock->probe_fails = 0U;
+	}
+
+	sock->probe_size = 0U;
+}
+
+/**
+ * @brief Starts a transfer: nothing in flight and an empty scoreboard.
+ * 
+ * @param st the state to initialize
+ * @param sock a valid microTCP socket handle
+ * @param buf the data, see snd_state_t
+ * @param mask see snd_state_t
+ * @param eom see snd_state_t
+ * @param base sequence number of buf[0]
+ * @param una sequence number of the first byte to be sent
+ * @param txflags sendmmsg() flags (0 or MSG_ZEROCOPY)
+ */
+static void _snd_init(snd_state_t * __restrict__ st, microtcp_sock_t * __restrict__ sock, const uint8_t * buf,
+						uint32_t mask, const uint64_t * eom, uint32_t base, uint32_t una, int txflags)
+{
+	st->buf      = buf;
+	st->mask     = mask;
+	st->eom      = eom;
+	st->txflags  = txflags;
+	st->more     = 0;
+	st->nsacked  = 0U;
+	st->base     = base;
+	st->end      = una;
+	st->una      = una;
+	st->nxt      = una;
+	st->max      = una;
+	st->recover  = una;
+	st->rtx_nxt  = una;
+	st->nak_nxt  = una;
+	st->dacks    = 0UL;
+	st->deadline = _now_us() + sock->rto;
+	st->pace_next = 0UL;
+	st->paced     = 0;
+
+	_init_iov_batch(&st->tx);
+	_init_batch(st->rx.msgs, st->rx.iovs, st->rx.hdrs, sizeof(st->rx.hdrs[0]));
+}
+
+/**
+ * @brief Queues the segment that starts at 'seq', of up to 'seglen' bytes. It is cut short
+ * at the end of the ring and at the end of a message, so that a segment never spans two.
+ * 
+ * @return the payload size of the segment
+ */
+static uint32_t _snd_segment(microtcp_sock_t * __restrict__ sock, snd_state_t * __restrict__ st, uint32_t seq, uint32_t seglen)
+{
+	uint32_t off = (uint32_t)(seq - st->base) & st->mask;
+	uint32_t eom;
+	int last;
+	int rtx;
+
+
+	seglen = MIN2(seglen, (uint64_t)(st->mask) + 1UL - off);
+
+	if ( st->eom ) {
+
+		eom    = _bitmap_scan(st->eom, off, seglen, 1);
+		last   = ( eom < seglen );
+		seglen = ( last ) ? eom + 1U : seglen;
+	}
+	else
+		last = ( !st->more && (seq + seglen == st->end) );
+
+	rtx = SEQ_LT(seq, st->max);
+
+	if ( rtx ) {
+
+		++sock->packets_lost;
+		sock->bytes_lost += seglen;
+	}
+
+	if ( sock->probe_size && (seq == sock->probe_seq) )  // the probe is resent: it was lost
+		_pmtu_probe_done(sock, 0);
+
+	_trace(sock, ( rtx ) ? MICROTCP_TRACE_RTX : MICROTCP_TRACE_TX,
+		_queue_segment(sock, &st->tx, st->buf + off, seq, seglen, last, st->txflags), 0U);
+
+	return seglen;
+}
+
+/**
+ * @brief Keeps the pipe full: queues the holes first, then new segments, while there is room
+ * in the window (and, if the congestion control paces, while they are due), and sends them.
+ */
+static void _snd_fill(microtcp_sock_t * __restrict__ sock, snd_state_t * __restrict__ st)
+{
+	uint32_t high;      // highest SACKed byte
+	uint32_t seq;
+	uint32_t hole_end;
+	uint32_t probe;
+	uint64_t pipe;      // estimation of the bytes in the network
+	uint64_t room;
+	uint64_t seglen;
+	uint64_t rate = ( sock->cc->pacing_rate ) ? sock->cc->pacing_rate(sock) : 0UL;
+	uint64_t now  = _now_us();
+
+
+	st->paced = 0;
+
+	for ( ;; ) {
+
+		if ( rate && (st->pace_next > now + MICROTCP_PACING_QUANTUM_US) ) {  // sent a quantum ahead of the rate
+
+			st->paced = 1;
+			break;
+		}
+
+		high = ( st->nsacked ) ? st->sacked[st->nsacked - 1U].right : st->una;
+
+		if ( st->dacks >= DUP_ACK_THRESHOLD ) {  // fast recovery: every hole below 'high' is lost
+
+			// without SACK information, the segment right after the cumulative ACK is lost
+			if ( SEQ_LT(high, st->una + sock->mss) )
+				high = SEQ_LT(st->una + sock->mss, st->max) ? st->una + sock->mss : st->max;
+
+			pipe = (uint32_t)(st->max - high)
+					+ (uint32_t)(st->rtx_nxt - st->una) - _sack_bytes(st->sacked, st->nsacked, st->una, st->rtx_nxt);
+
+			hole_end = high;
+			seq      = _sack_next_hole(st->sacked, st->nsacked, st->rtx_nxt, &hole_end);
+
+			if ( SEQ_LT(seq, high) ) {
+
+				seglen = MIN2(sock->mss, (uint32_t)(hole_end - seq));
+
+				if ( pipe + seglen > sock->cwnd )
+					break;
+
+				seglen      = _snd_segment(sock, st, seq, seglen);
+				st->rtx_nxt = seq + seglen;
+
+				if ( rate )
+					st->pace_next = MAX2(st->pace_next, now) + seglen * 1000000UL / rate;
+
+				continue;
+			}
+		}
+		else
+			pipe = (uint32_t)(st->nxt - st->una) - _sack_bytes(st->sacked, st->nsacked, st->una, st->nxt);
+
+		// new data (or data not SACKed, after a timeout)
+		hole_end = st->end;
+		st->nxt  = _sack_next_hole(st->sacked, st->nsacked, st->nxt, &hole_end);
+
+		if ( !SEQ_LT(st->nxt, st->end) )
+			break;
+
+		seglen = MIN2(sock->mss, (uint32_t)(hole_end - st->nxt));
+		room   = ( sock->cwnd > pipe ) ? sock->cwnd - pipe : 0UL;
+
+		if ( (uint32_t)(st->nxt - st->una) < sock->sendbuflen )
+			room = MIN2(room, sock->sendbuflen - (uint32_t)(st->nxt - st->una));
+		else
+			room = 0UL;
+
+		if ( seglen > room ) {
+
+			if ( pipe )
+				break;
+
+			seglen = MAX2(room, 1UL);  // window probe
+		}
+
+		// new data may carry a PMTU probe, if the window has room for it
+		probe = ( !sock->probe_size && (st->nxt == st->max) ) ? _pmtu_probe_size(sock) : 0U;
+
+		if ( probe && ((uint32_t)(hole_end - st->nxt) >= probe) && (room >= probe) )
+			seglen = probe;
+
+		seglen = _snd_segment(sock, st, st->nxt, seglen);
+
+		if ( probe && (seglen == probe) ) {
+
+			LOG_DEBUG("PMTU probe %u:%u\n", st->nxt, probe);
+
+			sock->probe_seq  = st->nxt;
+			sock->probe_size = probe;
+		}
+
+		st->nxt += seglen;
+
+		if ( SEQ_GT(st->nxt, st->max) )
+			st->max = st->nxt;
+
+		if ( rate )
+			st->pace_next = MAX2(st->pace_next, now) + seglen * 1000000UL / rate;
+	}
+
+	sock->zc_sent += _flush_batch(sock, st->tx.msgs, &st->tx.count, st->txflags);
+
+	if ( sock->zc_done != sock->zc_sent )
+		_reap_zerocopy(sock);  // otherwise the pending completions keep waking up ppoll()
+}
+
+/**
+ * @brief The retransmission timer expired: backs off and goes back to the oldest
+ * unacknowledged byte.
+ */
+static void _snd_timeout(microtcp_sock_t * __restrict__ sock, snd_state_t * __restrict__ st)
+{
+	uint64_t pipe;
+
+
+	++sock->timeouts;
+	_trace(sock, MICROTCP_TRACE_TIMEOUT, NULL, st->una);
+
+	sock->rto    = MIN2(2U * sock->rto, MICROTCP_MAX_RTO_US);  // exponential backoff
+	st->deadline = _now_us() + sock->rto;
+
+	pipe = (uint32_t)(st->max - st->una) - _sack_bytes(st->sacked, st->nsacked, st->una, st->max);
+	sock->cc->on_rto(sock, pipe);
+
+	st->nxt     = st->una;  // resend whatever was not SACKed
+	st->nak_nxt = st->una;
+	st->recover = st->max;
+	st->dacks   = 0UL;
+}
+
+/**
+ * @brief Processes a batch of ACKs: RTT samples, SACK blocks, the window, duplicate ACKs
+ * and NAKs. The congestion control module sees every ACK that slides the window, every
+ * fast retransmit and every timeout.
+ * 
+ * @param count the number of datagrams in st->rx
+ */
+static void _snd_acks(microtcp_sock_t * __restrict__ sock, snd_state_t * __restrict__ st, int64_t count)
+{
+	microtcp_header_t tcph;
+	int64_t index;
+	uint32_t seq;
+	uint32_t hole_end;
+	uint64_t now = _now_us();
+	uint64_t pipe;
+	uint64_t seglen;
+	uint32_t rtt;
+	microtcp_cc_sample_t rs;
+
+
+	for ( index = 0L; index < count; ++index ) {
+
+		tcph = st->rx.hdrs[index];
+
+		print_tcp_header(sock, &tcph);
+
+		if ( !_valid_segment(&tcph, NULL, (int64_t)(st->rx.msgs[index].msg_len) - (int64_t)(MICROTCP_HEADER_SIZE)) ) {
+
+			++sock->checksum_errors;
+			_trace(sock, MICROTCP_TRACE_BAD_CSUM, &tcph, 0U);
+			continue;  // damaged ACK: the next one carries the same information
+		}
+
+		_trace(sock, MICROTCP_TRACE_RX, &tcph, 0U);
+
+		_ntoh_recvd_tcph(tcph);
+
+		if ( !(tcph.control & CTRL_ACK) )
+			continue;
+
+		rtt = 0U;
+
+		if ( tcph.future_use2 && !(tcph.control & CTRL_NAK) ) {  // echoed timestamp: exact even for retransmissions
+
+			rtt = MAX2((uint32_t)(now) - tcph.future_use2, 1U);
+			_update_rto(sock, rtt);
+		}
+
+		sock->sendbuflen = (size_t)(tcph.window) << sock->snd_wscale;
+
+		if ( SEQ_LT(tcph.future_use0, tcph.future_use1) && SEQ_GT(tcph.future_use0, st->una)
+			&& SEQ_LEQ(tcph.future_use1, st->max) )
+			_sack_add(st->sacked, &st->nsacked, tcph.future_use0, tcph.future_use1);
+
+		if ( SEQ_GT(tcph.ack_number, st->una) && SEQ_LEQ(tcph.ack_number, st->max) ) {  // window slides
+
+			rs.now         = now;
+			rs.acked       = (uint32_t)(tcph.ack_number - st->una);
+			rs.rtt         = rtt;
+			rs.in_recovery = 0;
+			rs.recovered   = 0;
+
+			st->una      = tcph.ack_number;
+			st->deadline = now + sock->rto;  // restart the timer
+			_sack_trim(st->sacked, &st->nsacked, st->una);
+
+			if ( sock->probe_size && SEQ_GEQ(st->una, sock->probe_seq + sock->probe_size) )
+				_pmtu_probe_done(sock, 1);
+
+			if ( SEQ_LT(st->nxt, st->una) )
+				st->nxt = st->una;
+
+			if ( SEQ_LT(st->rtx_nxt, st->una) )
+				st->rtx_nxt = st->una;
+
+			if ( st->dacks >= DUP_ACK_THRESHOLD ) {  // fast recovery
+
+				rs.recovered   = SEQ_GEQ(st->una, st->recover);
+				rs.in_recovery = !rs.recovered;
+
+				if ( rs.recovered )
+					st->dacks = 0UL;
+			}
+			else
+				st->dacks = 0UL;
+
+			rs.inflight = (uint32_t)(st->nxt - st->una) - _sack_bytes(st->sacked, st->nsacked, st->una, st->nxt);
+			sock->cc->on_ack(sock, &rs);
+		}
+		else if ( (tcph.ack_number == st->una) && SEQ_LT(st->una, st->max) && !tcph.data_len
+				&& !(tcph.control & CTRL_NAK) ) {  // duplicate ACK
+
+			++sock->dup_acks;
+
+			if ( ++st->dacks == DUP_ACK_THRESHOLD ) {  // Fast Retransmit
+
+				_trace(sock, MICROTCP_TRACE_FAST_RTX, NULL, st->una);
+
+				pipe = (uint32_t)(st->max - st->una) - _sack_bytes(st->sacked, st->nsacked, st->una, st->max);
+				sock->cc->on_loss(sock, pipe);
+
+				st->recover = st->max;
+				st->rtx_nxt = st->una;
+			}
+		}
+
+		if ( (tcph.control & CTRL_NAK) && SEQ_LT(st->una, st->nxt) ) {
+
+			/* a segment was damaged, not lost to congestion: resend the next hole now,
+			   without touching the congestion window */
+			if ( SEQ_LT(st->nak_nxt, st->una) )
+				st->nak_nxt = st->una;
+
+			hole_end = st->nxt;
+			seq      = _sack_next_hole(st->sacked, st->nsacked, st->nak_nxt, &hole_end);
+
+			if ( SEQ_LT(seq, st->nxt) ) {
+
+				seglen      = MIN2(sock->mss, (uint32_t)(hole_end - seq));
+				st->nak_nxt = seq + _snd_segment(sock, st, seq, seglen);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Processes every ACK that is already queued; if there is none, waits for one until
+ * the retransmission timer expires (and handles the timeout), the next paced segment is due
+ * or 'wakefd' is signalled.
+ * 
+ * @param wakefd see _wait_readable()
+ */
+static void _snd_poll(microtcp_sock_t * __restrict__ sock, snd_state_t * __restrict__ st, int wakefd)
+{
+	uint64_t wake;
+	int64_t ret;
+
+
+	ret = _sock_recvmmsg(sock, st->rx.msgs, IO_BATCH, MSG_DONTWAIT);
+
+	if ( ret < 0 ) {
+
+		if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) )
+			check( ret );
+
+		// wake up for the next paced segment as well
+		wake = ( st->paced ) ? MIN2(st->deadline, st->pace_next - MICROTCP_PACING_QUANTUM_US) : st->deadline;
+
+		if ( !_wait_readable(sock, wake, wakefd) && (_now_us() >= st->deadline) )
+			_snd_timeout(sock, st);
+
+		return;
+	}
+
+	_snd_acks(sock, st, ret);
+}
+
+/**
+ * @brief How far a corked asynchronous socket may send (Nagle): full segments, and the
+ * tail only once nothing is unacknowledged, or once it is flushed. The byte before the
+ * point the tail is released at is marked as the end of a message. Called with the lock.
+ */
+static uint32_t _async_nagle(microtcp_sock_t * __restrict__ sock, snd_state_t * __restrict__ st,
+						struct microtcp_async * __restrict__ as)
+{
+	uint32_t full = st->max + (uint32_t)(as->end - st->max) / sock->mss * sock->mss;
+	uint32_t to;
+
+
+	if ( (st->una == st->max) || as->stop )
+		to = as->end;
+	else if ( SEQ_GT(as->push, full) )
+		to = as->push;
+	else
+		to = full;
+
+	if ( SEQ_LEQ(to, st->end) )  // what was released once stays so
+		return st->end;
+
+	if ( (to == as->end) || (to == as->push) )
+		_bitmap_fill(as->eom, (to - 1U - as->base) & as->mask, 1U, 1);
+
+	return to;
+}
+
+/**
+ * @brief Body of the thread of an asynchronous socket: sends whatever the application
+ * queues in the ring, and frees the ring as the peer acknowledges it.
+ */
+static void * _async_main(void * arg)
+{
+	microtcp_sock_t * sock = arg;
+	struct microtcp_async * as = sock->async;
+	snd_state_t * st;
+	struct pollfd pfd;
+	eventfd_t ev;
+	int stop;
+
+
+	check( (st = malloc(sizeof(*st))) ? 0 : -1 );
+
+	pthread_mutex_lock(&as->lock);
+	_snd_init(st, sock, as->ring, as->mask, as->eom, as->base, as->una, 0);
+	pthread_mutex_unlock(&as->lock);
+
+	for ( ;; ) {
+
+		pthread_mutex_lock(&as->lock);
+
+		if ( as->una != st->una ) {
+
+			as->una = st->una;
+			pthread_cond_broadcast(&as->acked);
+		}
+
+		if ( st->una == st->end )  // idle: the timer starts over with the next data
+			st->deadline = _now_us() + sock->rto;
+
+		st->end = ( as->cork ) ? _async_nagle(sock, st, as) : as->end;
+		stop    = as->stop;
+
+		pthread_mutex_unlock(&as->lock);
+
+		if ( st->una == st->end ) {
+
+			if ( stop )
+				break;
+
+			pfd.fd     = as->wakefd;
+			pfd.events = POLLIN;
+
+			if ( poll(&pfd, 1, -1) < 0 )
+				check( (errno == EINTR) ? 0 : -1 );
+
+			eventfd_read(as->wakefd, &ev);
+			continue;
+		}
+
+		_snd_fill(sock, st);
+		_snd_poll(sock, st, as->wakefd);
+	}
+
+	free(st);
+
+	return NULL;
+}
+
+/**
+ * @brief Queues a message in the send ring, blocking while the ring is full. The thread
+ * of the socket is started with the first message.
+ * 
+ * @param last whether 'buffer' ends the message, else the next call continues it
+ * @return 'length', else -1
+ */
+static ssize_t _async_send(microtcp_sock_t * __restrict__ sock, const uint8_t * __restrict__ buffer, size_t length,
+						int last)
+{
+	struct microtcp_async * as = sock->async;
+	uint32_t off;
+	uint32_t n;
+	uint32_t wrap;
+	size_t done;
+
+
+	pthread_mutex_lock(&as->lock);
+
+	if ( !as->started ) {
+
+		as->base = sock->seq_number;
+		as->una  = sock->seq_number;
+		as->end  = sock->seq_number;
+		as->push = sock->seq_number;
+
+		if ( (errno = pthread_create(&as->thread, NULL, _async_main, sock)) ) {
+
+			pthread_mutex_unlock(&as->lock);
+			return -(EXIT_FAILURE);
+		}
+
+		as->started = 1;
+	}
+
+	for ( done = 0UL; done < length; done += n ) {
+
+		while ( (uint32_t)(as->end - as->una) > as->mask )  // full
+			pthread_cond_wait(&as->acked, &as->lock);
+
+		off  = (uint32_t)(as->end - as->base) & as->mask;
+		n    = MIN2(length - done, (uint64_t)(as->mask) + 1UL - (uint32_t)(as->end - as->una));
+		wrap = MIN2(n, as->mask + 1U - off);
+
+		memcpy(as->ring + off, buffer + done, wrap);
+		memcpy(as->ring, buffer + done + wrap, n - wrap);
+		_bitmap_fill(as->eom, off, wrap, 0);
+		_bitmap_fill(as->eom, 0U, n - wrap, 0);
+
+		if ( last && (done + n == length) )
+			_bitmap_fill(as->eom, (off + n - 1U) & as->mask, 1U, 1);
+
+		as->end += n;
+		sock->seq_number = as->end;
+
+		pthread_mutex_unlock(&as->lock);
+		eventfd_write(as->wakefd, 1);
+		pthread_mutex_lock(&as->lock);
+	}
+
+	pthread_mutex_unlock(&as->lock);
+
+	return length;
+}
+
+/**
+ * @brief Blocks until the peer has acknowledged everything in the send ring.
+ */
+static void _async_drain(microtcp_sock_t * sock)
+{
+	struct microtcp_async * as = sock->async;
+
+
+	pthread_mutex_lock(&as->lock);
+
+	while ( as->una != as->end )
+		pthread_cond_wait(&as->acked, &as->lock);
+
+	pthread_mutex_unlock(&as->lock);
+}
+
+/**
+ * @brief Drains the send ring, stops the thread and frees the ring; the socket is
+ * synchronous again.
+ */
+static void _async_stop(microtcp_sock_t * sock)
+{
+	struct microtcp_async * as = sock->async;
+
+
+	if ( as->started ) {
+
+		_async_drain(sock);
+
+		pthread_mutex_lock(&as->lock);
+		as->stop = 1;
+		pthread_mutex_unlock(&as->lock);
+
+		eventfd_write(as->wakefd, 1);
+		pthread_join(as->thread, NULL);
+	}
+
+	close(as->wakefd);
+	pthread_cond_destroy(&as->acked);
+	pthread_mutex_destroy(&as->lock);
+	free(as->ring);
+	free(as->eom);
+	free(as);
+
+	sock->async = NULL;
+}
+
+/**
+ * @brief Sends what a corked synchronous socket holds back, and blocks until it is
+ * acknowledged. Called with the lock of the cork.
+ * 
+ * @param eom whether a send ended with it, else the message goes on
+ */
+static void _cork_push(microtcp_sock_t * sock, int eom)
+{
+	struct microtcp_cork * c = sock->corked;
+	snd_state_t st;
+
+
+	_snd_init(&st, sock, c->buf, ~0U, NULL, sock->seq_number, sock->seq_number, 0);
+	st.end  = st.base + c->len;
+	st.more = !eom;
+
+	while ( SEQ_LT(st.una, st.end) ) {
+
+		_snd_fill(sock, &st);
+		_snd_poll(sock, &st, -1);
+	}
+
+	sock->seq_number = st.end;
+	c->len = 0U;
+}
+
+/**
+ * @brief Sends at once what a corked synchronous socket holds back, if anything.
+ */
+static void _cork_release(microtcp_sock_t * sock)
+{
+	struct microtcp_cork * c = sock->corked;
+
+
+	if ( !c )
+		return;
+
+	pthread_mutex_lock(&c->lock);
+
+	if ( c->len )
+		_cork_push(sock, 1);
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @brief Body of the thread of a cork: sends the tail once it has been held back for
+ * MICROTCP_CORK_DELAY_US, unless a call of the application sends it first.
+ */
+static void * _cork_main(void * arg)
+{
+	microtcp_sock_t * sock = arg;
+	struct microtcp_cork * c = sock->corked;
+	struct timespec to;
+
+
+	pthread_mutex_lock(&c->lock);
+
+	while ( !c->stop ) {
+
+		if ( !c->len )
+			pthread_cond_wait(&c->held, &c->lock);
+		else if ( _now_us() >= c->due )
+			_cork_push(sock, 1);
+		else {
+
+			to.tv_sec  = c->due / 1000000UL;
+			to.tv_nsec = (c->due % 1000000UL) * 1000UL;
+			pthread_cond_timedwait(&c->held, &c->lock, &to);
+		}
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+/**
+ * @brief Allocates the cork of a synchronous socket and starts its thread.
+ * 
+ * @return the cork, else NULL
+ */
+static struct microtcp_cork * _cork_start(microtcp_sock_t * sock)
+{
+	struct microtcp_cork * c;
+	pthread_condattr_t attr;
+
+
+	if ( !(c = calloc(1, sizeof(*c))) )
+		return NULL;
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&c->held, &attr);
+	pthread_condattr_destroy(&attr);
+
+	sock->corked = c;
+
+	if ( (errno = pthread_create(&c->thread, NULL, _cork_main, sock)) ) {
+
+		pthread_cond_destroy(&c->held);
+		pthread_mutex_destroy(&c->lock);
+		free(c);
+		sock->corked = NULL;
+		return NULL;
+	}
+
+	return c;
+}
+
+/**
+ * @brief Stops the thread of the cork, if the socket has one, and frees it. What is still
+ * held back is dropped.
+ */
+static void _cork_stop(microtcp_sock_t * sock)
+{
+	struct microtcp_cork * c = sock->corked;
+
+
+	if ( !c )
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	c->stop = 1;
+	pthread_cond_signal(&c->held);
+	pthread_mutex_unlock(&c->lock);
+
+	pthread_join(c->thread, NULL);
+	pthread_cond_destroy(&c->held);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+
+	sock->corked = NULL;
+}
+
+/**
+ * @brief microtcp_send() of a corked synchronous socket. A send shorter than a segment is
+ * held back with the previous ones, which go out first if it does not fit. A longer one goes
+ * out at once: with what is held back if it fits, else after what is held back, topped up to
+ * whole segments, and the rest is left to the caller, to be sent as if the socket were not
+ * corked.
+ * 
+ * @return the bytes taken from 'buffer', else -1
+ */
+static ssize_t _cork_send(microtcp_sock_t * __restrict__ sock, const uint8_t * __restrict__ buffer, size_t length)
+{
+	struct microtcp_cork * c = sock->corked;
+	size_t n;
+
+
+	if ( !c && !(c = _cork_start(sock)) )
+		return -(EXIT_FAILURE);
+
+	pthread_mutex_lock(&c->lock);
+
+	if ( length >= sock->mss ) {
+
+		n = 0UL;
+
+		if ( c->len ) {
+
+			n = ( c->len + length <= MICROTCP_CORK_LEN ) ? length
+				: MIN2((sock->mss - c->len % sock->mss) % sock->mss, MICROTCP_CORK_LEN - c->len);
+			memcpy(c->buf + c->len, buffer, n);
+			c->len += n;
+			_cork_push(sock, (n == length) || !n);  // a message ends where a send did
+		}
+
+		pthread_mutex_unlock(&c->lock);
+
+		return n;
+	}
+
+	if ( c->len + length > MICROTCP_CORK_LEN )  // full: it ends where the previous send did
+		_cork_push(sock, 1);
+
+	if ( !c->len ) {  // the timer starts with the first byte held back
+
+		c->due = _now_us() + MICROTCP_CORK_DELAY_US;
+		pthread_cond_signal(&c->held);
+	}
+
+	memcpy(c->buf + c->len, buffer, length);
+	c->len += length;
+
+	pthread_mutex_unlock(&c->lock);
+
+	return length;
+}
+
+/**
+ * @brief Releases what a connection holds besides its receive ring, which may still have
+ * data to deliver: its place in the listener, the cork and the headers of MSG_ZEROCOPY.
+ */
+static void _close_sock(microtcp_sock_t * socket)
+{
+	_listener_detach(socket);
+	_cork_stop(socket);
+	free(socket->zc_hdrs);
+
+	socket->zc_hdrs = NULL;
+	socket->state   = CLOSED;
+}
+
+static void _cleanup();  /** TODO: add to at_exit() - free recvbuf() */
+
+//////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Lets the PMTU probes through: datagrams are never fragmented (DF), and their size
+ * is not limited by the path MTU the kernel has cached.
+ */
+static void _set_pmtu_probe(int sd, int family)
+{
+	if ( family == AF_INET6 )
+		setsockopt(sd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &(int){ IPV6_PMTUDISC_PROBE }, sizeof(int));
+	else
+		setsockopt(sd, IPPROTO_IP, IP_MTU_DISCOVER, &(int){ IP_PMTUDISC_PROBE }, sizeof(int));
+}
+
+/**
+ * @brief Smallest power of 2 not below 'n'.
+ */
+static size_t _round_pow2(size_t n)
+{
+	while ( n & (n - 1UL) )
+		n = (n | (n - 1UL)) + 1UL;
+
+	return n;
+}
+
+/**
+ * @brief (Re)allocates the receive ring of a socket, of 'len' bytes (a power of 2), and
+ * picks the window scale that lets the 16-bit window field cover it.
+ *
+ * @return 0 on success, -1 if the ring could not be allocated
+ */
+static int _alloc_recv_buf(microtcp_sock_t * sock, size_t len)
+{
+	_free_recv_buf(sock);
+
+	sock->recvbuf = (uint8_t *) malloc(len);
+	sock->rcvmap  = (uint64_t *) calloc(len / 64, sizeof(uint64_t));
+	sock->eommap  = (uint64_t *) calloc(len / 64, sizeof(uint64_t));
+
+	if ( !sock->recvbuf || !sock->rcvmap || !sock->eommap ) {
+
+		_free_recv_buf(sock);
+		errno = ENOMEM;
+
+		return -(EXIT_FAILURE);
+	}
+
+	sock->rcvbuf_len = len;
+	sock->rcv_wscale = 0U;
+
+	while ( (len >> sock->rcv_wscale) > 0xFFFFUL )
+		++sock->rcv_wscale;
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Sizes the kernel receive buffer of a UDP socket to a window of 'len' bytes, so
+ * that a whole window in flight is not dropped by the kernel. Above net.core.rmem_max
+ * only a privileged process gets the full size.
+ */
+static void _set_udp_rcvbuf(int sd, size_t len)
+{
+	int val = (int)(MIN2(len, (size_t)(INT_MAX / 2)));
+
+
+	if ( setsockopt(sd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)) )
+		setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+}
+
+/**
+ * @brief Initializes the state of a microTCP socket, everything but the UDP socket.
+ * 
+ * @return 0 on success, -1 if the receive buffer could not be allocated
+ */
+static int _init_sock(microtcp_sock_t * sock)
+{
+	bzero(sock, sizeof(*sock));
+
+	if ( _alloc_recv_buf(sock, MICROTCP_RECVBUF_LEN) ) {
+
+		sock->sd    = -1;
+		sock->state = CLOSED;
+
+		return -(EXIT_FAILURE);
+	}
+
+	sock->seq_number = rand();
+	sock->mss        = MICROTCP_MSS;
+	sock->rcv_mss    = MICROTCP_MSS;
+	sock->cwnd       = MICROTCP_INIT_CWND;
+	sock->ssthresh   = MICROTCP_INIT_SSTHRESH;
+	sock->cc         = &microtcp_cc_newreno;
+	sock->rto        = MICROTCP_ACK_TIMEOUT_US;
+	
+	#ifdef ENABLE_DEBUG_MSG
+	ackbase = sock->seq_number;
+	#endif
+
+
+	return EXIT_SUCCESS;
+}
+
+microtcp_sock_t microtcp_socket(int domain, int type, int protocol)
+{
+	microtcp_sock_t sock;
+	int sockfd;
+
+
+	if ( type != SOCK_DGRAM )
+		LOG_DEBUG("type of socket changed to 'SOCK_DGRAM'\n");
+
+	srand(time(NULL) + getpid());
+
+	if ( _init_sock(&sock) )
+		return sock;
+
+	check( sockfd = socket(domain, SOCK_DGRAM, protocol ));
+
+	sock.sd = sockfd;
+	_set_pmtu_probe(sockfd, domain);
+	_set_udp_rcvbuf(sockfd, sock.rcvbuf_len);
+
+
+	return sock;
+}
+
+int microtcp_bind(microtcp_sock_t * __restrict__ socket, const struct sockaddr * __restrict__ address,
+               socklen_t address_len)
+{
+	check( bind(socket->sd, address, address_len) );
+	return EXIT_SUCCESS;
+}
+
+int microtcp_connect(microtcp_sock_t * __restrict__ socket, const struct sockaddr * __restrict__ address,
+                  socklen_t address_len)
+{
+	microtcp_header_t tcph;
+	uint64_t syn_sent;
+	uint32_t tries;
+	int64_t sockfd;
+
+
+	if ( !socket ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	check( connect(socket->sd, address, address_len) );
+
+	_init_mss(socket, 0U);
+	_preapre_send_tcph(socket, &tcph, socket->seq_number, CTRL_SYN, NULL, 0U);
+
+	syn_sent = _now_us();
+	check( _sock_send(socket, &tcph, sizeof(tcph)) );   // send SYN
+
+	// again on every timeout: a listener drops the SYNs its backlog has no room for
+	for ( tries = 0U; !_wait_readable(socket, syn_sent + socket->rto, -1); ++tries ) {
+
+		if ( tries == MICROTCP_SYN_RETRIES ) {
+
+			socket->state = INVALID;
+			errno = ETIMEDOUT;
+
+			return -(EXIT_FAILURE);
+		}
+
+		++socket->timeouts;
+		socket->rto = MIN2(2U * socket->rto, MICROTCP_MAX_RTO_US);
+		syn_sent = _now_us();
+		check( _sock_send(socket, &tcph, sizeof(tcph)) );
+	}
+
+	check( _sock_recv(socket, &tcph, sizeof(tcph)) );   // recv SYNACK
+
+	#ifdef ENABLE_DEBUG_MSG
+	seqbase = ntohl(tcph.seq_number);  // necessary for print_tcp_header()
+	print_tcp_header(socket, &tcph);
+	#endif
+
+	/** SYNACK **/
+	if ( ntohs(tcph.control) != (CTRL_SYN | CTRL_ACK) ) {
+
+		socket->state = INVALID;
+		errno = ECONNABORTED;
+
+		return -(EXIT_FAILURE);
+	}
+
+	if ( !tries )  // no sample from a SYN that was sent again (Karn)
+		_update_rto(socket, _now_us() - syn_sent);  // first RTT sample
+
+	++socket->seq_number;
+	socket->ack_number = ntohl(tcph.seq_number) + 1U;
+	socket->rcv_head   = socket->ack_number;
+	socket->rcv_high   = socket->ack_number;
+	socket->sendbuflen = ntohs(tcph.window);
+	socket->snd_wscale = MIN2(ntohl(tcph.future_use1), MICROTCP_MAX_WSCALE);
+
+	_init_mss(socket, ntohl(tcph.future_use0));
+	_preapre_send_tcph(socket, &tcph, socket->seq_number, CTRL_ACK, NULL, 0U);
+
+	check( _sock_send(socket, &tcph, sizeof(tcph)) );  // send ACK
+	socket->state     = ESTABLISHED;
+	socket->cc->init(socket);
+
+	// _sock_enable_async(socket);
+
+	LOG_DEBUG("INIT CCONTROL:s.state: %d, s.cwnd: %ld, s.ssthres: %ld\n",socket->state,socket->cwnd,socket->ssthresh);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief The passive side of the 3-way handshake, once the SYN has been received.
+ * 
+ * @param socket a microTCP socket in the LISTEN state
+ * @param tcph the SYN, in network byte order
+ * @return 0 on success or -1 on failure
+ */
+static int _accept_syn(microtcp_sock_t * __restrict__ socket, microtcp_header_t * __restrict__ syn)
+{
+	microtcp_header_t tcph = *syn;
+	microtcp_header_t synack;
+	uint64_t syn_sent;
+
+
+	_trace(socket, MICROTCP_TRACE_RX, &tcph, 0U);
+
+	#ifdef ENABLE_DEBUG_MSG
+	seqbase = ntohl(tcph.seq_number);  // necessary for print_tcp_header()
+	print_tcp_header(socket, &tcph);
+	#endif
+
+	if ( ntohs(tcph.control) != CTRL_SYN ) {
+
+		socket->state = INVALID;
+		errno = ECONNABORTED;
+
+		return -(EXIT_FAILURE);
+	}
+
+	socket->sendbuflen = ntohs(tcph.window);
+	socket->snd_wscale = MIN2(ntohl(tcph.future_use1), MICROTCP_MAX_WSCALE);
+	socket->ack_number = ntohl(tcph.seq_number) + 1U;
+	socket->rcv_head   = socket->ack_number;
+	socket->rcv_high   = socket->ack_number;
+
+	// the SYN was read by microtcp_accept() or the listener
+	++socket->packets_received;
+	socket->bytes_received += MICROTCP_HEADER_SIZE;
+
+	_init_mss(socket, ntohl(tcph.future_use0));
+	_preapre_send_tcph(socket, &synack, socket->seq_number, CTRL_SYN | CTRL_ACK, NULL, 0U);
+
+	syn_sent = _now_us();
+	check(_sock_send(socket, &synack, sizeof(synack)));
+	check(_sock_recv(socket, &tcph, sizeof(tcph)));
+
+	while ( ntohs(tcph.control) == CTRL_SYN ) {  // the SYNACK was lost, or was late
+
+		syn_sent = _now_us();
+		check(_sock_send(socket, &synack, sizeof(synack)));
+		check(_sock_recv(socket, &tcph, sizeof(tcph)));
+	}
+
+	print_tcp_header(socket, &tcph);
+
+	if ( ( ntohs(tcph.control) ) != CTRL_ACK ) {
+
+		socket->state = INVALID;
+		errno = ECONNABORTED;
+
+		return -(EXIT_FAILURE);
+	}
+
+	_update_rto(socket, _now_us() - syn_sent);  // first RTT sample
+
+	++socket->seq_number;         // ghost-byte
+	socket->state = ESTABLISHED;
+	socket->cc->init(socket);
+
+	// _sock_enable_async(socket);
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_accept(microtcp_sock_t * __restrict__ socket, struct sockaddr * __restrict__ address,
+                 socklen_t address_len)
+{
+	microtcp_header_t tcph;
+
+
+	if ( socket->state != INVALID )
+		return -(EXIT_FAILURE);
+
+	socket->state   = LISTEN;
+
+	check( recvfrom(socket->sd, &tcph, sizeof(tcph), 0, address, &address_len) );
+	check( connect(socket->sd, address, address_len) );
+
+
+	return _accept_syn(socket, &tcph);
+}
+
+/**
+ * @brief Creates a listener bound to 'address', with SO_REUSEPORT set if 'reuseport'.
+ */
+static int _listener_open(microtcp_listener_t * __restrict__ listener, const struct sockaddr * __restrict__ address,
+						socklen_t address_len, int reuseport)
+{
+	unsigned int i;
+
+
+	if ( !listener || !address ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	bzero(listener, sizeof(*listener));
+	listener->conns_len = 64UL;
+	listener->conns     = calloc(listener->conns_len, sizeof(*listener->conns));
+	listener->rx        = malloc(sizeof(*listener->rx));
+
+	if ( !listener->conns || !listener->rx ) {
+
+		free(listener->conns);
+		free(listener->rx);
+		listener->sd = -1;
+		errno = ENOMEM;
+
+		return -(EXIT_FAILURE);
+	}
+
+	memset(listener->rx->msgs, 0, sizeof(listener->rx->msgs));
+	pthread_mutex_init(&listener->lock, NULL);
+
+	for ( i = 0U; i < IO_BATCH; ++i ) {
+
+		listener->rx->iovs[i].iov_base = listener->rx->bufs[i];
+		listener->rx->iovs[i].iov_len  = sizeof(listener->rx->bufs[i]);
+
+		listener->rx->msgs[i].msg_hdr.msg_iov    = listener->rx->iovs + i;
+		listener->rx->msgs[i].msg_hdr.msg_iovlen = 1;
+		listener->rx->msgs[i].msg_hdr.msg_name   = listener->rx->names + i;
+	}
+
+	check( listener->sd = socket(address->sa_family, SOCK_DGRAM, 0) );
+
+	if ( reuseport )
+		check( setsockopt(listener->sd, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 }, sizeof(int)) );
+
+	_set_pmtu_probe(listener->sd, address->sa_family);
+	_set_udp_rcvbuf(listener->sd, MICROTCP_LISTEN_RCVBUF);
+
+	check( bind(listener->sd, address, address_len) );
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_listen(microtcp_listener_t * __restrict__ listener, const struct sockaddr * __restrict__ address,
+                 socklen_t address_len)
+{
+	srand(time(NULL) + getpid());
+
+	return _listener_open(listener, address, address_len, 0);
+}
+
+int microtcp_listener_accept(microtcp_listener_t * __restrict__ listener, microtcp_sock_t * __restrict__ socket,
+                 struct sockaddr * __restrict__ address, socklen_t address_len)
+{
+	struct microtcp_dgram * syn;
+	microtcp_header_t tcph;
+
+
+	if ( !listener || !socket ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&listener->lock);
+	_listener_wait(listener, NULL, UINT64_MAX, -1);
+
+	syn = _dgram_pop(&listener->backlog, &listener->backlog_tail);
+	--listener->backlog_len;
+
+	pthread_mutex_unlock(&listener->lock);
+
+	if ( _init_sock(socket) ) {
+
+		free(syn);
+		return -(EXIT_FAILURE);
+	}
+
+	socket->sd       = listener->sd;
+	socket->listener = listener;
+	socket->peer_len = syn->addrlen;
+	socket->zerocopy = -1;  // the error queue of the socket is shared
+	socket->state    = LISTEN;
+	memcpy(&socket->peer, &syn->addr, sizeof(socket->peer));
+	memcpy(&tcph, syn->data, MICROTCP_HEADER_SIZE);
+
+	if ( address )
+		memcpy(address, &syn->addr, MIN2(address_len, syn->addrlen));
+
+	free(syn);
+
+	pthread_mutex_lock(&listener->lock);
+
+	if ( _conn_insert(listener, socket) ) {
+
+		pthread_mutex_unlock(&listener->lock);
+		_free_recv_buf(socket);
+		return -(EXIT_FAILURE);
+	}
+
+	pthread_mutex_unlock(&listener->lock);
+
+	if ( _accept_syn(socket, &tcph) ) {
+
+		_listener_detach(socket);
+		_free_recv_buf(socket);
+		return -(EXIT_FAILURE);
+	}
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_listener_close(microtcp_listener_t * listener)
+{
+	struct microtcp_dgram * d;
+
+
+	if ( !listener ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	while ( (d = _dgram_pop(&listener->backlog, &listener->backlog_tail)) )
+		free(d);
+
+	free(listener->conns);
+	free(listener->rx);
+	pthread_mutex_destroy(&listener->lock);
+
+	listener->conns       = NULL;
+	listener->rx          = NULL;
+	listener->backlog_len = 0U;
+	listener->nconns      = 0UL;
+
+	check( close(listener->sd) );
+	listener->sd = -1;
+
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * A connection accepted by a shard, and the thread that serves it
+ */
+struct microtcp_worker
+{
+	microtcp_sock_t sock;
+	struct sockaddr_storage peer;
+	microtcp_shard_t * shard;
+};
+
+/**
+ * @brief The thread of a connection of a shard: runs the handler, and closes the connection
+ * if the handler has not.
+ */
+static void * _shard_worker(void * arg)
+{
+	struct microtcp_worker * w = arg;
+	microtcp_shard_t * shard   = w->shard;
+
+
+	shard->rt->handler(&w->sock, (const struct sockaddr *)(&w->peer), w->sock.peer_len, shard->rt->arg);
+
+	if ( w->sock.listener ) {  // not shut down by the handler
+
+		_close_sock(&w->sock);
+		_free_recv_buf(&w->sock);
+	}
+
+	free(w);
+
+	pthread_mutex_lock(&shard->lock);
+
+	if ( !--shard->active )
+		pthread_cond_signal(&shard->idle);
+
+	pthread_mutex_unlock(&shard->lock);
+
+
+	return NULL;
+}
+
+/**
+ * @brief The thread of a shard: accepts connections from the listener of the shard and
+ * starts a thread for each, on the CPU of the shard, until the runtime is stopped. Then
+ * waits for the connections it has started to be served.
+ */
+static void * _shard_main(void * arg)
+{
+	microtcp_shard_t * shard = arg;
+	microtcp_runtime_t * rt  = shard->rt;
+	microtcp_listener_t * l  = &shard->listener;
+	struct microtcp_worker * w;
+	pthread_attr_t attr;
+	pthread_t thread;
+	cpu_set_t cpus;
+	int ready;
+
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if ( shard->cpu >= 0 ) {
+
+		CPU_ZERO(&cpus);
+		CPU_SET(shard->cpu, &cpus);
+
+		if ( pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) )
+			LOG_DEBUG("could not pin shard to CPU %d\n", shard->cpu);
+
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+
+	while ( !rt->stopping ) {
+
+		// wait for a SYN in a way that a stop request ends
+		pthread_mutex_lock(&l->lock);
+		ready = _listener_wait(l, NULL, UINT64_MAX, rt->stopfd);
+		pthread_mutex_unlock(&l->lock);
+
+		if ( !ready || !(w = malloc(sizeof(*w))) )
+			continue;
+
+		if ( microtcp_listener_accept(l, &w->sock, (struct sockaddr *)(&w->peer), sizeof(w->peer)) ) {
+
+			free(w);
+			continue;
+		}
+
+		w->shard = shard;
+		++shard->conns;
+
+		pthread_mutex_lock(&shard->lock);
+		++shard->active;
+		pthread_mutex_unlock(&shard->lock);
+
+		if ( pthread_create(&thread, &attr, _shard_worker, w) )
+			_shard_worker(w);  // no thread to spare: served here, and accepting waits
+	}
+
+	pthread_attr_destroy(&attr);
+
+	pthread_mutex_lock(&shard->lock);
+
+	while ( shard->active )
+		pthread_cond_wait(&shard->idle, &shard->lock);
+
+	pthread_mutex_unlock(&shard->lock);
+
+
+	return NULL;
+}
+
+int microtcp_runtime_start(microtcp_runtime_t * __restrict__ rt, const struct sockaddr * __restrict__ address,
+                 socklen_t address_len, unsigned int nshards, microtcp_handler_t handler, void * arg)
+{
+	cpu_set_t cpus;
+	unsigned int i;
+	int ncpus;
+	int cpu;
+
+
+	if ( !rt || !address || !handler ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	CPU_ZERO(&cpus);
+	check( sched_getaffinity(0, sizeof(cpus), &cpus) );
+	ncpus = CPU_COUNT(&cpus);
+
+	bzero(rt, sizeof(*rt));
+	rt->nshards = ( nshards ) ? nshards : (unsigned int)(ncpus);
+	rt->handler = handler;
+	rt->arg     = arg;
+
+	if ( !(rt->shards = calloc(rt->nshards, sizeof(*rt->shards))) ) {
+
+		errno = ENOMEM;
+		return -(EXIT_FAILURE);
+	}
+
+	check( rt->stopfd = eventfd(0, EFD_CLOEXEC) );
+	srand(time(NULL) + getpid());
+
+	/* every socket joins the SO_REUSEPORT group before any thread starts, so the
+	   kernel hashes each peer to the same shard for the lifetime of the runtime */
+	for ( i = 0U; i < rt->nshards; ++i )
+		check( _listener_open(&rt->shards[i].listener, address, address_len, 1) );
+
+	// shard i runs on the i-th CPU of the affinity mask (round-robin, if there are more shards)
+	for ( i = 0U, cpu = -1; i < rt->nshards; ++i ) {
+
+		do
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		while ( ncpus && !CPU_ISSET(cpu, &cpus) );
+
+		rt->shards[i].cpu = ( ncpus ) ? cpu : -1;
+		rt->shards[i].rt  = rt;
+		pthread_mutex_init(&rt->shards[i].lock, NULL);
+		pthread_cond_init(&rt->shards[i].idle, NULL);
+
+		if ( (errno = pthread_create(&rt->shards[i].thread, NULL, _shard_main, rt->shards + i)) )
+			check( -1 );
+	}
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_runtime_stop(microtcp_runtime_t * rt)
+{
+	unsigned int i;
+
+
+	if ( !rt || !rt->shards ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	rt->stopping = 1;
+	check( eventfd_write(rt->stopfd, 1) );  // wakes up every idle shard ...
+
+	for ( i = 0U; i < rt->nshards; ++i ) {  // ... reading its socket or not
+
+		pthread_mutex_lock(&rt->shards[i].listener.lock);
+		_listener_wake_acceptors(&rt->shards[i].listener);
+		pthread_mutex_unlock(&rt->shards[i].listener.lock);
+	}
+
+	for ( i = 0U; i < rt->nshards; ++i ) {
+
+		pthread_join(rt->shards[i].thread, NULL);
+		microtcp_listener_close(&rt->shards[i].listener);
+		pthread_mutex_destroy(&rt->shards[i].lock);
+		pthread_cond_destroy(&rt->shards[i].idle);
+	}
+
+	check( close(rt->stopfd) );
+	free(rt->shards);
+	rt->shards = NULL;
+
+
+	return EXIT_SUCCESS;
+}
+
+int microtcp_shutdown(microtcp_sock_t * socket, int how)
+{
+	// LOG_DEBUG("Start of SD");
+	// LOG_DEBUG("how=%d",how);
+	microtcp_header_t fin_ack, ack;
+
+	if ( socket->async )  // everything queued is delivered before the FIN
+		_async_stop(socket);
+
+	if ( socket->state < CLOSING_BY_PEER )
+		_cork_release(socket);
+	else  // the peer takes no more data
+		_cork_stop(socket);
+
+	if(how==SHUTDOWN_CLIENT){//sender is shutting down the connection
+
+		_preapre_send_tcph(socket, &fin_ack, socket->seq_number, CTRL_FIN | CTRL_ACK, NULL, 0U);
+
+		/* Send FIN/ACK */
+		check(_sock_send(socket, (void*)&fin_ack, sizeof(fin_ack)));
+		/* Receive ACK for previous FINACK */
+		check(_sock_recv(socket, (void*)&ack, sizeof(ack)));
+
+		uint16_t recieved_ack = ntohs(ack.control);
+
+		/* Check if the received package is an ACK (and the correct ACK)*/
+		if(!(recieved_ack & CTRL_ACK)){
+			return -(EXIT_FAILURE);
+		}
+
+		socket->state = CLOSING_BY_HOST;
+
+		/* Wait for FIN ACK from the server*/
+		check(_sock_recv(socket, (void*)&fin_ack, sizeof(ack)))
+
+		uint16_t recieved_finack = ntohs(fin_ack.control);
+
+		if(!(recieved_finack & (CTRL_FIN | CTRL_ACK))){
+			return -(EXIT_FAILURE);
+		}
+
+		/* Prepare and send back the ACK header*/
+		_preapre_send_tcph(socket, &ack, socket->seq_number, CTRL_ACK, NULL, 0U);
+
+		check(_sock_send(socket, (void*)&ack, sizeof(ack)));
+		
+		/** TODO: Timed wait for server FIN ACK retransmition */
+		_free_recv_buf(socket);
+		_close_sock(socket);
+		return EXIT_SUCCESS;
+
+	}else if(how==SHUTDOWN_SERVER){//reciever recieved a FIN packet
+
+		socket->state=CLOSING_BY_PEER;
+		// LOG_DEBUG("SD: state:cbp");
+		_preapre_send_tcph(socket, &ack, socket->seq_number, CTRL_ACK, NULL, 0U);
+		check(_sock_send(socket, (void*)&ack, sizeof(ack)));
+		
+		// LOG_DEBUG("SD: sent ACK\n");
+		_preapre_send_tcph(socket, &fin_ack, socket->seq_number, CTRL_FIN | CTRL_ACK, NULL, 0U);
+		
+		/* Send FIN/ACK */
+		check(_sock_send(socket, (void*)&fin_ack, sizeof(fin_ack)));
+		// LOG_DEBUG("SD: Sent FINACK\n");
+		// LOG_DEBUG("SD: Waiting for ACK\n");
+		/* Receive ACK for previous FINACK */
+		check(_sock_recv(socket, (void*)&ack, sizeof(ack)));
+
+		uint16_t recieved_ack = ntohs(ack.control);
+
+		/* Check if the received package is an ACK */
+		if(!(recieved_ack & CTRL_ACK)) {
+			return -(EXIT_FAILURE);
+		}
+		// LOG_DEBUG("SD: recieved ACK");
+
+		/* Terminate the connection */
+		_close_sock(socket);
+		// LOG_DEBUG("SD: state:closed");
+		return EXIT_SUCCESS;
+
+	}else{
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+}
+
+ssize_t microtcp_send(microtcp_sock_t * __restrict__ socket, const void * __restrict__ buffer, size_t length,
+               int flags)
+{
+	snd_state_t st;
+	ssize_t corked;     // bytes of 'buffer' held back by MICROTCP_SO_CORK, or sent with the tail
+	size_t done;
+	uint32_t n;
+	int txflags;        // MSG_ZEROCOPY or 0
+
+
+	if ( !socket ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( (socket->state == INVALID) || (socket->state >= CLOSING_BY_PEER) ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( socket->async )
+		return _async_send(socket, buffer, length, !socket->cork);
+
+	corked = 0L;
+
+	if ( socket->cork && ((corked = _cork_send(socket, buffer, length)) < 0) )
+		return -(EXIT_FAILURE);
+
+	txflags = 0;
+
+	if ( (flags & MICROTCP_MSG_ZEROCOPY) && (length - corked >= MICROTCP_ZEROCOPY_MIN) ) {
+
+		if ( !socket->zerocopy ) {
+
+			socket->zerocopy = ( setsockopt(socket->sd, SOL_SOCKET, SO_ZEROCOPY, &(int){ 1 }, sizeof(int)) ) ? -1 : 1;
+
+			if ( (socket->zerocopy > 0) && !(socket->zc_hdrs = malloc(ZC_HDR_SLOTS * MICROTCP_HEADER_SIZE)) )
+				return -(EXIT_FAILURE);
+		}
+
+		if ( socket->zerocopy > 0 )
+			txflags = MSG_ZEROCOPY;
+	}
+
+	/* Sequence numbers wrap at 4 GiB and compare within 2 GiB, so a long buffer is sent in
+	 * chunks, each one based where the previous ended; only the last one ends the message */
+	for ( done = corked; done < length; done += n ) {
+
+		n = MIN2(length - done, SEND_CHUNK);
+
+		_snd_init(&st, socket, (const uint8_t *)(buffer) + done, ~0U, NULL, socket->seq_number, socket->seq_number, txflags);
+		st.end = st.base + n;
+		st.more = ( done + n < length );
+
+		while ( SEQ_LT(st.una, st.end) ) {
+
+			_snd_fill(socket, &st);
+			_snd_poll(socket, &st, -1);
+		}
+
+		socket->seq_number = st.end;
+	}
+
+	if ( socket->zc_done != socket->zc_sent )  // the kernel may still hold pages of 'buffer'
+		_drain_zerocopy(socket);
+
+
+	return length;
+}
+
+/**
+ * @brief Maps the window 'win' of a file, SENDFILE_WINDOW bytes from 'first' on, over its
+ * half of 'ring' and asks for it to be read ahead.
+ * 
+ * @param len the bytes of the window that will be sent
+ * @return the mapping, else NULL
+ */
+static uint8_t * _sendfile_map(uint8_t * ring, int fd, off_t first, uint64_t win, uint32_t len)
+{
+	uint8_t * map = ring + (win & 1UL) * SENDFILE_WINDOW;
+
+
+	if ( mmap(map, SENDFILE_WINDOW, PROT_READ, MAP_SHARED | MAP_FIXED, fd,
+			first + (off_t)(win * SENDFILE_WINDOW)) == MAP_FAILED )
+		return NULL;
+
+	madvise(map, len, MADV_SEQUENTIAL);
+	madvise(map, len, MADV_WILLNEED);
+
+	return map;
+}
+
+ssize_t microtcp_sendfile(microtcp_sock_t * __restrict__ socket, int fd, off_t offset, size_t count)
+{
+	snd_state_t st;
+	struct stat finfo;
+	uint8_t * ring;     // two windows of the file, the older one being acknowledged
+	uint8_t * map;
+	off_t first;        // offset of the first window, aligned to SENDFILE_WINDOW
+	uint64_t total;     // bytes to map from 'first'
+	uint64_t mapped;
+	uint32_t lead;      // bytes of the first window before 'offset'
+	uint32_t n;
+	ssize_t ret;
+
+
+	if ( !socket || (offset < 0) ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( (socket->state == INVALID) || (socket->state >= CLOSING_BY_PEER) ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( fstat(fd, &finfo) )
+		return -(EXIT_FAILURE);
+
+	if ( !S_ISREG(finfo.st_mode) ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	count = ( offset < finfo.st_size ) ? MIN2(count, (uint64_t)(finfo.st_size - offset)) : 0UL;
+
+	if ( !count )
+		return 0;
+
+	first  = offset & ~((off_t)(SENDFILE_WINDOW) - 1);
+	lead   = offset - first;
+	total  = lead + count;
+	ret    = count;
+
+	// reserves the address range of the ring, the windows are mapped over it
+	if ( (ring = mmap(NULL, 2UL * SENDFILE_WINDOW, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED )
+		return -(EXIT_FAILURE);
+
+	if ( socket->async ) {  // copied into the send ring, one window at a time
+
+		for ( mapped = 0UL; mapped < total; mapped += n ) {
+
+			n = MIN2(total - mapped, SENDFILE_WINDOW);
+
+			if ( !(map = _sendfile_map(ring, fd, first, mapped / SENDFILE_WINDOW, n)) ) {
+
+				ret = -(EXIT_FAILURE);
+				break;
+			}
+
+			if ( _async_send(socket, map + ( (mapped) ? 0U : lead ), n - ( (mapped) ? 0U : lead ), mapped + n == total) < 0 ) {
+
+				ret = -(EXIT_FAILURE);
+				break;
+			}
+		}
+
+		munmap(ring, 2UL * SENDFILE_WINDOW);
+
+		return ret;
+	}
+
+	_cork_release(socket);  // what send() corked goes ahead of the file
+
+	_snd_init(&st, socket, ring, 2U * SENDFILE_WINDOW - 1U, NULL, socket->seq_number - lead, socket->seq_number, 0);
+
+	for ( mapped = 0UL; (mapped < total) && (mapped < 2UL * SENDFILE_WINDOW); mapped += n ) {
+
+		n = MIN2(total - mapped, SENDFILE_WINDOW);
+
+		if ( !_sendfile_map(ring, fd, first, mapped / SENDFILE_WINDOW, n) ) {
+
+			munmap(ring, 2UL * SENDFILE_WINDOW);
+			return -(EXIT_FAILURE);
+		}
+	}
+
+	st.end  = st.base + mapped;
+	st.more = ( mapped < total );
+
+	while ( st.more || SEQ_LT(st.una, st.end) ) {
+
+		// once the older window is acknowledged, the next one takes its place
+		while ( st.more && ((uint32_t)(st.end - st.una) <= SENDFILE_WINDOW) ) {
+
+			n = MIN2(total - mapped, SENDFILE_WINDOW);
+
+			if ( !_sendfile_map(ring, fd, first, mapped / SENDFILE_WINDOW, n) ) {  // the message ends short
+
+				ret     = -(EXIT_FAILURE);
+				st.more = 0;
+				break;
+			}
+
+			mapped += n;
+			st.end += n;
+			st.more = ( mapped < total );
+		}
+
+		_snd_fill(socket, &st);
+		_snd_poll(socket, &st, -1);
+	}
+
+	socket->seq_number = st.end;
+
+	munmap(ring, 2UL * SENDFILE_WINDOW);
+
+	return ret;
+}
+
+/**
+ * @brief Receives a message, or the 'length' bytes of it that fit in 'buffer'. With a
+ * 'length' of 0, blocks for a batch of segments and keeps all of it in the receive ring.
+ * 
+ * @return the number of bytes read, else -1
+ */
+static ssize_t _recv(microtcp_sock_t * __restrict__ socket, void * __restrict__ buffer, size_t length)
+{
+	seg_batch_t rx;     // segments received with one syscall
+	hdr_batch_t tx;     // ACKs sent with one syscall
+	microtcp_header_t tcph;
+	uint8_t * tbuff;
+
+	size_t total_bytes_read;
+	int64_t bytes_read;
+	int64_t count;
+	int64_t index;
+
+	uint32_t ack_from;  // ACK number before the segment
+	int eom;
+
+
+	if ( !socket ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( (socket->state == INVALID) || ((socket->state >= CLOSING_BY_PEER) && !socket->buf_fill_level) ) {
+
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+
+	if ( socket->async )  // the thread of the socket must not read the data segments
+		_async_drain(socket);
+
+	_cork_release(socket);  // the peer may be waiting for it to answer
+
+	total_bytes_read = 0UL;
+	eom    = 0;
+
+	rx.stride = MICROTCP_HEADER_SIZE + socket->rcv_mss;
+
+	if ( !socket->segbufs && (socket->state < CLOSING_BY_PEER) && !(socket->segbufs = malloc(IO_BATCH * rx.stride)) )
+		return -(EXIT_FAILURE);
+
+	rx.bufs = socket->segbufs;
+
+	_init_batch(rx.msgs, rx.iovs, rx.bufs, rx.stride);
+	_init_batch(tx.msgs, tx.iovs, tx.hdrs, sizeof(tx.hdrs[0]));
+	tx.count = 0U;
+
+	for ( ;; ) {
+
+		// data that is already in order is delivered first
+		if ( socket->buf_fill_level && length ) {
+
+			total_bytes_read += _deliver_recv_buf(socket, (uint8_t *)(buffer) + total_bytes_read,
+												length - total_bytes_read, &eom);
+
+			if ( eom || (total_bytes_read == length) )
+				break;
+		}
+
+		if ( socket->state >= CLOSING_BY_PEER ) {  // FIN was received, nothing more is coming
+
+			_free_recv_buf(socket);
+			break;
+		}
+
+		if ( socket->ack_pending && !_wait_readable(socket, socket->ack_deadline, -1) ) {  // delayed ACK timer
+
+			_queue_ack(socket, &tx, CTRL_ACK);
+			_flush_batch(socket, tx.msgs, &tx.count, 0);
+		}
+
+		// block for the first segment, take whatever else is already queued
+		check( count = _sock_recvmmsg(socket, rx.msgs, IO_BATCH, MSG_WAITFORONE) );
+
+		for ( index = 0L; index < count; ++index ) {
+
+			tbuff      = rx.bufs + index * rx.stride;
+			bytes_read = rx.msgs[index].msg_len;
+
+			memcpy(&tcph, tbuff, MICROTCP_HEADER_SIZE);
+			print_tcp_header(socket,&tcph);
+
+			if ( !_valid_segment(&tcph, tbuff + MICROTCP_HEADER_SIZE, bytes_read - (int64_t)(MICROTCP_HEADER_SIZE)) ) {
+
+				++socket->checksum_errors;
+				_trace(socket, MICROTCP_TRACE_BAD_CSUM, &tcph, 0U);
+
+				// duplicate ACK, so that the sender resends the first hole right away
+				_queue_ack(socket, &tx, CTRL_ACK | CTRL_NAK);
+				continue;
+			}
+
+			_trace(socket, MICROTCP_TRACE_RX, &tcph, 0U);
+			_ntoh_recvd_tcph(tcph);
+
+			if ( (tcph.control & CTRL_FIN) && (tcph.seq_number == socket->ack_number) ) {  // termination
+
+				_flush_batch(socket, tx.msgs, &tx.count, 0);
+				microtcp_shutdown(socket, SHUTDOWN_SERVER);
+
+				if ( !socket->buf_fill_level )
+					_free_recv_buf(socket);
+
+				if ( !total_bytes_read && !socket->buf_fill_level )
+					return -1L;
+
+				break;
+			}
+
+			if ( !tcph.data_len ) {  // zero length packet
+
+				if ( !total_bytes_read && (count == 1L) ) {  // returned as an empty message, on the common way out
+
+					eom = 1;
+					break;
+				}
+
+				continue;
+			}
+
+			if ( !socket->ack_pending )  // the ACK echoes the earliest segment it covers
+				socket->ts_recent = tcph.future_use2;
+
+			ack_from = socket->ack_number;
+
+			if ( !eom && (tcph.seq_number == socket->ack_number) && !socket->buf_fill_level
+				&& (tcph.data_len <= length - total_bytes_read) ) {
+
+				// in order and nothing buffered: straight to the application buffer
+				memcpy((uint8_t *)(buffer) + total_bytes_read, tbuff + MICROTCP_HEADER_SIZE, tcph.data_len);
+
+				_ring_fill(socket, socket->rcvmap, socket->ack_number, tcph.data_len, 0);
+				total_bytes_read   += tcph.data_len;
+				socket->ack_number += tcph.data_len;
+				socket->rcv_head    = socket->ack_number;
+				eom = !(tcph.control & FRAGMENT);
+
+				if ( SEQ_GT(socket->ack_number, socket->rcv_high) )
+					socket->rcv_high = socket->ack_number;
+
+				_advance_ack(socket);  // out-of-order data may now be contiguous
+			}
+			else {
+
+				// kept for a later call, once this one has returned its message
+				_update_recv_buf(socket, &tcph, tbuff + MICROTCP_HEADER_SIZE);
+			}
+
+			_update_sack(socket, tcph.seq_number);
+
+			/* in order, no hole behind it and more of the message to come: the ACK may wait for
+			   the next segment. Anything else is acknowledged at once (a duplicate ACK, if the
+			   segment did not fill the gap) */
+			if ( (tcph.seq_number == ack_from) && (socket->ack_number == ack_from + tcph.data_len)
+				&& (socket->rcv_high == socket->ack_number) && (tcph.control & FRAGMENT) && !socket->ack_pending ) {
+
+				socket->ack_pending  = 1U;
+				socket->ack_deadline = _now_us() + MICROTCP_DELACK_US;
+				continue;
+			}
+
+			_queue_ack(socket, &tx, CTRL_ACK);
+		}
+
+		_flush_batch(socket, tx.msgs, &tx.count, 0);
+
+		if ( eom || (total_bytes_read == length) )
+			break;
+	}
+
+	if ( socket->ack_pending ) {  // the application may not call again for a while
+
+		_queue_ack(socket, &tx, CTRL_ACK);
+		_flush_batch(socket, tx.msgs, &tx.count, 0);
+	}
+
+
+	return total_bytes_read;
+}
+
+ssize_t microtcp_recv(microtcp_sock_t * __restrict__ socket, void * __restrict__ buffer, size_t length, int flags)
+{
+	if ( socket && (socket->msg_head != socket->msg_tail) ) {  // the data of the lent messages is at 'rcv_head'
 
-		LOG_DEBUG("'ctrlb' ---> ");
-		strctrl(ctrlb);
-		check(-1);
+		errno = EBUSY;
+		return -(EXIT_FAILURE);
 	}
 
-	tcph->seq_number = htonl(sock->seq_number);
-	tcph->ack_number = htonl(sock->ack_number);
-	tcph->control    = htons(ctrlb);
-	tcph->window     = htons(MICROTCP_RECVBUF_LEN - sock->buf_fill_level);
-	tcph->data_len   = htonl(paysz);
-	tcph->checksum   = htonl( (paysz) ? crc32(payld, paysz) : 0U );
+	return _recv(socket, buffer, length);
 }
 
 /**
- * @brief ENABLE or DISABLE the timeout socket option
- * @param sockfd A valid socket
- * @param too timeout-option (TIOUT_ENABLE, TIOUT_DISABLE)
- * @return int 
+ * @brief Tells the peer that the window has opened, in case it waits for it.
  */
-static int _timeout(int sockfd, int too)
+static void _window_update(microtcp_sock_t * sock)
 {
+	hdr_batch_t tx;
 
-	struct timeval to;  // timeout
 
-	to.tv_sec = 0L;
+	_init_batch(tx.msgs, tx.iovs, tx.hdrs, sizeof(tx.hdrs[0]));
+	tx.count = 0U;
 
-	if ( too == TIOUT_ENABLE )
-		to.tv_usec = MICROTCP_ACK_TIMEOUT_US;
-	else  // timeout disabled
-		to.tv_usec = 0L;
-	
-	check( setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(to)) );
-
-	return EXIT_SUCCESS;
+	_queue_ack(sock, &tx, CTRL_ACK);
+	_flush_batch(sock, tx.msgs, &tx.count, 0);
 }
 
-static void _update_recv_buf(microtcp_sock_t *socket)
+/**
+ * @brief Writes the 'n' in-order bytes at the head of the receive ring to 'fd' (at '*pos',
+ * if it is not -1), with as few system calls as possible, and frees their room in the ring.
+ * 
+ * @return 0 on success, else -1
+ */
+static int _ring_write(microtcp_sock_t * __restrict__ sock, int fd, off_t * __restrict__ pos, uint32_t n)
 {
-	
-}
+	struct iovec iov[2];
+	uint32_t at = sock->rcv_head & (sock->rcvbuf_len - 1U);
+	ssize_t ret;
 
-static void _cleanup();  /** TODO: add to at_exit() - free recvbuf() */
-
-//////////////////////////////////////////////////////////////////////////////////////
-
-/** TODO: [!] implement byte and packet statistics [!] */
 
-microtcp_sock_t microtcp_socket(int domain, int type, int protocol)
-{
-	microtcp_sock_t sock;
-	int sockfd;
+	iov[0].iov_base = sock->recvbuf + at;
+	iov[0].iov_len  = MIN2(n, sock->rcvbuf_len - at);
+	iov[1].iov_base = sock->recvbuf;
+	iov[1].iov_len  = n - iov[0].iov_len;
 
+	_ring_fill(sock, sock->eommap, sock->rcv_head, n, 0);  // a file has no message boundaries
+	sock->rcv_head       += n;
+	sock->buf_fill_level -= n;
 
-	if ( type != SOCK_DGRAM )
-		LOG_DEBUG("type of socket changed to 'SOCK_DGRAM'\n");
+	while ( iov[0].iov_len + iov[1].iov_len ) {
 
-	bzero(&sock, sizeof(sock));
-	sock.recvbuf = (uint8_t *) malloc(MICROTCP_RECVBUF_LEN);
+		ret = ( *pos >= 0 ) ? pwritev(fd, iov + !iov[0].iov_len, 2 - !iov[0].iov_len, *pos)
+							: writev(fd, iov + !iov[0].iov_len, 2 - !iov[0].iov_len);
 
-	if ( !sock.recvbuf ) {
+		if ( ret < 0 ) {
 
-		sock.sd    = -1;
-		sock.state = INVALID;
-		sock.state = CLOSED;
-		errno = ENOMEM;
+			if ( errno == EINTR )
+				continue;
 
-		return sock;
-	}
+			return -(EXIT_FAILURE);
+		}
 
-	check( sockfd = socket(domain, SOCK_DGRAM, protocol ));
+		if ( *pos >= 0 )
+			*pos += ret;
 
-	memset(&sock, 0, sizeof(sock));
-	srand(time(NULL) + getpid());
+		if ( (size_t)(ret) >= iov[0].iov_len ) {
 
-	sock.sd         = sockfd;
-	sock.seq_number = rand();
-	sock.cwnd       = MICROTCP_INIT_CWND;
-	sock.ssthresh   = MICROTCP_INIT_SSTHRESH;
-	
-	#ifdef ENABLE_DEBUG_MSG
-	ackbase = sock.seq_number;
-	#endif
+			ret -= iov[0].iov_len;
+			iov[0].iov_len   = 0UL;
+			iov[1].iov_base  = (uint8_t *)(iov[1].iov_base) + ret;
+			iov[1].iov_len  -= ret;
+		}
+		else {
 
+			iov[0].iov_base  = (uint8_t *)(iov[0].iov_base) + ret;
+			iov[0].iov_len  -= ret;
+		}
+	}
 
-	return sock;
+	return 0;
 }
 
-int microtcp_bind(microtcp_sock_t * __restrict__ socket, const struct sockaddr * __restrict__ address,
-               socklen_t address_len)
+ssize_t microtcp_recvfile(microtcp_sock_t * __restrict__ socket, int fd, size_t count)
 {
-	check( bind(socket->sd, address, address_len) );
-	return EXIT_SUCCESS;
-}
+	size_t written = 0UL;
+	off_t pos;
+	uint32_t n;
+	int closed;         // the window had no room for a segment
 
-int microtcp_connect(microtcp_sock_t * __restrict__ socket, const struct sockaddr * __restrict__ address,
-                  socklen_t address_len)
-{
-	microtcp_header_t tcph;
-	int64_t sockfd;
 
+	if ( !socket || !count ) {
 
-	if ( !socket ) {
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
+
+	if ( (socket->state == INVALID) || ((socket->state >= CLOSING_BY_PEER) && !socket->buf_fill_level) ) {
 
 		errno = EINVAL;
 		return -(EXIT_FAILURE);
 	}
 
-	check( connect(socket->sd, address, address_len) );
+	if ( socket->msg_head != socket->msg_tail ) {
 
-	tcph.seq_number = htonl(socket->seq_number);
-	tcph.window     = htons(MICROTCP_RECVBUF_LEN);
-	tcph.control    = htons(CTRL_SYN);
+		errno = EBUSY;
+		return -(EXIT_FAILURE);
+	}
 
-	check( send(socket->sd, &tcph, sizeof(tcph), 0) );   // send SYN
-	check( recv(socket->sd, &tcph, sizeof(tcph), 0) );   // recv SYNACK
+	pos = lseek(fd, 0, SEEK_CUR);  // -1 if 'fd' is a pipe or a socket
 
-	#ifdef ENABLE_DEBUG_MSG
-	seqbase = ntohl(tcph.seq_number);  // necessary for print_tcp_header()
-	print_tcp_header(socket, &tcph);
-	#endif
+	while ( written < count ) {
 
-	/** SYNACK **/
-	if ( ntohs(tcph.control) != (CTRL_SYN | CTRL_ACK) ) {
+		n = MIN2(socket->buf_fill_level, count - written);
 
-		socket->state = INVALID;
-		errno = ECONNABORTED;
+		/* the ring is only written out in large pieces: once half of it is full, once it
+		   holds the rest of 'count' or once the peer has closed */
+		if ( n && ((n == count - written) || (n >= socket->rcvbuf_len / 2U) || (socket->state >= CLOSING_BY_PEER)) ) {
 
-		return -(EXIT_FAILURE);
-	}
+			closed = ( socket->rcvbuf_len - socket->buf_fill_level < socket->rcv_mss );
 
-	++socket->seq_number;
-	socket->ack_number = ntohl(tcph.seq_number) + 1U;
-	socket->sendbuflen = ntohs(tcph.window);
+			if ( _ring_write(socket, fd, &pos, n) )
+				return ( written ) ? (ssize_t)(written) : -(EXIT_FAILURE);
 
-	tcph.seq_number = htonl(socket->seq_number);
-	tcph.ack_number = htonl(socket->ack_number);
-	tcph.control    = htons(CTRL_ACK);
+			written += n;
 
-	check( send(socket->sd, &tcph, sizeof(tcph), 0) );  // send ACK
-	socket->state     = SLOW_START;
+			if ( closed && (socket->state < CLOSING_BY_PEER) )  // the sender is waiting for the window to open
+				_window_update(socket);
 
-	// _sock_enable_async(socket);
+			continue;
+		}
 
-	LOG_DEBUG("INIT CCONTROL:s.state: %d, s.cwnd: %ld, s.ssthres: %ld\n",socket->state,socket->cwnd,socket->ssthresh);
-	return EXIT_SUCCESS;
+		if ( socket->state >= CLOSING_BY_PEER ) {  // FIN was received, nothing more is coming
+
+			_free_recv_buf(socket);
+			break;
+		}
+
+		if ( _recv(socket, NULL, 0UL) < 0 )
+			break;
+	}
+
+	if ( (pos >= 0) && (lseek(fd, pos, SEEK_SET) < 0) )
+		return -(EXIT_FAILURE);
+
+	return ( written ) ? (ssize_t)(written) : -(EXIT_FAILURE);
 }
 
-int microtcp_accept(microtcp_sock_t * __restrict__ socket, struct sockaddr * __restrict__ address,
-                 socklen_t address_len)
+ssize_t microtcp_recv_msg(microtcp_sock_t * __restrict__ socket, const microtcp_msg_t ** __restrict__ msg)
 {
-	microtcp_header_t tcph;
+	microtcp_msg_t * m;
+	uint32_t held;      // bytes of the messages already lent
+	uint32_t avail;     // in-order bytes after them
+	uint32_t n;
+	uint32_t at;
 
 
-	if ( socket->state != INVALID )
-		return -(EXIT_FAILURE);
+	if ( !socket || !msg ) {
 
-	socket->state   = LISTEN;
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
 
-	check( recvfrom(socket->sd, &tcph, sizeof(tcph), 0, address, &address_len) );
-	check( connect(socket->sd, address, address_len) );
+	if ( (socket->state == INVALID) || ((socket->state >= CLOSING_BY_PEER) && !socket->buf_fill_level) ) {
 
-	#ifdef ENABLE_DEBUG_MSG
-	seqbase = ntohl(tcph.seq_number);  // necessary for print_tcp_header()
-	print_tcp_header(socket, &tcph);
-	#endif
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
 
-	if ( ntohs(tcph.control) != CTRL_SYN ) {
+	if ( !socket->msgs && !(socket->msgs = calloc(MICROTCP_MSG_POOL, sizeof(*socket->msgs))) )
+		return -(EXIT_FAILURE);
 
-		socket->state = INVALID;
-		errno = ECONNABORTED;
+	if ( socket->msg_tail - socket->msg_head == MICROTCP_MSG_POOL ) {
 
+		errno = ENOBUFS;
 		return -(EXIT_FAILURE);
 	}
 
-	socket->sendbuflen = ntohs(tcph.window);
-	socket->ack_number = ntohl(tcph.seq_number) + 1U;
+	if ( socket->msg_head == socket->msg_tail )
+		socket->rcv_lent = socket->rcv_head;
 
-	++socket->packets_received;
-	++socket->bytes_received;
+	for ( ;; ) {
 
-	tcph.seq_number = htonl(socket->seq_number);
-	tcph.ack_number = htonl(socket->ack_number);
-	tcph.control    = htons(CTRL_ACK | CTRL_SYN);
-	tcph.window     = htons(MICROTCP_RECVBUF_LEN);
+		held  = socket->rcv_lent - socket->rcv_head;
+		avail = socket->buf_fill_level - held;
 
-	check(send(socket->sd, &tcph, sizeof(tcph), 0));
-	check(recv(socket->sd, &tcph, sizeof(tcph), 0));
+		if ( (n = _ring_scan(socket, socket->eommap, socket->rcv_lent, avail, 1)) < avail ) {  // a whole message
 
-	print_tcp_header(socket, &tcph);
+			_ring_fill(socket, socket->eommap, socket->rcv_lent + n, 1U, 0);
+			++n;
+			break;
+		}
 
-	if ( ( ntohs(tcph.control) ) != CTRL_ACK ) {
+		if ( socket->state >= CLOSING_BY_PEER ) {  // FIN was received: the rest, if any, is all there is
 
-		socket->state = INVALID;
-		errno = ECONNABORTED;
+			if ( (n = avail) )
+				break;
 
-		return -(EXIT_FAILURE);
+			return -(EXIT_FAILURE);
+		}
+
+		if ( held + avail == socket->rcvbuf_len ) {  // the ring is full, without the end of the message
+
+			errno = ( held ) ? ENOBUFS : EMSGSIZE;
+			return -(EXIT_FAILURE);
+		}
+
+		_recv(socket, NULL, 0UL);
 	}
 
-	++socket->seq_number;         // ghost-byte
-	socket->state = ESTABLISHED;
+	m  = socket->msgs + socket->msg_tail++ % MICROTCP_MSG_POOL;
+	at = socket->rcv_lent & (socket->rcvbuf_len - 1U);
 
-	// _sock_enable_async(socket);
+	m->iov[0].iov_base = socket->recvbuf + at;
+	m->iov[0].iov_len  = MIN2(n, socket->rcvbuf_len - at);
+	m->iov[1].iov_base = socket->recvbuf;
+	m->iov[1].iov_len  = n - m->iov[0].iov_len;
+	m->iovcnt = ( m->iov[1].iov_len ) ? 2 : 1;
+	m->len    = n;
+	m->lent   = 1;
 
+	socket->rcv_lent += n;
+	*msg = m;
 
-	return EXIT_SUCCESS;
+	return n;
 }
 
-int microtcp_shutdown(microtcp_sock_t * socket, int how)
+int microtcp_release_msg(microtcp_sock_t * __restrict__ socket, const microtcp_msg_t * __restrict__ msg)
 {
-	// LOG_DEBUG("Start of SD");
-	// LOG_DEBUG("how=%d",how);
-	microtcp_header_t fin_ack, ack;
+	microtcp_msg_t * m;
+	int closed;         // the window had no room for a segment
 
-	if(how==SHUTDOWN_CLIENT){//sender is shutting down the connection
-
-		fin_ack.seq_number = htonl(socket->seq_number);
-		fin_ack.ack_number = htonl(socket->ack_number);
-		fin_ack.control    = htons(CTRL_FIN | CTRL_ACK);
 
-		/* Send FIN/ACK */
-		check(send(socket->sd, (void*)&fin_ack, sizeof(fin_ack), 0));
-		/* Receive ACK for previous FINACK */
-		check(recv(socket->sd, (void*)&ack, sizeof(ack), 0));
+	if ( !socket || !socket->msgs || (msg < socket->msgs) || (msg >= socket->msgs + MICROTCP_MSG_POOL) || !msg->lent ) {
 
-		uint16_t recieved_ack = ntohs(ack.control);
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
 
-		/* Check if the received package is an ACK (and the correct ACK)*/
-		if(!(recieved_ack & CTRL_ACK)){
-			return -(EXIT_FAILURE);
-		}
+	((microtcp_msg_t *)(msg))->lent = 0;
 
-		socket->state = CLOSING_BY_HOST;
+	closed = ( socket->rcvbuf_len - socket->buf_fill_level < socket->rcv_mss );
 
-		/* Wait for FIN ACK from the server*/
-		check(recv(socket->sd, (void*)&fin_ack, sizeof(ack), 0))
+	// the room of the oldest messages is freed, once they are all released
+	while ( socket->msg_head != socket->msg_tail ) {
 
-		uint16_t recieved_finack = ntohs(fin_ack.control);
+		m = socket->msgs + socket->msg_head % MICROTCP_MSG_POOL;
 
-		if(!(recieved_finack & (CTRL_FIN | CTRL_ACK))){
-			return -(EXIT_FAILURE);
-		}
+		if ( m->lent )
+			break;
 
-		/* Prepare and send back the ACK header*/
-		ack.control    = htons(CTRL_ACK);
-		ack.ack_number = htonl(socket->ack_number);
-		ack.seq_number = htonl(socket->seq_number);
+		socket->rcv_head       += m->len;
+		socket->buf_fill_level -= m->len;
+		++socket->msg_head;
+	}
 
-		check(send(socket->sd, (void*)&ack, sizeof(ack), 0));
-		
-		/** TODO: Timed wait for server FIN ACK retransmition */
-		socket->state = CLOSED;
-		return EXIT_SUCCESS;
+	if ( socket->state >= CLOSING_BY_PEER ) {
 
-	}else if(how==SHUTDOWN_SERVER){//reciever recieved a FIN packet
+		if ( !socket->buf_fill_level )
+			_free_recv_buf(socket);
+	}
+	else if ( closed && (socket->rcvbuf_len - socket->buf_fill_level >= socket->rcv_mss) )
+		_window_update(socket);
 
-		socket->state=CLOSING_BY_PEER;
-		// LOG_DEBUG("SD: state:cbp");
-		ack.control    = htons(CTRL_ACK);
-		ack.ack_number = htonl(socket->ack_number);
-		check(send(socket->sd, (void*)&ack, sizeof(ack), 0));
-		
-		// LOG_DEBUG("SD: sent ACK\n");
-		fin_ack.seq_number = htonl(socket->seq_number);
-		fin_ack.ack_number = htonl(socket->ack_number);
-		fin_ack.control    = htons(CTRL_FIN | CTRL_ACK);
-		
-		/* Send FIN/ACK */
-		check(send(socket->sd, (void*)&fin_ack, sizeof(fin_ack), 0));
-		// LOG_DEBUG("SD: Sent FINACK\n");
-		// LOG_DEBUG("SD: Waiting for ACK\n");
-		/* Receive ACK for previous FINACK */
-		check(recv(socket->sd, (void*)&ack, sizeof(ack), 0));
+	return EXIT_SUCCESS;
+}
 
-		uint16_t recieved_ack = ntohs(ack.control);
+int microtcp_flush(microtcp_sock_t * socket)
+{
+	struct microtcp_async * as;
 
-		/* Check if the received package is an ACK */
-		if((recieved_ack & CTRL_ACK)) {
-			return -(EXIT_FAILURE);
-		}
-		// LOG_DEBUG("SD: recieved ACK");
 
-		/* Terminate the connection */
-		socket->state = CLOSED;
-		// LOG_DEBUG("SD: state:closed");
-		return EXIT_SUCCESS;
+	if ( !socket || (socket->state == INVALID) || (socket->state >= CLOSING_BY_PEER) ) {
 
-	}else{
 		errno = EINVAL;
 		return -(EXIT_FAILURE);
 	}
-}
 
-ssize_t microtcp_send(microtcp_sock_t * __restrict__ socket, const void * __restrict__ buffer, size_t length,
-               int flags)
-{
-	/** TODO: Congestion control --> update() ssthresh after each send() */
+	if ( (as = socket->async) ) {
 
-	uint8_t tbuff[MICROTCP_HEADER_SIZE + MICROTCP_MSS];  // c99 and onwards --- problem for larger MSS
-	microtcp_header_t tcph;
-	int64_t ret;
+		pthread_mutex_lock(&as->lock);
+		as->push = as->end;
+		pthread_mutex_unlock(&as->lock);
 
-	int sockfd;
-	int fflag;  // fragments flag
-	size_t lengthcpy = length;
+		eventfd_write(as->wakefd, 1);
+	}
+	else
+		_cork_release(socket);
+
+	return EXIT_SUCCESS;
+}
 
-	uint64_t bytes_to_send;
-	uint64_t chunks;
-	uint64_t index;
-	uint64_t dacks;
-	uint64_t tmp;
+int microtcp_setsockopt(microtcp_sock_t * __restrict__ socket, int option, const void * __restrict__ value,
+               socklen_t value_len)
+{
+	struct microtcp_async * as;
+	struct microtcp_trace * tr;
+	size_t len;
 
 
-	if ( !socket ) {
+	if ( !socket || !value ) {
 
 		errno = EINVAL;
 		return -(EXIT_FAILURE);
 	}
 
-	if ( (socket->state == INVALID) || (socket->state >= CLOSING_BY_PEER) ) {
+	switch ( option ) {
 
-		errno = EINVAL;
-		return -(EXIT_FAILURE);
-	}
+		case MICROTCP_SO_SNDRING:
 
-	sockfd = socket->sd;
-	fflag  = 0;
+			if ( value_len != sizeof(size_t) ) {
 
-sflag0:
-	if ( length > MIN2(MICROTCP_MSS, MIN2(socket->cwnd, socket->sendbuflen)) )
-		fflag = 0;
-	else
-		fflag = 1;
+				errno = EINVAL;
+				return -(EXIT_FAILURE);
+			}
 
-	_timeout(sockfd, TIOUT_ENABLE);
+			if ( socket->listener ) {  // the thread would read the shared socket on behalf of other connections
 
-	while ( length ) {
-send1:
-		tmp = MIN2(socket->cwnd, socket->sendbuflen);
-		bytes_to_send = MIN2(length, tmp);
-		chunks = bytes_to_send / MICROTCP_MSS;  // avoid IP-Fragmentation (break into fragments)
+				errno = EOPNOTSUPP;
+				return -(EXIT_FAILURE);
+			}
 
-		LOG_DEBUG("\n\e[1mlength = %lu\e[0m\n"
-					" > chunks = %lu\n"
-					" > bytes_to_send = %lu\n", length, chunks, bytes_to_send);
+			if ( socket->async )
+				_async_stop(socket);
 
-		for ( index = 0UL; index < chunks; ++index ) {
+			if ( !(len = *(const size_t *)(value)) )
+				return EXIT_SUCCESS;
 
-			tmp = (uint64_t)(buffer) + (index * MICROTCP_MSS);  // pointer arithmetic - c99 and onwards
+			len = MIN2(MAX2(len, 64UL), MICROTCP_SNDRING_MAX);
 
-			_preapre_send_tcph(socket, &tcph, ( !fflag ) ? (fflag = FRAGMENT) : CTRL_XXX, (void *)(tmp), MICROTCP_MSS);
-			memcpy(tbuff, &tcph, MICROTCP_HEADER_SIZE);
-			memcpy(tbuff + MICROTCP_HEADER_SIZE, (void *)(tmp), MICROTCP_MSS);
+			len = _round_pow2(len);
 
-			check( send(sockfd, tbuff, MICROTCP_MSS + MICROTCP_HEADER_SIZE, 0) );
-		}
+			if ( !(as = calloc(1, sizeof(*as))) )
+				return -(EXIT_FAILURE);
 
-		length -= bytes_to_send;
-		bytes_to_send -= index * MICROTCP_MSS;
+			as->ring   = malloc(len);
+			as->eom    = calloc(len / 64, sizeof(uint64_t));
+			as->mask   = len - 1UL;
+			as->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
-		// semi-filled chunk
-		if ( bytes_to_send ) {
+			if ( !as->ring || !as->eom || (as->wakefd < 0) ) {
 
-			tmp = (uint64_t)(buffer) + (index * MICROTCP_MSS);  // pointer arithmetic
+				if ( as->wakefd >= 0 )
+					close(as->wakefd);
 
-			_preapre_send_tcph(socket, &tcph, ( !length && chunks) ? FRAGMENT : CTRL_XXX, (void *)(tmp), bytes_to_send);
-			memcpy(tbuff, &tcph, MICROTCP_HEADER_SIZE);
-			memcpy(tbuff + MICROTCP_HEADER_SIZE, (void *)(tmp), bytes_to_send);
-			++chunks;
+				free(as->ring);
+				free(as->eom);
+				free(as);
+				return -(EXIT_FAILURE);
+			}
 
-			check( send(sockfd, tbuff, bytes_to_send + MICROTCP_HEADER_SIZE, 0) );
-		}
+			pthread_mutex_init(&as->lock, NULL);
+			pthread_cond_init(&as->acked, NULL);
+			as->cork = socket->cork;
 
-		for ( dacks = 0UL, index = 0UL; index < chunks; ++index ) {	
+			_cork_release(socket);  // the ring takes over from here
 
-sflag1:
-			ret = recv(sockfd, &tcph, MICROTCP_HEADER_SIZE, 0);
+			socket->async = as;
 
-			LOG_DEBUG("s.state: %d, s.cwnd: %ld, s.ssthres: %ld\n",socket->state,socket->cwnd,socket->ssthresh);
+			return EXIT_SUCCESS;
 
-			if ( ret < 0 ) {
+		case MICROTCP_SO_RCVBUF:
 
-				if ( errno == EAGAIN ) {
+			if ( value_len != sizeof(size_t) ) {
 
-					socket->ssthresh  = socket->cwnd / 2; 
-					socket->cwnd      = MICROTCP_MSS;
-					socket->state     = SLOW_START;
+				errno = EINVAL;
+				return -(EXIT_FAILURE);
+			}
 
-					LOG_DEBUG("timeout-occured, retransmiting packet\n");
+			if ( socket->state != INVALID ) {  // the window scale is fixed at the handshake
 
-					length = lengthcpy;
-					goto send1;
-				}
-				else
-					check( ret );
+				errno = EISCONN;
+				return -(EXIT_FAILURE);
 			}
-			else {
 
-				print_tcp_header(socket, &tcph);
-				_ntoh_recvd_tcph(tcph);
+			len = _round_pow2(MIN2(MAX2(*(const size_t *)(value), MICROTCP_RCVBUF_MIN), MICROTCP_RCVBUF_MAX));
 
-				if ( tcph.ack_number < socket->seq_number ) {  // retransmit
+			if ( _alloc_recv_buf(socket, len) )
+				return -(EXIT_FAILURE);
 
-					LOG_DEBUG("!ack < seq!");
-					
-					/** TODO: Fast Retransmit */
+			_set_udp_rcvbuf(socket->sd, len);
 
-					if ( ++dacks == 3UL ) {
+			return EXIT_SUCCESS;
 
-						socket->ssthresh   = socket->cwnd / 2;
-						socket->cwnd       = socket->ssthresh + 3 * MICROTCP_MSS;
-						socket->seq_number = tcph.ack_number;
+		case MICROTCP_SO_CONGESTION:
 
-						// tmp = (index != chunks - 1UL) ? MICROTCP_MSS : bytes_to_send;
-						// buffer += (index - 1UL) * tmp;
-						length = lengthcpy;
-					}
-					else if ( dacks > 3UL )
-						socket->cwnd = socket->cwnd + MICROTCP_MSS;
+			if ( (value_len != sizeof(const microtcp_cc_ops_t *)) || !*(const microtcp_cc_ops_t * const *)(value) ) {
 
-					goto send1;
-				}
-				else {  // everything is normal
+				errno = EINVAL;
+				return -(EXIT_FAILURE);
+			}
 
-					socket->seq_number += (index != chunks - 1UL) ? MICROTCP_MSS : bytes_to_send;
-					dacks = 0UL;
+			if ( socket->async && socket->async->started )  // the thread of the socket must be idle
+				_async_drain(socket);
 
-					if ( socket->state == SLOW_START ) {
+			// the windows of the previous module mean nothing to this one (BBR has no ssthresh)
+			socket->cc       = *(const microtcp_cc_ops_t * const *)(value);
+			socket->cwnd     = MAX2(MICROTCP_INIT_CWND, 2UL * socket->mss);
+			socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+			memset(socket->cc_priv, 0, sizeof(socket->cc_priv));
 
-						socket->cwnd = socket->cwnd * 2;  // in SLOW_START increment cwnd exponentially
+			if ( socket->state != INVALID )
+				socket->cc->init(socket);
 
-						if ( socket->cwnd >= socket->ssthresh )  // if SLOW_START & cwnd>=ssthresh -> CONG_AVOID
-							socket->state = CONG_AVOID;
-					}
-					else
-						socket->cwnd += MICROTCP_MSS;  // in CONG_AVOID increment cwnd additively
-				}
+			return EXIT_SUCCESS;
+
+		case MICROTCP_SO_TRACE:
+
+			if ( value_len != sizeof(size_t) ) {
+
+				errno = EINVAL;
+				return -(EXIT_FAILURE);
 			}
-		}
-	}
 
-	_timeout(sockfd, TIOUT_DISABLE);
+			if ( socket->async && socket->async->started )  // the thread of the socket must be idle
+				_async_drain(socket);
 
+			free(socket->trace);
+			socket->trace = NULL;
 
-	return EXIT_SUCCESS;
-}
+			if ( !(len = *(const size_t *)(value)) )
+				return EXIT_SUCCESS;
 
-ssize_t microtcp_recv(microtcp_sock_t * __restrict__ socket, void * __restrict__ buffer, size_t length, int flags)
-{
-	uint8_t tbuff[MICROTCP_MSS + MICROTCP_HEADER_SIZE];
-	microtcp_header_t tcph;
+			len = _round_pow2(MIN2(len, MICROTCP_TRACE_MAX));
 
-	int64_t total_bytes_read;
-	int64_t bytes_read;
+			if ( !(tr = malloc(sizeof(*tr) + len * sizeof(tr->recs[0]))) )
+				return -(EXIT_FAILURE);
 
-	int sockfd;
-	int frag;
+			tr->head = 0UL;
+			tr->mask = len - 1UL;
+			tr->tsc0 = _trace_clock();
+			tr->ns0  = _now_us() * 1000UL;
+			socket->trace = tr;
 
+			return EXIT_SUCCESS;
 
-	if ( !socket ) {
+		case MICROTCP_SO_CORK:
 
-		errno = EINVAL;
-		return -(EXIT_FAILURE);
+			if ( value_len != sizeof(int) ) {
+
+				errno = EINVAL;
+				return -(EXIT_FAILURE);
+			}
+
+			socket->cork = ( *(const int *)(value) != 0 );
+
+			if ( (as = socket->async) ) {
+
+				pthread_mutex_lock(&as->lock);
+				as->cork = socket->cork;
+				as->push = as->end;  // what is held back goes now
+				pthread_mutex_unlock(&as->lock);
+
+				eventfd_write(as->wakefd, 1);
+			}
+			else if ( !socket->cork )
+				_cork_release(socket);
+
+			return EXIT_SUCCESS;
+
+		default:
+
+			errno = ENOPROTOOPT;
+			return -(EXIT_FAILURE);
 	}
+}
 
-	if ( (socket->state == INVALID) || (socket->state >= CLOSING_BY_PEER) ) {
+int microtcp_get_stats(const microtcp_sock_t * __restrict__ socket, microtcp_stats_t * __restrict__ stats)
+{
+	if ( !socket || !stats ) {
 
 		errno = EINVAL;
 		return -(EXIT_FAILURE);
 	}
 
+	stats->packets_send     = socket->packets_send;
+	stats->packets_received = socket->packets_received;
+	stats->packets_lost     = socket->packets_lost;
+	stats->bytes_send       = socket->bytes_send;
+	stats->bytes_received   = socket->bytes_received;
+	stats->bytes_lost       = socket->bytes_lost;
+	stats->timeouts         = socket->timeouts;
+	stats->dup_acks         = socket->dup_acks;
+	stats->checksum_errors  = socket->checksum_errors;
+	stats->cwnd             = socket->cwnd;
+	stats->ssthresh         = socket->ssthresh;
+	stats->mss              = socket->mss;
+	stats->srtt             = socket->srtt;
+	stats->rttvar           = socket->rttvar;
+	stats->rto              = socket->rto;
 
-	total_bytes_read = 0L;
-	sockfd = socket->sd;
 
-rflag0:
-	check( total_bytes_read = recv(sockfd, tbuff, length, 0) );
-	memcpy(&tcph, tbuff, MICROTCP_HEADER_SIZE);
-	print_tcp_header(socket,&tcph);
+	return EXIT_SUCCESS;
+}
 
-	_ntoh_recvd_tcph(tcph);
+/**
+ * @brief write() of the whole of 'buf', resuming after short writes.
+ * 
+ * @return 0 on success or -1 on failure
+ */
+static int _write_all(int fd, const void * buf, size_t len)
+{
+	ssize_t ret;
 
-	// Fast Retransmit
-	if ( tcph.seq_number > socket->ack_number ) {
 
-		LOG_DEBUG("Reordering\n");  // packet that was read is actually discarded!
-		_preapre_send_tcph(socket, &tcph, CTRL_ACK, NULL, 0U);
-		check( send(sockfd, &tcph, MICROTCP_HEADER_SIZE, 0) );
+	while ( len ) {
 
-		/** TODO: Packet reordeing could also be performed here,
-		 * thus achieving better performance.
-		 */
+		if ( (ret = write(fd, buf, len)) < 0 ) {
 
-		goto rflag0;
-	}
-	else if ( tcph.control & CTRL_FIN ) {  // termination
+			if ( errno == EINTR )
+				continue;
 
-		microtcp_shutdown(socket, SHUTDOWN_SERVER);
-		return -1L;
+			return -(EXIT_FAILURE);
+		}
+
+		buf  = (const uint8_t *)(buf) + ret;
+		len -= ret;
 	}
-	else if ( tcph.seq_number < socket->ack_number )  // skip duplicate packets (during TIMEOUT)
-		goto rflag0;
 
-	if ( !tcph.data_len )  // zero length packet
-		return 0L;
 
-	memcpy(buffer, tbuff + MICROTCP_HEADER_SIZE, tcph.data_len);
+	return EXIT_SUCCESS;
+}
 
-	total_bytes_read -= MICROTCP_HEADER_SIZE;
-	socket->ack_number += tcph.data_len;
-	tcph.ack_number = socket->ack_number;
-	tcph.seq_number = socket->seq_number;
-	frag = tcph.control & FRAGMENT;
+int microtcp_trace_dump(const microtcp_sock_t * socket, int fd)
+{
+	const struct microtcp_trace * tr;
+	microtcp_trace_hdr_t hdr;
+	uint64_t head;
+	uint64_t first;
+	uint64_t from;
+	uint64_t n;
 
-	_preapre_send_tcph(socket, &tcph, CTRL_ACK, NULL, 0U);
-	check( send(sockfd, &tcph, MICROTCP_HEADER_SIZE, 0) );
 
-	if ( !frag )  // no fragmentation case
-		return total_bytes_read;
+	if ( !socket || !(tr = socket->trace) ) {
 
-	// fragmentation case
-	tbuff[total_bytes_read - 1L];
-	bytes_read = total_bytes_read;
+		errno = EINVAL;
+		return -(EXIT_FAILURE);
+	}
 
-	do {
+	head  = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+	first = ( head > tr->mask ) ? head - tr->mask - 1UL : 0UL;  // older records were overwritten
 
-		tbuff[bytes_read - 1L] = 0;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MICROTCP_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.rec_size = sizeof(microtcp_trace_rec_t);
+	hdr.count    = head - first;
+	hdr.tsc0     = tr->tsc0;
+	hdr.ns0      = tr->ns0;
+	hdr.tsc1     = _trace_clock();
+	hdr.ns1      = _now_us() * 1000UL;
 
-		check( bytes_read = recv(sockfd, tbuff, MICROTCP_MSS + MICROTCP_HEADER_SIZE, 0) );
-		memcpy(&tcph, tbuff, MICROTCP_HEADER_SIZE);
-		_ntoh_recvd_tcph(tcph);
-		memcpy(buffer + total_bytes_read, tbuff + MICROTCP_HEADER_SIZE, tcph.data_len);
+	if ( _write_all(fd, &hdr, sizeof(hdr)) )
+		return -(EXIT_FAILURE);
 
-		total_bytes_read += bytes_read - MICROTCP_HEADER_SIZE;
-		socket->ack_number += tcph.data_len;
-		tcph.seq_number = socket->seq_number;
-		tcph.ack_number = socket->ack_number;
-		frag = tcph.control & FRAGMENT;
+	// the ring in at most two runs, from the oldest record
+	for ( ; first < head; first += n ) {
 
-		_preapre_send_tcph(socket, &tcph, CTRL_ACK, NULL, 0U);
-		check( send(sockfd, &tcph, MICROTCP_HEADER_SIZE, 0) );
+		from = first & tr->mask;
+		n    = MIN2(head - first, tr->mask + 1UL - from);
 
-	} while ( !frag );
+		if ( _write_all(fd, tr->recs + from, n * sizeof(tr->recs[0])) )
+			return -(EXIT_FAILURE);
+	}
 
 
-	return total_bytes_read;
+	return EXIT_SUCCESS;
 }
-
@@ -23,8 +23,10 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/ip.h>
 #include <stdint.h>
+#include <pthread.h>
 
 
 /** DEFINES **/
@@ -35,19 +37,90 @@
 #define CTRL_SYN ( 1U << 1 )
 #define CTRL_RST ( 1U << 2 )
 #define CTRL_ACK ( 1U << 3 )
+#define CTRL_NAK ( 1U << 4 )  /* with CTRL_ACK: a segment arrived damaged (wrong checksum) */
 
 #define SHUTDOWN_CLIENT 0
 #define SHUTDOWN_SERVER 1
 
+#define MICROTCP_MSG_ZEROCOPY ( 1 << 0 )  /* microtcp_send(): let the kernel send straight from the buffer */
+
+#define MICROTCP_SO_SNDRING 1   /* microtcp_setsockopt(): size_t length of the send ring, 0 to disable */
+#define MICROTCP_SO_RCVBUF 2    /* microtcp_setsockopt(): size_t length of the receive ring */
+#define MICROTCP_SO_CONGESTION 3  /* microtcp_setsockopt(): const microtcp_cc_ops_t *, the congestion control */
+#define MICROTCP_SO_TRACE 4     /* microtcp_setsockopt(): size_t records of the trace ring, 0 to free it */
+#define MICROTCP_SO_CORK 5      /* microtcp_setsockopt(): int, non zero joins small sends into full segments */
+
 /*
  * Several useful constants
  */
-#define MICROTCP_ACK_TIMEOUT_US 200000L
-#define MICROTCP_MSS 1400U
-#define MICROTCP_RECVBUF_LEN 8192
+#define MICROTCP_ACK_TIMEOUT_US 200000L   /* initial retransmission timeout */
+#define MICROTCP_MIN_RTO_US 2000U
+#define MICROTCP_MAX_RTO_US 60000000U
+#define MICROTCP_SYN_RETRIES 6U             /* SYNs sent again, with backoff, before connect() gives up */
+#define MICROTCP_DELACK_US 1000U           /* longest an ACK is delayed */
+#define MICROTCP_MSS 1400U                  /* segments start at this size, until a PMTU probe succeeds */
+#define MICROTCP_MAX_MSS 8940U              /* a 9000-byte jumbo frame */
+#define MICROTCP_PMTU_STEP 64U              /* PMTU search stops once it is narrower than this */
+#define MICROTCP_PMTU_PROBES 2U             /* losses of a probe before its size is given up */
+#define MICROTCP_RECVBUF_LEN (2UL << 20)     /* default receive ring: 10 ms at 1.6 Gbit/s */
+#define MICROTCP_RCVBUF_MIN 4096UL
+#define MICROTCP_RCVBUF_MAX (1UL << 30)
+#define MICROTCP_MAX_WSCALE 14U             /* largest window scale (RFC 7323) */
+#define MICROTCP_LISTEN_RCVBUF (8UL << 20)  /* kernel buffer of a listener, shared by its connections */
+#define MICROTCP_PACING_QUANTUM_US 1000UL   /* a paced sender may run this far ahead of its rate */
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
 #define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
 #define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+#define MICROTCP_ZEROCOPY_MIN (64 * 1024)   /* smaller sends are copied, even with MICROTCP_MSG_ZEROCOPY */
+#define MICROTCP_LISTEN_BACKLOG 128         /* SYNs a listener keeps until they are accepted */
+#define MICROTCP_CONN_RXQ_LEN 256           /* datagrams a listener queues per connection; more are dropped */
+#define MICROTCP_SNDRING_MAX (1UL << 30)    /* longest send ring */
+#define MICROTCP_TRACE_MAX (1UL << 24)      /* most records of a trace ring */
+#define MICROTCP_CORK_LEN (64U * 1024)      /* most a corked synchronous socket holds back */
+#define MICROTCP_CORK_DELAY_US 200000UL     /* longest a corked synchronous socket holds data back */
+#define MICROTCP_MSG_POOL 64U               /* messages microtcp_recv_msg() can lend at a time */
+
+/**
+ * microTCP header structure
+ * NOTE: DO NOT CHANGE!
+ *
+ * Use of the future_use fields:
+ *  - future_use0, future_use1: left and right edge of a SACK block, on ACKs. The block
+ *    [future_use0, future_use1) was received out of order; it is empty when both are equal.
+ *  - future_use0, on SYN and SYN-ACK: the largest payload the sender accepts (its MSS).
+ *    0 means MICROTCP_MSS.
+ *  - future_use1, on SYN and SYN-ACK: the window scale of the sender. The window of every
+ *    later segment it sends is in units of 2^future_use1 bytes (the SYNs' are in bytes).
+ *  - future_use2: on data segments, the time of transmission (sender clock, microseconds);
+ *    on ACKs, the timestamp of the data segment that triggered the ACK. 0 means none.
+ */
+typedef struct
+{
+  uint32_t seq_number;          /**< Sequence number */
+  uint32_t ack_number;          /**< ACK number */
+  uint16_t control;             /**< Control bits (e.g. SYN, ACK, FIN) */
+  uint16_t window;              /**< Window size in units of (1 << wscale) bytes, wscale being the shift
+                                     the sender advertised in future_use1 of its SYN ('rcv_wscale' of the
+                                     sender, 'snd_wscale' of the receiver). A SYN's window is in bytes */
+  uint32_t data_len;            /**< Data length in bytes (EXCLUDING header) */
+  uint32_t future_use0;         /**< 32-bits for future use */
+  uint32_t future_use1;         /**< 32-bits for future use */
+  uint32_t future_use2;         /**< 32-bits for future use */
+  uint32_t checksum;            /**< CRC-32 of the header (with this field 0) and the payload, see
+                                     crc32() in utils folder */
+} microtcp_header_t;
+
+/**
+ * A message lent by microtcp_recv_msg(). It stays in the receive ring, where it was
+ * reassembled, until microtcp_release_msg().
+ */
+typedef struct
+{
+  struct iovec iov[2];           /**< The message: one piece, or two if it wraps around the ring */
+  int iovcnt;
+  size_t len;                    /**< Total length */
+  int lent;                      /**< Private */
+} microtcp_msg_t;
 
 /**
  * Possible states of the microTCP socket
@@ -60,8 +133,6 @@ typedef enum
   INVALID,
   LISTEN,
   ESTABLISHED,
-  SLOW_START,
-  CONG_AVOID,
   CLOSING_BY_PEER,
   CLOSING_BY_HOST,
   CLOSED,
@@ -70,6 +141,14 @@ typedef enum
 /** TODO: handle better 'INVALID' state (set only upon error) */
 
 
+struct microtcp_listener;
+struct microtcp_dgram;
+struct microtcp_waiter;
+struct microtcp_rxbatch;
+struct microtcp_async;
+struct microtcp_cc_ops;
+struct microtcp_trace;
+
 /**
  * This is the microTCP socket structure. It holds all the necessary
  * information of each microTCP socket.
@@ -77,12 +156,16 @@ typedef enum
  * NOTE: Fill free to insert additional fields.
  */
 
-/** TODO: fuck 'recvbuf', it's useless. Let's use the kernel's
- * (UDP) built-in buffer.
- */
 typedef struct
 {
   int sd;                        /**< The underline UDP socket descriptor */
+  struct microtcp_listener * listener;  /**< The listener that accepted the connection and owns 'sd', or NULL */
+  struct sockaddr_storage peer;  /**< Address of the peer, when 'sd' is a listener's */
+  socklen_t peer_len;
+  struct microtcp_dgram * rxq_head;  /**< Datagrams the listener has received for this connection ... */
+  struct microtcp_dgram * rxq_tail;
+  uint32_t rxq_len;              /**< ... and how many */
+  struct microtcp_waiter * rxq_waiter;  /**< The thread blocked for them, or NULL */
   mircotcp_state_t state;        /**< The state of the microTCP socket */
   size_t init_win_size;          /**< The window size negotiated at the 3-way handshake */
   size_t curr_win_size;          /**< The current window size */
@@ -90,41 +173,239 @@ typedef struct
   uint8_t * recvbuf;             /**< The *receive* buffer of the TCP
                                      connection. It is allocated during the connection establishment and
                                      is freed at the shutdown of the connection. This buffer is used
-                                     to retrieve the data from the network. */
-  size_t buf_fill_level;         /**< Amount of data in the buffer */
+                                     to retrieve the data from the network. It is a ring indexed by
+                                     sequence number: the byte 'seq' lives at recvbuf[seq % rcvbuf_len] */
+  uint32_t rcvbuf_len;           /**< Length of 'recvbuf', a power of 2 */
+  uint32_t rcv_wscale;           /**< Window scale advertised to the peer */
+  uint64_t * rcvmap;             /**< One bit per byte of 'recvbuf': received out of order */
+  uint64_t * eommap;             /**< One bit per byte of 'recvbuf': last byte of a message */
+  uint8_t * segbufs;             /**< recvmmsg() buffers, sized to 'rcv_mss' */
+  uint32_t rcv_head;             /**< Sequence number of the first byte not yet delivered to the application */
+  uint32_t rcv_high;             /**< Sequence number right after the highest byte received */
+  uint32_t sack_left;            /**< SACK block reported with the next ACK ... */
+  uint32_t sack_right;           /**< ... empty if sack_left == sack_right */
+  size_t buf_fill_level;         /**< Amount of in-order data in the buffer */
   size_t cwnd;
   size_t ssthresh;
+  const struct microtcp_cc_ops * cc;  /**< Congestion control module, NewReno by default */
+  uint64_t cc_priv[32];          /**< Private state of 'cc' */
+
+  uint32_t mss;                  /**< Largest payload sent, known to fit the path */
+  uint32_t mss_max;              /**< Largest payload the peer and the local route accept */
+  uint32_t mss_hi;               /**< Largest payload not known to be too big for the path */
+  uint32_t rcv_mss;              /**< Largest payload accepted, advertised in the SYN */
+  uint32_t probe_seq;            /**< First byte of the PMTU probe in flight ... */
+  uint32_t probe_size;           /**< ... and its size, 0 if none */
+  uint32_t probe_fails;          /**< Probes of this size lost so far */
+
+  uint32_t srtt;                 /**< Smoothed round-trip time (us), 0 until the first sample */
+  uint32_t rttvar;               /**< Round-trip time variation (us) */
+  uint32_t rto;                  /**< Retransmission timeout (us) */
+  uint32_t ts_recent;            /**< Timestamp of the earliest segment the next ACK covers, echoed back with it */
+  uint32_t ack_pending;          /**< In-order segments received but not acknowledged yet (delayed ACK) */
+  uint64_t ack_deadline;         /**< When the delayed ACK is due (monotonic clock, microseconds) */
   
-  uint16_t sendbuflen;
+  size_t sendbuflen;             /**< The window advertised by the peer, in bytes */
+  uint32_t snd_wscale;           /**< Window scale of the peer */
+
+  int zerocopy;                  /**< SO_ZEROCOPY on 'sd': 0 not tried yet, 1 enabled, -1 not supported */
+  uint32_t zc_sent;              /**< Datagrams sent with MSG_ZEROCOPY ... */
+  uint32_t zc_done;              /**< ... and how many of them the kernel has released */
+  microtcp_header_t * zc_hdrs;   /**< Headers of MSG_ZEROCOPY datagrams; the kernel references them until released */
+  uint32_t zc_slot;              /**< Next free entry of 'zc_hdrs' */
+
+  struct microtcp_async * async; /**< Send ring and transmission thread (MICROTCP_SO_SNDRING), or NULL */
+  struct microtcp_trace * trace; /**< Trace ring (MICROTCP_SO_TRACE), or NULL */
+  int cork;                      /**< MICROTCP_SO_CORK */
+  struct microtcp_cork * corked; /**< Data a corked synchronous socket holds back, and its timer thread, or NULL */
+  microtcp_msg_t * msgs;         /**< Pool of the messages lent by microtcp_recv_msg() ... */
+  uint32_t msg_head;             /**< ... the oldest one not released yet ... */
+  uint32_t msg_tail;             /**< ... and the next one to be lent, both modulo MICROTCP_MSG_POOL */
+  uint32_t rcv_lent;             /**< Sequence number right after the last message lent */
   
-  size_t seq_number;             /**< Keep the state of the sequence number */
-  size_t ack_number;             /**< Keep the state of the ack number */
-  uint64_t packets_send;
+  uint32_t seq_number;           /**< Keep the state of the sequence number */
+  uint32_t ack_number;           /**< Keep the state of the ack number */
+  uint64_t packets_send;         /**< Counters, see microtcp_stats_t */
   uint64_t packets_received;
   uint64_t packets_lost;
   uint64_t bytes_send;
   uint64_t bytes_received;
   uint64_t bytes_lost;
+  uint64_t timeouts;
+  uint64_t dup_acks;
+  uint64_t checksum_errors;
 
 } microtcp_sock_t;
 
+/**
+ * A snapshot of the counters of a socket, see microtcp_get_stats()
+ */
+typedef struct
+{
+  uint64_t packets_send;          /**< Datagrams sent, retransmissions and ACKs included */
+  uint64_t packets_received;      /**< Datagrams received, damaged ones included */
+  uint64_t packets_lost;          /**< Segments retransmitted, after a timeout, duplicate ACKs or a NAK */
+  uint64_t bytes_send;            /**< Bytes of 'packets_send', headers included */
+  uint64_t bytes_received;        /**< Bytes of 'packets_received', headers included */
+  uint64_t bytes_lost;            /**< Payload bytes of 'packets_lost' */
+  uint64_t timeouts;              /**< Retransmission timer expirations */
+  uint64_t dup_acks;              /**< Duplicate ACKs received */
+  uint64_t checksum_errors;       /**< Datagrams dropped for a wrong checksum */
+  size_t cwnd;                    /**< Congestion window (bytes) */
+  size_t ssthresh;                /**< Slow start threshold (bytes) */
+  uint32_t mss;                   /**< Current segment payload size */
+  uint32_t srtt;                  /**< Smoothed round-trip time (us), 0 until the first sample */
+  uint32_t rttvar;                /**< Round-trip time variation (us) */
+  uint32_t rto;                   /**< Retransmission timeout (us) */
+} microtcp_stats_t;
+
+/**
+ * Events of the trace ring
+ */
+typedef enum
+{
+  MICROTCP_TRACE_RX,             /**< A segment was received */
+  MICROTCP_TRACE_TX,             /**< A segment was sent */
+  MICROTCP_TRACE_RTX,            /**< A segment was sent again */
+  MICROTCP_TRACE_BAD_CSUM,       /**< A segment was received with a wrong checksum, and dropped */
+  MICROTCP_TRACE_TIMEOUT,        /**< The retransmission timer expired; 'seq' is the oldest unacknowledged byte */
+  MICROTCP_TRACE_FAST_RTX,       /**< 3 duplicate ACKs; 'seq' is the oldest unacknowledged byte */
+} microtcp_trace_event_t;
 
 /**
- * microTCP header structure
- * NOTE: DO NOT CHANGE!
+ * A record of the trace ring. The header fields are in host byte order, and 0 for the
+ * events that have no segment.
  */
 typedef struct
 {
-  uint32_t seq_number;          /**< Sequence number */
-  uint32_t ack_number;          /**< ACK number */
-  uint16_t control;             /**< Control bits (e.g. SYN, ACK, FIN) */
-  uint16_t window;              /**< Window size in bytes */
-  uint32_t data_len;            /**< Data length in bytes (EXCLUDING header) */
-  uint32_t future_use0;         /**< 32-bits for future use */
-  uint32_t future_use1;         /**< 32-bits for future use */
-  uint32_t future_use2;         /**< 32-bits for future use */
-  uint32_t checksum;            /**< CRC-32 checksum, see crc32() in utils folder */
-} microtcp_header_t;
+  uint64_t tsc;                  /**< Cycle counter (x86) or monotonic clock (ns), see microtcp_trace_hdr_t */
+  uint32_t seq_number;
+  uint32_t ack_number;
+  uint32_t data_len;
+  uint32_t checksum;
+  uint32_t cwnd;                 /**< Congestion window of the socket at the time */
+  uint16_t window;
+  uint8_t control;
+  uint8_t event;                 /**< A microtcp_trace_event_t */
+} microtcp_trace_rec_t;
+
+#define MICROTCP_TRACE_MAGIC "MTCPTRC1"
+
+/**
+ * Header of a trace file, written by microtcp_trace_dump() and followed by 'count' records,
+ * oldest first. The clock of the records is mapped to nanoseconds by the two pairs of
+ * readings of both clocks, taken when the ring was created and when it was dumped.
+ */
+typedef struct
+{
+  char magic[8];                 /**< MICROTCP_TRACE_MAGIC */
+  uint32_t rec_size;             /**< sizeof(microtcp_trace_rec_t) */
+  uint32_t count;
+  uint64_t tsc0;
+  uint64_t ns0;
+  uint64_t tsc1;
+  uint64_t ns1;
+} microtcp_trace_hdr_t;
+
+/**
+ * What the congestion control learns from an ACK that slides the window
+ */
+typedef struct
+{
+  uint64_t now;                  /**< Monotonic clock, microseconds */
+  uint32_t acked;                /**< Bytes newly acknowledged */
+  uint32_t rtt;                  /**< Round-trip time sample (us), 0 if none */
+  uint64_t inflight;             /**< Bytes still in flight */
+  int in_recovery;               /**< The ACK is a partial ACK of fast recovery ... */
+  int recovered;                 /**< ... or it ends fast recovery */
+} microtcp_cc_sample_t;
+
+/**
+ * A congestion control module. It owns 'cwnd' and 'ssthresh' of the socket, and may keep
+ * its own state in 'cc_priv'. Every callback but 'pacing_rate' is required.
+ */
+typedef struct microtcp_cc_ops
+{
+  const char * name;
+  void (*init)(microtcp_sock_t * sock);      /**< The connection is established, or the module selected */
+  void (*on_ack)(microtcp_sock_t * sock, const microtcp_cc_sample_t * rs);
+  void (*on_loss)(microtcp_sock_t * sock, uint64_t inflight);  /**< Fast retransmit (3 duplicate ACKs) */
+  void (*on_rto)(microtcp_sock_t * sock, uint64_t inflight);   /**< The retransmission timer expired */
+  uint64_t (*pacing_rate)(const microtcp_sock_t * sock);       /**< Bytes per second, 0 for no pacing */
+} microtcp_cc_ops_t;
+
+extern const microtcp_cc_ops_t microtcp_cc_newreno;  /**< RFC 5681 / 6582, the default */
+extern const microtcp_cc_ops_t microtcp_cc_cubic;    /**< RFC 9438 */
+extern const microtcp_cc_ops_t microtcp_cc_bbr;      /**< Model-based, after BBR v1; paces */
+
+/**
+ * A listener serves any number of connections over one bound UDP socket. Every datagram
+ * it receives is routed by the address of its sender: to the connection of that peer,
+ * or, if it is a SYN from a new peer, to the backlog of microtcp_listener_accept().
+ *
+ * The calls block, so every connection needs a thread of its own (and so does
+ * microtcp_listener_accept()): a thread blocked on one connection serves no other. The
+ * listener is locked, and each connection may be used by its thread at the same time as
+ * the others; one thread at a time, among those that are waiting, reads the socket on
+ * behalf of all of them and wakes up the ones it has received something for.
+ */
+typedef struct microtcp_listener
+{
+  int sd;                              /**< The bound UDP socket, shared by every connection */
+  microtcp_sock_t ** conns;            /**< Connection table, keyed by peer address (open addressing) */
+  size_t conns_len;                    /**< Number of slots of 'conns', a power of 2 */
+  size_t nconns;                       /**< Connections in the table */
+  struct microtcp_dgram * backlog;     /**< SYNs of peers that have not been accepted yet ... */
+  struct microtcp_dgram * backlog_tail;
+  uint32_t backlog_len;                /**< ... and how many */
+  struct microtcp_rxbatch * rx;        /**< recvmmsg() scratch space of the reading thread */
+  pthread_mutex_t lock;                /**< Guards the fields above and the queues of the connections */
+  struct microtcp_waiter * waiters;    /**< Threads blocked on the listener ... */
+  int reading;                         /**< ... and whether one of them is reading 'sd' */
+} microtcp_listener_t;
+
+/**
+ * Serves a connection accepted by a microtcp_runtime_t, on a thread of its own. The
+ * handler should shut the connection down before returning.
+ */
+typedef int (*microtcp_handler_t)(microtcp_sock_t * socket, const struct sockaddr * peer, socklen_t peer_len,
+                                  void * arg);
+
+struct microtcp_runtime;
+
+/**
+ * One shard of a runtime: a listener on its own SO_REUSEPORT socket, and the thread that
+ * accepts its connections, pinned to one CPU. Each connection is served by a thread of
+ * its own, pinned to the same CPU, so a shard serves any number of them at once.
+ */
+typedef struct
+{
+  pthread_t thread;
+  microtcp_listener_t listener;
+  int cpu;                       /**< The CPU the threads are pinned to, -1 for none */
+  uint64_t conns;                /**< Connections accepted so far */
+  pthread_mutex_t lock;
+  pthread_cond_t idle;           /**< Signalled when 'active' drops to 0 */
+  unsigned int active;           /**< Connections being served */
+  struct microtcp_runtime * rt;
+} microtcp_shard_t;
+
+/**
+ * A sharded server: N listeners bound to the same port with SO_REUSEPORT, one thread per
+ * listener. The kernel hashes the address of every peer to one of the sockets, so each
+ * connection lives on a single shard and shards share no state.
+ */
+typedef struct microtcp_runtime
+{
+  microtcp_shard_t * shards;
+  unsigned int nshards;
+  int stopfd;                    /**< eventfd, readable once microtcp_runtime_stop() is called */
+  volatile int stopping;
+  microtcp_handler_t handler;
+  void * arg;
+} microtcp_runtime_t;
+
+
 
 
 microtcp_sock_t microtcp_socket(int domain, int type, int protocol);
@@ -147,6 +428,64 @@ int microtcp_connect(microtcp_sock_t * __restrict__ socket, const struct sockadd
 int microtcp_accept(microtcp_sock_t * __restrict__ socket, struct sockaddr * __restrict__ address,
                  socklen_t address_len);
 
+/**
+ * Creates a listener bound to 'address'.
+ *
+ * @param listener the listener to initialize
+ * @param address the local address
+ * @param address_len the length of the address structure
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_listen(microtcp_listener_t * __restrict__ listener, const struct sockaddr * __restrict__ address,
+                 socklen_t address_len);
+
+/**
+ * Blocks waiting for a new connection on a listener. The connection shares the socket
+ * of the listener: 'socket' must stay at the same address until it is shut down, and its
+ * 'sd' must not be closed.
+ *
+ * @param listener a listener created by microtcp_listen()
+ * @param socket where the state of the new connection is stored
+ * @param address pointer to store the address information of the connected peer, or NULL
+ * @param address_len the length of the address structure.
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_listener_accept(microtcp_listener_t * __restrict__ listener, microtcp_sock_t * __restrict__ socket,
+                 struct sockaddr * __restrict__ address, socklen_t address_len);
+
+/**
+ * Closes the socket of a listener and frees its resources. Its connections must have
+ * been shut down already.
+ *
+ * @param listener a listener created by microtcp_listen()
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_listener_close(microtcp_listener_t * listener);
+
+/**
+ * Starts a sharded server on 'address'. Each shard thread accepts the connections the kernel
+ * hashes to its socket and calls 'handler' for each of them on a new thread.
+ *
+ * @param rt the runtime to initialize
+ * @param address the local address, shared by every shard
+ * @param address_len the length of the address structure
+ * @param nshards the number of shards, 0 for one per CPU the process may run on
+ * @param handler called for every accepted connection
+ * @param arg passed to 'handler'
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_runtime_start(microtcp_runtime_t * __restrict__ rt, const struct sockaddr * __restrict__ address,
+                 socklen_t address_len, unsigned int nshards, microtcp_handler_t handler, void * arg);
+
+/**
+ * Stops a runtime: the shards stop accepting connections, finish the ones they are serving
+ * and exit. Their listeners are closed.
+ *
+ * @param rt a runtime started with microtcp_runtime_start()
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_runtime_stop(microtcp_runtime_t * rt);
+
 /**
  * @brief 
  * 
@@ -159,17 +498,122 @@ int microtcp_accept(microtcp_sock_t * __restrict__ socket, struct sockaddr * __r
 int microtcp_shutdown(microtcp_sock_t *socket, int how);
 
 /**
- * @brief 
+ * @brief Sends 'length' bytes of 'buffer' as one message. Up to min(cwnd, peer window)
+ * bytes are kept in flight; the window slides on every cumulative ACK. Blocks until
+ * every byte has been acknowledged by the peer.
  * 
- * @param socket 
- * @param buffer 
- * @param length 
- * @param flags NOT SUPPORTED
- * @return ssize_t 
+ * @param socket a valid microTCP socket object
+ * @param buffer the data to send
+ * @param length the number of bytes to send
+ * @param flags 0 or MICROTCP_MSG_ZEROCOPY. With MICROTCP_MSG_ZEROCOPY, sends of at least
+ * MICROTCP_ZEROCOPY_MIN bytes are transmitted straight from the pages of 'buffer' (MSG_ZEROCOPY),
+ * if the kernel supports it. Either way, 'buffer' may be reused as soon as the call returns.
+ * In asynchronous mode (see MICROTCP_SO_SNDRING), the data is copied into the send ring and
+ * the call returns at once, blocking only while the ring is full; 'flags' is ignored.
+ * @return the number of bytes sent, else -1
  */
 ssize_t microtcp_send(microtcp_sock_t * __restrict__ socket, const void * __restrict__ buffer, size_t length,
                int flags);
 
+/**
+ * @brief Sends 'count' bytes of the file 'fd', from 'offset' on, as one message. The file is
+ * mapped a window at a time and segmented straight from the page cache, with readahead, so
+ * any size is sent with constant memory and no copy in user space. Like microtcp_send(),
+ * blocks until every byte has been acknowledged; in asynchronous mode the windows are copied
+ * into the send ring instead. The file must not be truncated meanwhile (SIGBUS).
+ * 
+ * @param socket a valid microTCP socket object
+ * @param fd a regular file, open for reading
+ * @param offset where the data starts in the file
+ * @param count the number of bytes to send, cut short at the end of the file
+ * @return the number of bytes sent, else -1
+ */
+ssize_t microtcp_sendfile(microtcp_sock_t * __restrict__ socket, int fd, off_t offset, size_t count);
+
+/**
+ * @brief Sends at once the data that MICROTCP_SO_CORK holds back, as the end of a message.
+ * Does nothing if there is none. An asynchronous socket returns without waiting.
+ * 
+ * @param socket a valid microTCP socket object
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_flush(microtcp_sock_t * socket);
+
+/**
+ * @brief Sets an option of a microTCP socket.
+ *
+ * MICROTCP_SO_SNDRING ('value' is a size_t): makes the socket asynchronous. microtcp_send()
+ * copies into a send ring of that many bytes (rounded up to a power of 2) and returns, while
+ * a thread of the socket transmits the ring, processes the ACKs and runs the retransmission
+ * timer. microtcp_recv() and microtcp_shutdown() wait for the ring to be acknowledged first.
+ * 0 waits for the ring to drain and makes the socket synchronous again. 'socket' must stay at
+ * the same address while it is asynchronous. Not supported on connections of a listener.
+ *
+ * MICROTCP_SO_RCVBUF ('value' is a size_t): the length of the receive ring, rounded up to a
+ * power of 2 (MICROTCP_RECVBUF_LEN by default). It bounds the window, so it should cover
+ * the bandwidth-delay product of the path. Must be set before the connection is established.
+ *
+ * MICROTCP_SO_CONGESTION ('value' is a const microtcp_cc_ops_t *): the congestion control
+ * of the socket, e.g. &microtcp_cc_cubic. It starts over from its initial state, and so do
+ * the congestion window and the slow start threshold, as on a new connection.
+ *
+ * MICROTCP_SO_TRACE ('value' is a size_t): records every segment sent and received, and the
+ * timeouts and fast retransmits, in a ring of that many records (rounded up to a power of 2),
+ * overwriting the oldest. Each record costs a few nanoseconds; see microtcp_trace_dump().
+ * 0 frees the ring, which is otherwise kept after microtcp_shutdown().
+ *
+ * MICROTCP_SO_CORK ('value' is an int): non zero joins small sends into full segments. An
+ * asynchronous socket holds back the tail that does not fill a segment while earlier data is
+ * unacknowledged (Nagle). A synchronous one (which has nothing unacknowledged between calls)
+ * holds back the sends shorter than a segment, up to MICROTCP_CORK_LEN bytes of them and for
+ * at most MICROTCP_CORK_DELAY_US, after which a thread of the socket sends them; 'socket'
+ * must stay at the same address until microtcp_shutdown(). A longer send goes out at once:
+ * joined to what is held back if they fit in MICROTCP_CORK_LEN, else as if the socket were
+ * not corked (honouring MICROTCP_MSG_ZEROCOPY), after what is held back topped up to whole
+ * segments. microtcp_flush(), microtcp_recv() and microtcp_shutdown() release what is held
+ * back at once. Messages end only where a send ended, but sends that share a segment end one
+ * message, so receivers should read fixed amounts rather than rely on microtcp_recv_msg().
+ * 0 releases what is held back.
+ *
+ * @param socket a valid microTCP socket object
+ * @param option the option to set
+ * @param value the new value
+ * @param value_len the size of 'value'
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_setsockopt(microtcp_sock_t * __restrict__ socket, int option, const void * __restrict__ value,
+               socklen_t value_len);
+
+/**
+ * @brief Looks a congestion control module up by name ("newreno", "cubic" or "bbr").
+ *
+ * @return the module, or NULL if there is none by that name
+ */
+const microtcp_cc_ops_t * microtcp_cc_by_name(const char * name);
+
+/**
+ * @brief Takes a snapshot of the counters of a socket. They count from the creation of the
+ * socket (or the acceptance of the connection) and are never reset. In asynchronous mode the
+ * thread of the socket keeps updating them, so the snapshot may be a moment old.
+ *
+ * @param socket a valid microTCP socket object
+ * @param stats where the snapshot is stored
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_get_stats(const microtcp_sock_t * __restrict__ socket, microtcp_stats_t * __restrict__ stats);
+
+/**
+ * @brief Writes the trace ring of a socket to 'fd': a microtcp_trace_hdr_t, followed by the
+ * records still in the ring, oldest first. Decode it with the trace_decode tool. The ring
+ * outlives microtcp_shutdown(), so it may be dumped once the connection is closed. Records
+ * written while the dump runs may come out torn.
+ *
+ * @param socket a microTCP socket with a trace ring (see MICROTCP_SO_TRACE)
+ * @param fd where the trace is written
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_trace_dump(const microtcp_sock_t * socket, int fd);
+
 /**
  * @brief The receive calls normally return any data available, up to the requested amount rather
  * than waiting for receipt of the full amount requested.
@@ -182,5 +626,43 @@ ssize_t microtcp_send(microtcp_sock_t * __restrict__ socket, const void * __rest
  */
 ssize_t microtcp_recv(microtcp_sock_t * __restrict__ socket, void * __restrict__ buffer, size_t length, int flags);
 
+/**
+ * @brief Receives 'count' bytes of the stream into 'fd', ignoring message boundaries. The data
+ * is written straight from the receive ring, and only in large pieces: pwritev() at the
+ * file offset of 'fd' (which is then moved past the data), or writev() if 'fd' is not seekable.
+ * Returns early only if the peer closes the connection.
+ * 
+ * @param socket a valid microTCP socket object
+ * @param fd where the data is written
+ * @param count the number of bytes to receive
+ * @return the number of bytes written, else -1
+ */
+ssize_t microtcp_recvfile(microtcp_sock_t * __restrict__ socket, int fd, size_t count);
+
+/**
+ * @brief Receives the next message without copying it: the message is lent in place, in the
+ * receive ring, and its room is only freed (and the window reopened) by microtcp_release_msg().
+ * Up to MICROTCP_MSG_POOL messages may be held at a time, released in any order, but they take
+ * room from the window, so they should not be held for long. microtcp_recv() and
+ * microtcp_recvfile() fail with EBUSY while a message is held. A message must fit in the
+ * receive ring (EMSGSIZE), see MICROTCP_SO_RCVBUF. If the peer closes the connection in the
+ * middle of a message, what has arrived of it is returned as a message.
+ * 
+ * @param socket a valid microTCP socket object
+ * @param msg set to the message, valid until it is released or the connection is shut down
+ * @return the length of the message, else -1 (the peer has closed the connection, or ENOBUFS
+ * if too many messages are held)
+ */
+ssize_t microtcp_recv_msg(microtcp_sock_t * __restrict__ socket, const microtcp_msg_t ** __restrict__ msg);
+
+/**
+ * @brief Gives a message of microtcp_recv_msg() back to the socket.
+ * 
+ * @param socket the socket that lent the message
+ * @param msg the message
+ * @return 0 on success or -1 on failure
+ */
+int microtcp_release_msg(microtcp_sock_t * __restrict__ socket, const microtcp_msg_t * __restrict__ msg);
+
 
 #endif /* LIB_MICROTCP_H_ */
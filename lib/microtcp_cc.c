@@ -0,0 +1,436 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Congestion control modules, see microtcp_cc_ops_t.
+ */
+
+#include "microtcp.h"
+
+#include <string.h>
+#include <math.h>
+
+
+#define MIN2(x, y) ( (x > y) ? y : x )
+#define MAX2(x, y) ( (x > y) ? x : y )
+
+// the private state of a module must fit into microtcp_sock_t::cc_priv
+#define CC_PRIV(sock, type) \
+	( (void)sizeof(char[1 - 2 * (sizeof(type) > sizeof((sock)->cc_priv))]), (type *)((sock)->cc_priv) )
+
+
+////////////////////////////////////////////////////////////////////////// NewReno
+
+/*
+ * NewReno (RFC 5681, RFC 6582): slow start while cwnd < ssthresh, then one MSS per RTT;
+ * the window is halved on a loss and collapses to one MSS on a timeout.
+ */
+
+static void _reno_init(microtcp_sock_t * sock)
+{
+	(void)(sock);
+}
+
+static void _reno_on_ack(microtcp_sock_t * sock, const microtcp_cc_sample_t * rs)
+{
+	if ( rs->in_recovery )
+		return;
+
+	if ( rs->recovered ) {
+
+		sock->cwnd = sock->ssthresh;  // deflate the window
+		return;
+	}
+
+	if ( sock->cwnd < sock->ssthresh )  // slow start, with byte counting (RFC 3465, L = 2)
+		sock->cwnd += MIN2(rs->acked, 2UL * sock->mss);
+	else  // congestion avoidance: ~ one MSS per RTT, whatever the ACK rate
+		sock->cwnd += MAX2((uint64_t)(sock->mss) * rs->acked / sock->cwnd, 1UL);
+}
+
+static void _reno_on_loss(microtcp_sock_t * sock, uint64_t inflight)
+{
+	sock->ssthresh = MAX2(inflight / 2, 2UL * sock->mss);
+	sock->cwnd     = sock->ssthresh;
+}
+
+static void _reno_on_rto(microtcp_sock_t * sock, uint64_t inflight)
+{
+	sock->ssthresh = MAX2(inflight / 2, 2UL * sock->mss);
+	sock->cwnd     = sock->mss;
+}
+
+const microtcp_cc_ops_t microtcp_cc_newreno = {
+	.name        = "newreno",
+	.init        = _reno_init,
+	.on_ack      = _reno_on_ack,
+	.on_loss     = _reno_on_loss,
+	.on_rto      = _reno_on_rto,
+	.pacing_rate = NULL,
+};
+
+
+////////////////////////////////////////////////////////////////////////// CUBIC
+
+/*
+ * CUBIC (RFC 9438): after a loss the window grows along a cubic curve of the time since
+ * the loss, concave up to the window at which the loss happened, convex past it. The
+ * growth does not depend on the RTT, and the window is only cut by 30%.
+ */
+
+#define CUBIC_C     0.4
+#define CUBIC_BETA  0.7
+
+struct cubic
+{
+	double w_max;       // window before the last reduction (bytes)
+	double k;           // time to grow back to w_max (s)
+	double origin;      // window at the plateau of the curve (bytes)
+	double w_est;       // window Reno would have (bytes)
+	uint64_t epoch;     // start of the current growth period (us), 0 if none
+};
+
+static void _cubic_init(microtcp_sock_t * sock)
+{
+	memset(CC_PRIV(sock, struct cubic), 0, sizeof(struct cubic));
+}
+
+static void _cubic_on_ack(microtcp_sock_t * sock, const microtcp_cc_sample_t * rs)
+{
+	struct cubic * c = CC_PRIV(sock, struct cubic);
+	double mss = sock->mss;
+	double cwnd = sock->cwnd;
+	double target;
+	double t;
+
+
+	if ( rs->in_recovery )
+		return;
+
+	if ( rs->recovered ) {
+
+		sock->cwnd = sock->ssthresh;
+		return;
+	}
+
+	if ( sock->cwnd < sock->ssthresh ) {
+
+		sock->cwnd += MIN2(rs->acked, 2UL * sock->mss);
+		return;
+	}
+
+	if ( !c->epoch ) {
+
+		c->epoch = rs->now;
+		c->w_est = cwnd;
+
+		if ( cwnd < c->w_max ) {
+
+			c->k      = cbrt((c->w_max - cwnd) / mss / CUBIC_C);
+			c->origin = c->w_max;
+		}
+		else {
+
+			c->k      = 0.0;
+			c->origin = cwnd;
+		}
+	}
+
+	// where the curve is one RTT from now
+	t      = (double)(rs->now - c->epoch + sock->srtt) / 1e6 - c->k;
+	target = c->origin + CUBIC_C * t * t * t * mss;
+	target = MIN2(MAX2(target, cwnd), 1.5 * cwnd);
+
+	c->w_est += mss * (3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA)) * rs->acked / cwnd;
+
+	if ( c->w_est > target )  // Reno-friendly region
+		sock->cwnd = (size_t)(c->w_est);
+	else
+		sock->cwnd += (size_t)((target - cwnd) * rs->acked / cwnd);
+}
+
+static void _cubic_reduce(microtcp_sock_t * sock)
+{
+	struct cubic * c = CC_PRIV(sock, struct cubic);
+	double cwnd = sock->cwnd;
+
+
+	// fast convergence: a flow that lost before reaching its old plateau yields bandwidth
+	c->w_max = ( cwnd < c->w_max ) ? cwnd * (1.0 + CUBIC_BETA) / 2.0 : cwnd;
+	c->epoch = 0UL;
+
+	sock->ssthresh = MAX2((size_t)(cwnd * CUBIC_BETA), 2UL * sock->mss);
+}
+
+static void _cubic_on_loss(microtcp_sock_t * sock, uint64_t inflight)
+{
+	(void)(inflight);
+
+	_cubic_reduce(sock);
+	sock->cwnd = sock->ssthresh;
+}
+
+static void _cubic_on_rto(microtcp_sock_t * sock, uint64_t inflight)
+{
+	(void)(inflight);
+
+	_cubic_reduce(sock);
+	sock->cwnd = sock->mss;
+}
+
+const microtcp_cc_ops_t microtcp_cc_cubic = {
+	.name        = "cubic",
+	.init        = _cubic_init,
+	.on_ack      = _cubic_on_ack,
+	.on_loss     = _cubic_on_loss,
+	.on_rto      = _cubic_on_rto,
+	.pacing_rate = NULL,
+};
+
+
+////////////////////////////////////////////////////////////////////////// BBR
+
+/*
+ * A BBR-style controller (after BBR v1): a model of the path, its bottleneck bandwidth
+ * (windowed max of the delivery rate) and its propagation delay (windowed min of the RTT),
+ * sets the pacing rate and caps the data in flight to a small multiple of the BDP. Losses
+ * do not shrink the model.
+ *
+ *  - STARTUP: doubles the rate every round until the bandwidth stops growing,
+ *  - DRAIN: drains the queue STARTUP built,
+ *  - PROBE_BW: cycles the pacing gain (5/4, 3/4, then 1) to probe for more bandwidth,
+ *  - PROBE_RTT: every 10 s without a new min RTT, drops to 4 segments for 200 ms.
+ */
+
+#define BBR_UNIT            256U   // fixed point unit of the gains
+#define BBR_HIGH_GAIN       739U   // 2 / ln(2)
+#define BBR_DRAIN_GAIN      88U    // 1 / BBR_HIGH_GAIN
+#define BBR_CWND_GAIN       512U
+#define BBR_BW_ROUNDS       10U    // length of the bandwidth filter, in rounds
+#define BBR_MIN_RTT_US      10000000UL
+#define BBR_PROBE_RTT_US    200000UL
+#define BBR_MIN_CWND_SEGS   4U
+
+enum { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT };
+
+static const uint32_t bbr_cycle_gain[8] = { 320U, 192U, 256U, 256U, 256U, 256U, 256U, 256U };
+
+struct bbr
+{
+	uint64_t bw[BBR_BW_ROUNDS];  // max delivery rate of the last rounds (bytes/s)
+	uint64_t btl_bw;             // max of 'bw'
+	uint64_t full_bw;            // bandwidth at the last time it grew by 25%
+	uint64_t delivered;          // bytes acknowledged so far
+	uint64_t rs_stamp;           // start of the current rate sample (us) ...
+	uint64_t rs_delivered;       // ... and 'delivered' then
+	uint64_t min_rtt_stamp;      // when 'min_rtt' was measured
+	uint64_t cycle_stamp;        // start of the current PROBE_BW phase
+	uint64_t probe_rtt_done;     // end of PROBE_RTT
+	uint64_t prior_cwnd;         // cwnd before PROBE_RTT
+	uint32_t min_rtt;            // us, 0 until the first sample
+	uint32_t round;
+	uint32_t full_bw_cnt;        // rounds without 25% growth
+	uint32_t mode;
+	uint32_t cycle_idx;
+	uint32_t pacing_gain;
+	uint32_t cwnd_gain;
+};
+
+static void _bbr_init(microtcp_sock_t * sock)
+{
+	struct bbr * b = CC_PRIV(sock, struct bbr);
+
+
+	memset(b, 0, sizeof(*b));
+	b->mode        = BBR_STARTUP;
+	b->pacing_gain = BBR_HIGH_GAIN;
+	b->cwnd_gain   = BBR_HIGH_GAIN;
+
+	sock->ssthresh = SIZE_MAX;  // not used
+}
+
+static uint64_t _bbr_bdp(const microtcp_sock_t * sock, const struct bbr * b, uint32_t gain)
+{
+	if ( !b->btl_bw || !b->min_rtt )
+		return 0UL;
+
+	return b->btl_bw * b->min_rtt / 1000000UL * gain / BBR_UNIT + 3UL * sock->mss;
+}
+
+/**
+ * Called once per round trip, with a new delivery rate sample.
+ */
+static void _bbr_on_round(microtcp_sock_t * sock, struct bbr * b, uint64_t bw, const microtcp_cc_sample_t * rs)
+{
+	uint32_t i;
+
+
+	b->bw[b->round++ % BBR_BW_ROUNDS] = bw;
+	b->btl_bw = 0UL;
+
+	for ( i = 0U; i < BBR_BW_ROUNDS; ++i )
+		b->btl_bw = MAX2(b->btl_bw, b->bw[i]);
+
+	if ( b->mode == BBR_STARTUP ) {
+
+		if ( b->btl_bw >= b->full_bw * 5U / 4U ) {
+
+			b->full_bw     = b->btl_bw;
+			b->full_bw_cnt = 0U;
+		}
+		else if ( ++b->full_bw_cnt >= 3U ) {  // the pipe is full
+
+			b->mode        = BBR_DRAIN;
+			b->pacing_gain = BBR_DRAIN_GAIN;
+			b->cwnd_gain   = BBR_HIGH_GAIN;
+		}
+	}
+
+	if ( (b->mode == BBR_DRAIN) && (rs->inflight <= _bbr_bdp(sock, b, BBR_UNIT)) ) {
+
+		b->mode        = BBR_PROBE_BW;
+		b->cycle_idx   = 0U;
+		b->cycle_stamp = rs->now;
+		b->pacing_gain = bbr_cycle_gain[0];
+		b->cwnd_gain   = BBR_CWND_GAIN;
+	}
+}
+
+static void _bbr_on_ack(microtcp_sock_t * sock, const microtcp_cc_sample_t * rs)
+{
+	struct bbr * b = CC_PRIV(sock, struct bbr);
+	uint64_t interval;
+	uint64_t target;
+	uint64_t min_cwnd = BBR_MIN_CWND_SEGS * sock->mss;
+
+
+	b->delivered += rs->acked;
+
+	if ( !b->rs_stamp ) {
+
+		b->rs_stamp     = rs->now;
+		b->rs_delivered = b->delivered;
+	}
+
+	if ( rs->rtt && (!b->min_rtt || (rs->rtt <= b->min_rtt) || (rs->now - b->min_rtt_stamp > BBR_MIN_RTT_US)) ) {
+
+		b->min_rtt       = rs->rtt;
+		b->min_rtt_stamp = rs->now;
+	}
+
+	// a rate sample per round trip
+	interval = rs->now - b->rs_stamp;
+
+	if ( b->min_rtt && (interval >= b->min_rtt) ) {
+
+		_bbr_on_round(sock, b, (b->delivered - b->rs_delivered) * 1000000UL / interval, rs);
+		b->rs_stamp     = rs->now;
+		b->rs_delivered = b->delivered;
+	}
+
+	if ( (b->mode == BBR_PROBE_BW) && (rs->now - b->cycle_stamp > b->min_rtt) ) {
+
+		b->cycle_idx   = (b->cycle_idx + 1U) % 8U;
+		b->cycle_stamp = rs->now;
+		b->pacing_gain = bbr_cycle_gain[b->cycle_idx];
+	}
+
+	if ( (b->mode != BBR_PROBE_RTT) && (b->mode != BBR_STARTUP) && (rs->now - b->min_rtt_stamp > BBR_MIN_RTT_US) ) {
+
+		b->mode           = BBR_PROBE_RTT;  // the min RTT is stale: drain the queue to measure it again
+		b->pacing_gain    = BBR_UNIT;
+		b->prior_cwnd     = sock->cwnd;
+		b->probe_rtt_done = rs->now + MAX2(BBR_PROBE_RTT_US, (uint64_t)(b->min_rtt));
+		b->min_rtt        = 0U;
+	}
+
+	if ( b->mode == BBR_PROBE_RTT ) {
+
+		sock->cwnd = min_cwnd;
+
+		if ( rs->now >= b->probe_rtt_done ) {
+
+			b->mode        = BBR_PROBE_BW;
+			b->cycle_idx   = 2U;
+			b->cycle_stamp = rs->now;
+			b->pacing_gain = BBR_UNIT;
+			sock->cwnd     = MAX2(b->prior_cwnd, min_cwnd);
+		}
+
+		return;
+	}
+
+	// grow towards the target, one ACKed byte at a time
+	target = _bbr_bdp(sock, b, b->cwnd_gain);
+
+	if ( !target || ((b->mode == BBR_STARTUP) && (sock->cwnd < target)) )
+		sock->cwnd += rs->acked;
+	else
+		sock->cwnd = MIN2(sock->cwnd + rs->acked, target);
+
+	sock->cwnd = MAX2(sock->cwnd, min_cwnd);
+}
+
+static void _bbr_on_loss(microtcp_sock_t * sock, uint64_t inflight)
+{
+	(void)(sock);
+	(void)(inflight);
+}
+
+static void _bbr_on_rto(microtcp_sock_t * sock, uint64_t inflight)
+{
+	(void)(inflight);
+
+	sock->cwnd = sock->mss;  // the model is kept: the window grows back within a round
+}
+
+static uint64_t _bbr_pacing_rate(const microtcp_sock_t * sock)
+{
+	const struct bbr * b = (const struct bbr *)(sock->cc_priv);
+
+
+	if ( !b->btl_bw )  // no estimate yet: the initial window over the handshake RTT, at high gain
+		return (uint64_t)(sock->cwnd) * 1000000UL / MAX2(sock->srtt, 1000U) * BBR_HIGH_GAIN / BBR_UNIT;
+
+	return b->btl_bw * b->pacing_gain / BBR_UNIT;
+}
+
+const microtcp_cc_ops_t microtcp_cc_bbr = {
+	.name        = "bbr",
+	.init        = _bbr_init,
+	.on_ack      = _bbr_on_ack,
+	.on_loss     = _bbr_on_loss,
+	.on_rto      = _bbr_on_rto,
+	.pacing_rate = _bbr_pacing_rate,
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+
+const microtcp_cc_ops_t * microtcp_cc_by_name(const char * name)
+{
+	static const microtcp_cc_ops_t * const modules[] = { &microtcp_cc_newreno, &microtcp_cc_cubic, &microtcp_cc_bbr };
+	size_t i;
+
+
+	for ( i = 0UL; name && (i < sizeof(modules) / sizeof(modules[0])); ++i )
+		if ( !strcmp(modules[i]->name, name) )
+			return modules[i];
+
+	return NULL;
+}
@@ -26,22 +26,57 @@
 #include <stdint.h>
 #include <ifaddrs.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <stddef.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "../lib/microtcp.h"
 
 #define CHUNK_SIZE 4096
+/* microTCP never puts two messages in one segment: send it large ones */
+#define MICROTCP_CHUNK_SIZE (1024 * 1024)
+/* Send ring of the microTCP client, so that it does not wait for the ACKs of every message */
+#define MICROTCP_CLIENT_SNDRING (4UL << 20)
+
+/*
+ * What the client measured for one transfer
+ */
+struct transfer_report
+{
+  const char *name;
+  size_t bytes;
+  double elapsed;           /* From connect() until the server has it all */
+  double cpu;               /* User and system time of the process */
+  uint64_t retransmissions; /* Segments sent again */
+};
+
+/* Congestion control of the microTCP sockets (-c), NULL for the default */
+static const microtcp_cc_ops_t *congestion;
+
+static inline double
+cpu_seconds (void)
+{
+  struct rusage ru;
+  getrusage (RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+      + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+static inline double
+elapsed_seconds (struct timespec start, struct timespec end)
+{
+  return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
 
 static inline void
 print_statistics (ssize_t received, struct timespec start, struct timespec end)
 {
-  double elapsed = end.tv_sec - start.tv_sec
-      + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  double elapsed = elapsed_seconds (start, end);
   double megabytes = received / (1024.0 * 1024.0);
   printf ("Data received: %f MB\n", megabytes);
   printf ("Transfer time: %f seconds\n", elapsed);
@@ -156,24 +191,134 @@ server_tcp (uint16_t listen_port, const char *file)
   return 0;
 }
 
+/*
+ * Binds a microTCP socket to 'listen_port', on all interfaces
+ */
+static int
+bind_microtcp (microtcp_sock_t *sock, uint16_t listen_port)
+{
+  struct sockaddr_in sin;
+
+  *sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock->sd < 0) {
+    perror ("Opening microTCP socket");
+    return -EXIT_FAILURE;
+  }
+
+  if (congestion
+      && microtcp_setsockopt (sock, MICROTCP_SO_CONGESTION, &congestion,
+                              sizeof(congestion)) < 0) {
+    perror ("microTCP congestion control");
+    return -EXIT_FAILURE;
+  }
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (listen_port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+
+  if (microtcp_bind (sock, (struct sockaddr *) &sin,
+                     sizeof(struct sockaddr_in)) < 0) {
+    perror ("microTCP bind");
+    return -EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
+/*
+ * Accepts a connection on a bound microTCP socket, and writes everything
+ * received to 'file'
+ */
+static int
+serve_microtcp (microtcp_sock_t *sock, const char *file)
+{
+  FILE *fp;
+  ssize_t received;
+  ssize_t total_bytes = 0;
+  struct sockaddr_in client_addr;
+  struct timespec start_time;
+  struct timespec end_time;
+
+  fp = fopen (file, "w");
+  if (!fp) {
+    perror ("Open file for writing");
+    return -EXIT_FAILURE;
+  }
+
+  if (microtcp_accept (sock, (struct sockaddr *) &client_addr,
+                       sizeof(client_addr)) < 0) {
+    perror ("microTCP accept");
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+
+  /*
+   * The data goes from the receive ring straight to the file. With no limit,
+   * microtcp_recvfile() returns once the client has shut the connection down.
+   */
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+  while ((received = microtcp_recvfile (sock, fileno (fp), SIZE_MAX)) > 0) {
+    total_bytes += received;
+  }
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+  print_statistics (total_bytes, start_time, end_time);
+
+  fclose (fp);
+
+  return 0;
+}
+
 int
 server_microtcp (uint16_t listen_port, const char *file)
 {
-  /*TODO: Write your code here */
-  return 0;
+  microtcp_sock_t sock;
+
+  if (bind_microtcp (&sock, listen_port) < 0) {
+    return -EXIT_FAILURE;
+  }
+
+  return serve_microtcp (&sock, file);
+}
+
+/*
+ * The server side of -x: one transfer over TCP, then one over microTCP, on
+ * the same port. The microTCP socket is bound first, so that the client may
+ * connect as soon as the TCP transfer is over.
+ */
+int
+server_compare (uint16_t listen_port, const char *file)
+{
+  microtcp_sock_t sock;
+
+  if (bind_microtcp (&sock, listen_port) < 0) {
+    return -EXIT_FAILURE;
+  }
+
+  printf ("TCP:\n");
+  if (server_tcp (listen_port, file) < 0) {
+    return -EXIT_FAILURE;
+  }
+
+  printf ("microTCP:\n");
+  return serve_microtcp (&sock, file);
 }
 
 int
-client_tcp (const char *serverip, uint16_t server_port, const char *file)
+client_tcp (const char *serverip, uint16_t server_port, const char *file,
+            struct transfer_report *report)
 {
   uint8_t *buffer;
   int sock;
-  socklen_t client_addr_len;
   FILE *fp;
   size_t read_items = 0;
+  size_t total_bytes = 0;
   ssize_t data_sent;
-
-  struct sockaddr *client_addr;
+  struct tcp_info info;
+  socklen_t info_len = sizeof(info);
+  struct timespec start_time;
+  struct timespec end_time;
+  double start_cpu;
 
   /* Allocate memory for the application receive buffer */
   buffer = (uint8_t *) malloc (CHUNK_SIZE);
@@ -205,6 +350,9 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
   /* The server's IP*/
   sin.sin_addr.s_addr = inet_addr (serverip);
 
+  start_cpu = cpu_seconds ();
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+
   if (connect (sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in))
       == -1) {
     perror ("TCP connect");
@@ -216,6 +364,9 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
   while (!feof (fp)) {
     read_items = fread (buffer, sizeof(uint8_t), CHUNK_SIZE, fp);
     if (read_items < 1) {
+      if (feof (fp)) {
+        break;
+      }
       perror ("Failed read from file");
       shutdown (sock, SHUT_RDWR);
       close (sock);
@@ -234,11 +385,27 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
       fclose (fp);
       return -EXIT_FAILURE;
     }
+    total_bytes += data_sent;
+  }
+
+  /* The server closes the connection once it has read everything */
+  shutdown (sock, SHUT_WR);
+  while (recv (sock, buffer, CHUNK_SIZE, 0) > 0)
+    ;
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
 
+  if (report) {
+    report->name = "TCP";
+    report->bytes = total_bytes;
+    report->elapsed = elapsed_seconds (start_time, end_time);
+    report->cpu = cpu_seconds () - start_cpu;
+    report->retransmissions = 0;
+    if (getsockopt (sock, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
+      report->retransmissions = info.tcpi_total_retrans;
+    }
   }
 
   printf ("Data sent. Terminating...\n");
-  shutdown (sock, SHUT_RDWR);
   close (sock);
   free (buffer);
   fclose (fp);
@@ -246,9 +413,153 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
 }
 
 int
-client_microtcp (const char *serverip, uint16_t server_port, const char *file)
+client_microtcp (const char *serverip, uint16_t server_port, const char *file,
+                 struct transfer_report *report)
 {
-  /*TODO: Write your code here */
+  uint8_t *buffer;
+  microtcp_sock_t sock;
+  FILE *fp;
+  size_t read_items = 0;
+  size_t total_bytes = 0;
+  size_t ring = MICROTCP_CLIENT_SNDRING;
+  ssize_t data_sent;
+  microtcp_stats_t stats;
+  struct sockaddr_in sin;
+  struct timespec start_time;
+  struct timespec end_time;
+  double start_cpu;
+
+  buffer = (uint8_t *) malloc (MICROTCP_CHUNK_SIZE);
+  if (!buffer) {
+    perror ("Allocate application send buffer");
+    return -EXIT_FAILURE;
+  }
+
+  fp = fopen (file, "r");
+  if (!fp) {
+    perror ("Open file for reading");
+    free (buffer);
+    return -EXIT_FAILURE;
+  }
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.sd < 0) {
+    perror ("Opening microTCP socket");
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+
+  if (congestion
+      && microtcp_setsockopt (&sock, MICROTCP_SO_CONGESTION, &congestion,
+                              sizeof(congestion)) < 0) {
+    perror ("microTCP congestion control");
+    exit (EXIT_FAILURE);
+  }
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (server_port);
+  sin.sin_addr.s_addr = inet_addr (serverip);
+
+  start_cpu = cpu_seconds ();
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+
+  if (microtcp_connect (&sock, (struct sockaddr *) &sin,
+                        sizeof(struct sockaddr_in)) < 0) {
+    perror ("microTCP connect");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Sends return once the data is in the ring, not once it is acknowledged */
+  if (microtcp_setsockopt (&sock, MICROTCP_SO_SNDRING, &ring, sizeof(ring)) < 0) {
+    perror ("microTCP send ring");
+    exit (EXIT_FAILURE);
+  }
+
+  printf ("Starting sending data...\n");
+  while (!feof (fp)) {
+    read_items = fread (buffer, sizeof(uint8_t), MICROTCP_CHUNK_SIZE, fp);
+    if (read_items < 1) {
+      if (feof (fp)) {
+        break;
+      }
+      perror ("Failed read from file");
+      microtcp_shutdown (&sock, SHUTDOWN_CLIENT);
+      free (buffer);
+      fclose (fp);
+      return -EXIT_FAILURE;
+    }
+
+    data_sent = microtcp_send (&sock, buffer, read_items, 0);
+    if (data_sent != (ssize_t) read_items) {
+      printf ("Failed to send the"
+              " amount of data read from the file.\n");
+      microtcp_shutdown (&sock, SHUTDOWN_CLIENT);
+      free (buffer);
+      fclose (fp);
+      return -EXIT_FAILURE;
+    }
+    total_bytes += data_sent;
+  }
+
+  /* Returns once the server has acknowledged everything and the FIN */
+  microtcp_shutdown (&sock, SHUTDOWN_CLIENT);
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+
+  if (report) {
+    microtcp_get_stats (&sock, &stats);
+    report->name = "microTCP";
+    report->bytes = total_bytes;
+    report->elapsed = elapsed_seconds (start_time, end_time);
+    report->cpu = cpu_seconds () - start_cpu;
+    report->retransmissions = stats.packets_lost;
+  }
+
+  printf ("Data sent. Terminating...\n");
+  free (buffer);
+  fclose (fp);
+  return 0;
+}
+
+static void
+print_report (const struct transfer_report *report, size_t n)
+{
+  size_t i;
+  double gigabytes;
+
+  printf ("\n%-10s %12s %10s %12s %15s %12s\n", "Protocol", "Bytes",
+          "Time (s)", "MB/s", "Retransmits", "CPU s/GB");
+  for (i = 0; i < n; i++) {
+    gigabytes = report[i].bytes / 1e9;
+    printf ("%-10s %12zu %10.3f %12.2f %15lu %12.3f\n", report[i].name,
+            report[i].bytes, report[i].elapsed,
+            report[i].bytes / (1024.0 * 1024.0) / report[i].elapsed,
+            (unsigned long) report[i].retransmissions,
+            gigabytes > 0 ? report[i].cpu / gigabytes : 0.0);
+  }
+}
+
+/*
+ * The client side of -x: sends the file over TCP, then over microTCP, and
+ * compares the two transfers
+ */
+int
+client_compare (const char *serverip, uint16_t server_port, const char *file)
+{
+  struct transfer_report report[2];
+
+  memset (report, 0, sizeof(report));
+
+  if (client_tcp (serverip, server_port, file, &report[0]) < 0) {
+    return -EXIT_FAILURE;
+  }
+
+  if (client_microtcp (serverip, server_port, file, &report[1]) < 0) {
+    return -EXIT_FAILURE;
+  }
+
+  print_report (report, 2);
   return 0;
 }
 
@@ -262,9 +573,10 @@ main (int argc, char **argv)
   char *ipstr = NULL;
   uint8_t is_server = 0;
   uint8_t use_microtcp = 0;
+  uint8_t compare = 0;
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hsmf:p:a:")) != -1) {
+  while ((opt = getopt (argc, argv, "hsmxf:p:a:c:")) != -1) {
     switch (opt)
       {
       /* If -s is set, program runs on server mode */
@@ -287,13 +599,27 @@ main (int argc, char **argv)
       case 'a':
         ipstr = strdup (optarg);
         break;
+        /* if -x is set TCP and microTCP transfer the file one after the other */
+      case 'x':
+        compare = 1;
+        break;
+      case 'c':
+        congestion = microtcp_cc_by_name (optarg);
+        if (!congestion) {
+          printf ("Unknown congestion control: %s\n", optarg);
+          exit (EXIT_FAILURE);
+        }
+        break;
 
       default:
         printf (
-            "Usage: bandwidth_test [-s] [-m] -p port -f file"
+            "Usage: bandwidth_test [-s] [-m | -x] [-c cc] -p port -f file [-a address]\n"
             "Options:\n"
             "   -s                  If set, the program runs as server. Otherwise as client.\n"
             "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
+            "   -x                  Transfers the file over TCP and then over microTCP, and compares them.\n"
+            "                       Both the server and the client must be given -x.\n"
+            "   -c <string>         The congestion control of microTCP: newreno, cubic or bbr.\n"
             "   -f <string>         If -s is set the -f option specifies the filename of the file that will be saved.\n"
             "                       If not, is the source file at the client side that will be sent to the server.\n"
             "   -p <int>            The listening port of the server\n"
@@ -310,7 +636,16 @@ main (int argc, char **argv)
   /*
    * Depending the use arguments execute the appropriate functions
    */
-  if (is_server) {
+  if (compare) {
+
+    if (is_server) {
+      exit_code = server_compare (port, filestr);
+    }
+    else {
+      exit_code = client_compare (ipstr, port, filestr);
+    }
+  }
+  else if (is_server) {
 
     if (use_microtcp) {
       exit_code = server_microtcp (port, filestr);
@@ -321,10 +656,10 @@ main (int argc, char **argv)
   }
   else {
     if (use_microtcp) {
-      exit_code = client_microtcp (ipstr, port, filestr);
+      exit_code = client_microtcp (ipstr, port, filestr, NULL);
     }
     else {
-      exit_code = client_tcp (ipstr, port, filestr);
+      exit_code = client_tcp (ipstr, port, filestr, NULL);
     }
   }
 
@@ -0,0 +1,622 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A UDP relay that impairs the traffic between microTCP peers, without root
+ * (unlike netem). Clients connect to the port of the proxy instead of the
+ * server; every client gets its own socket towards the server, so the server
+ * sees one peer per client.
+ *
+ * Each datagram goes through, in order: the loss model (random or
+ * Gilbert-Elliott), the bandwidth limit (a drop-tail queue in front of a link
+ * of the given rate, shared by all the clients), duplication, corruption (one
+ * bit flipped) and the delay (fixed, plus uniform jitter, plus an extra delay
+ * for the datagrams picked for reordering). Both directions are impaired the
+ * same way. All the randomness comes from one seeded generator, so a run
+ * with the same seed and the same traffic makes the same decisions.
+ *
+ * Example, 20 ms RTT and 1% loss in front of a bandwidth_test server:
+ *   bandwidth_test -s -m -p 9000 -f out
+ *   impairment_proxy -p 9001 -P 9000 -d 10 -l 0.01 -s 42 -H
+ *   bandwidth_test -m -a 127.0.0.1 -p 9001 -f in
+ * The traffic generator client connects through it the same way. Kernel TCP
+ * cannot be relayed: run bandwidth_test with -m through it.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+
+#define MAX_FLOWS 64
+#define MAX_DATAGRAM 65536
+#define SOCKET_BUFFER (16 << 20)
+
+enum { TO_SERVER, TO_CLIENT };
+
+/*
+ * What the proxy does to the datagrams
+ */
+struct impairments
+{
+  double delay_us;
+  double jitter_us;           /* Uniform in [0, jitter) on top of the delay */
+  double rate_bps;            /* 0 for no limit */
+  double queue_bytes;         /* Of the bottleneck, beyond it datagrams are dropped */
+  double loss;                /* Random loss, if Gilbert-Elliott is off */
+  int gilbert;
+  double ge_p;                /* P(good -> bad) */
+  double ge_r;                /* P(bad -> good) */
+  double ge_bad_loss;         /* Loss in the bad state */
+  double ge_good_loss;        /* Loss in the good state */
+  double duplicate;
+  double reorder;
+  double reorder_us;          /* Extra delay of a reordered datagram */
+  double corrupt;
+  int spare_control;          /* Let the handshake and the termination through untouched */
+};
+
+struct counters
+{
+  uint64_t received;
+  uint64_t forwarded;
+  uint64_t lost;
+  uint64_t queue_drops;
+  uint64_t duplicated;
+  uint64_t corrupted;
+  uint64_t reordered;
+};
+
+struct flow
+{
+  struct sockaddr_in client;
+  int upstream;               /* Connected to the server */
+  int control;                /* In the handshake or the termination */
+};
+
+struct packet
+{
+  uint64_t due;
+  uint64_t order;             /* Ties are sent in arrival order */
+  struct flow *flow;
+  int dir;
+  size_t len;
+  uint8_t data[];
+};
+
+static struct impairments imp;
+static struct counters stats[2];
+static struct flow flows[MAX_FLOWS];
+static int nflows;
+static struct packet **heap;
+static size_t heap_len;
+static size_t heap_cap;
+static uint64_t rng_state;
+static uint64_t link_free[2];   /* When the bottleneck is done with its queue */
+static uint64_t last_due[2];    /* Latest delivery time so far */
+static int ge_bad[2];
+static volatile sig_atomic_t running = 1;
+
+static void
+sig_handler (int signal)
+{
+  (void) signal;
+  running = 0;
+}
+
+static inline uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* splitmix64, to spread the seed */
+static void
+rng_seed (uint64_t seed)
+{
+  uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  rng_state = (z ^ (z >> 31)) | 1;
+}
+
+/* xorshift64*, the same sequence on every platform for a given seed */
+static inline uint64_t
+rng_next (void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1) */
+static inline double
+rng_uniform (void)
+{
+  return (rng_next () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline int
+chance (double p)
+{
+  return p > 0 && rng_uniform () < p;
+}
+
+static void
+heap_push (struct packet *pkt)
+{
+  size_t i;
+  size_t parent;
+
+  if (heap_len == heap_cap) {
+    heap_cap = heap_cap ? 2 * heap_cap : 1024;
+    heap = realloc (heap, heap_cap * sizeof(*heap));
+    if (!heap) {
+      perror ("Allocate packet queue");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (i = heap_len++; i; i = parent) {
+    parent = (i - 1) / 2;
+    if (heap[parent]->due < pkt->due
+        || (heap[parent]->due == pkt->due && heap[parent]->order < pkt->order)) {
+      break;
+    }
+    heap[i] = heap[parent];
+  }
+  heap[i] = pkt;
+}
+
+static struct packet *
+heap_pop (void)
+{
+  struct packet *top = heap[0];
+  struct packet *last = heap[--heap_len];
+  size_t i = 0;
+  size_t child;
+
+  while ((child = 2 * i + 1) < heap_len) {
+    if (child + 1 < heap_len
+        && (heap[child + 1]->due < heap[child]->due
+            || (heap[child + 1]->due == heap[child]->due
+                && heap[child + 1]->order < heap[child]->order))) {
+      child++;
+    }
+    if (last->due < heap[child]->due
+        || (last->due == heap[child]->due && last->order < heap[child]->order)) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+/*
+ * microTCP does not retransmit the segments of the handshake and of the
+ * termination: a flow is in either from its first datagram until the first
+ * one that carries data, and from the first FIN on.
+ */
+static int
+is_control (struct flow *flow, const uint8_t *data, size_t len)
+{
+  uint16_t control;
+  uint32_t data_len;
+
+  if (len < sizeof(microtcp_header_t)) {
+    return flow->control;
+  }
+  memcpy (&control, data + offsetof(microtcp_header_t, control), sizeof(control));
+  memcpy (&data_len, data + offsetof(microtcp_header_t, data_len), sizeof(data_len));
+
+  if (ntohs (control) & CTRL_FIN) {
+    flow->control = 1;
+  }
+  else if (ntohl (data_len) && !(ntohs (control) & CTRL_SYN)) {
+    flow->control = 0;
+  }
+  return flow->control || (ntohs (control) & CTRL_SYN);
+}
+
+static int
+is_lost (int dir)
+{
+  if (!imp.gilbert) {
+    return chance (imp.loss);
+  }
+
+  /* The state changes before every datagram */
+  if (ge_bad[dir]) {
+    ge_bad[dir] = !chance (imp.ge_r);
+  }
+  else {
+    ge_bad[dir] = chance (imp.ge_p);
+  }
+  return chance (ge_bad[dir] ? imp.ge_bad_loss : imp.ge_good_loss);
+}
+
+static void
+enqueue (struct flow *flow, int dir, const uint8_t *data, size_t len, uint64_t now)
+{
+  static uint64_t order;
+  struct counters *st = &stats[dir];
+  struct packet *pkt;
+  uint64_t depart = now;
+  uint64_t backlog;
+  int spare;
+  int copies;
+  int reordered;
+  size_t bit;
+
+  st->received++;
+  spare = imp.spare_control && is_control (flow, data, len);
+
+  if (!spare && is_lost (dir)) {
+    st->lost++;
+    return;
+  }
+
+  if (imp.rate_bps > 0) {
+    depart = link_free[dir] > now ? link_free[dir] : now;
+    backlog = (uint64_t) ((depart - now) * imp.rate_bps / 8e6);
+    if (!spare && backlog + len > imp.queue_bytes) {
+      st->queue_drops++;
+      return;
+    }
+    depart += (uint64_t) (len * 8e6 / imp.rate_bps);
+    link_free[dir] = depart;
+  }
+
+  copies = 1;
+  if (!spare && chance (imp.duplicate)) {
+    st->duplicated++;
+    copies = 2;
+  }
+
+  while (copies--) {
+    pkt = malloc (sizeof(*pkt) + len);
+    if (!pkt) {
+      perror ("Allocate packet");
+      exit (EXIT_FAILURE);
+    }
+    pkt->flow = flow;
+    pkt->dir = dir;
+    pkt->len = len;
+    pkt->order = order++;
+    memcpy (pkt->data, data, len);
+    pkt->due = depart + (uint64_t) imp.delay_us;
+
+    if (spare) {
+      /* Never ahead of the data: a FIN that overtakes it is ignored */
+      if (pkt->due < last_due[dir]) {
+        pkt->due = last_due[dir];
+      }
+    }
+    else {
+      if (imp.jitter_us > 0) {
+        pkt->due += (uint64_t) (rng_uniform () * imp.jitter_us);
+      }
+      reordered = chance (imp.reorder);
+      if (reordered) {
+        pkt->due += (uint64_t) imp.reorder_us;
+        st->reordered++;
+      }
+      if (len && chance (imp.corrupt)) {
+        bit = rng_next () % (len * 8);
+        pkt->data[bit / 8] ^= 1U << (bit % 8);
+        st->corrupted++;
+      }
+    }
+
+    if (pkt->due > last_due[dir]) {
+      last_due[dir] = pkt->due;
+    }
+    heap_push (pkt);
+  }
+}
+
+static struct flow *
+find_flow (const struct sockaddr_in *client, const struct sockaddr_in *server)
+{
+  int i;
+  int sbuf = SOCKET_BUFFER;
+
+  for (i = 0; i < nflows; i++) {
+    if (flows[i].client.sin_port == client->sin_port
+        && flows[i].client.sin_addr.s_addr == client->sin_addr.s_addr) {
+      return &flows[i];
+    }
+  }
+
+  if (nflows == MAX_FLOWS) {
+    return NULL;
+  }
+
+  flows[nflows].client = *client;
+  flows[nflows].control = 1;
+  flows[nflows].upstream = socket (AF_INET, SOCK_DGRAM, 0);
+  if (flows[nflows].upstream < 0
+      || connect (flows[nflows].upstream, (const struct sockaddr *) server,
+                  sizeof(*server)) < 0) {
+    perror ("Connect to the server");
+    exit (EXIT_FAILURE);
+  }
+  setsockopt (flows[nflows].upstream, SOL_SOCKET, SO_RCVBUFFORCE, &sbuf, sizeof(sbuf));
+  setsockopt (flows[nflows].upstream, SOL_SOCKET, SO_RCVBUF, &sbuf, sizeof(sbuf));
+  return &flows[nflows++];
+}
+
+static void
+send_due (int listen_sock, uint64_t now)
+{
+  struct packet *pkt;
+
+  while (heap_len && heap[0]->due <= now) {
+    pkt = heap_pop ();
+    if (pkt->dir == TO_SERVER) {
+      send (pkt->flow->upstream, pkt->data, pkt->len, 0);
+    }
+    else {
+      sendto (listen_sock, pkt->data, pkt->len, 0,
+              (const struct sockaddr *) &pkt->flow->client,
+              sizeof(pkt->flow->client));
+    }
+    stats[pkt->dir].forwarded++;
+    free (pkt);
+  }
+}
+
+static void
+print_counters (void)
+{
+  static const char *names[2] = { "to server", "to client" };
+  int i;
+
+  printf ("\n%-10s %10s %10s %10s %10s %10s %10s %10s\n", "Direction",
+          "Received", "Forwarded", "Lost", "Overflow", "Duplicated",
+          "Corrupted", "Reordered");
+  for (i = 0; i < 2; i++) {
+    printf ("%-10s %10lu %10lu %10lu %10lu %10lu %10lu %10lu\n", names[i],
+            (unsigned long) stats[i].received, (unsigned long) stats[i].forwarded,
+            (unsigned long) stats[i].lost, (unsigned long) stats[i].queue_drops,
+            (unsigned long) stats[i].duplicated, (unsigned long) stats[i].corrupted,
+            (unsigned long) stats[i].reordered);
+  }
+}
+
+static void
+usage (void)
+{
+  printf (
+      "Usage: impairment_proxy -p port -P server_port [-a server_address] [options]\n"
+      "Options:\n"
+      "   -p <int>            The port the clients connect to\n"
+      "   -a <string>         The IP address of the server (127.0.0.1)\n"
+      "   -P <int>            The port of the server\n"
+      "   -d <ms>             One-way delay\n"
+      "   -j <ms>             Jitter: up to that much extra delay, uniformly\n"
+      "   -b <Mbit/s>         Rate of the bottleneck link\n"
+      "   -q <bytes>          Queue of the bottleneck link, in bytes (1048576)\n"
+      "   -l <prob>           Random loss probability\n"
+      "   -g <p,r[,h[,k]]>    Gilbert-Elliott loss: P(good->bad), P(bad->good), loss in the bad\n"
+      "                       state (1) and in the good state (0). Replaces -l\n"
+      "   -u <prob>           Duplication probability\n"
+      "   -r <prob>           Reordering probability\n"
+      "   -R <ms>             Extra delay of a reordered datagram (5)\n"
+      "   -c <prob>           Probability to flip a bit of a datagram\n"
+      "   -s <int>            Seed of the random decisions (1)\n"
+      "   -H                  Spare the handshake and the termination: microTCP does not retransmit them\n"
+      "   -h                  prints this help\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt;
+  int i;
+  int listen_port = 0;
+  int server_port = 0;
+  int listen_sock;
+  int sbuf = SOCKET_BUFFER;
+  int nfds;
+  uint64_t seed = 1;
+  uint64_t now;
+  uint64_t wait_us;
+  ssize_t len;
+  const char *server_ip = "127.0.0.1";
+  struct sockaddr_in sin;
+  struct sockaddr_in server;
+  struct sockaddr_in client;
+  socklen_t client_len;
+  struct flow *flow;
+  struct pollfd pfds[MAX_FLOWS + 1];
+  struct timespec timeout;
+  static uint8_t buffer[MAX_DATAGRAM];
+
+  imp.queue_bytes = 1 << 20;
+  imp.reorder_us = 5000;
+  imp.ge_bad_loss = 1;
+
+  while ((opt = getopt (argc, argv, "hp:a:P:d:j:b:q:l:g:u:r:R:c:s:H")) != -1) {
+    switch (opt)
+      {
+      case 'p':
+        listen_port = atoi (optarg);
+        break;
+      case 'a':
+        server_ip = optarg;
+        break;
+      case 'P':
+        server_port = atoi (optarg);
+        break;
+      case 'd':
+        imp.delay_us = atof (optarg) * 1000;
+        break;
+      case 'j':
+        imp.jitter_us = atof (optarg) * 1000;
+        break;
+      case 'b':
+        imp.rate_bps = atof (optarg) * 1e6;
+        break;
+      case 'q':
+        imp.queue_bytes = atof (optarg);
+        break;
+      case 'l':
+        imp.loss = atof (optarg);
+        break;
+      case 'g':
+        imp.gilbert = 1;
+        if (sscanf (optarg, "%lf,%lf,%lf,%lf", &imp.ge_p, &imp.ge_r,
+                    &imp.ge_bad_loss, &imp.ge_good_loss) < 2) {
+          printf ("-g needs at least p,r\n");
+          exit (EXIT_FAILURE);
+        }
+        break;
+      case 'u':
+        imp.duplicate = atof (optarg);
+        break;
+      case 'r':
+        imp.reorder = atof (optarg);
+        break;
+      case 'R':
+        imp.reorder_us = atof (optarg) * 1000;
+        break;
+      case 'c':
+        imp.corrupt = atof (optarg);
+        break;
+      case 's':
+        seed = strtoull (optarg, NULL, 0);
+        break;
+      case 'H':
+        imp.spare_control = 1;
+        break;
+      default:
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  if (!listen_port || !server_port) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+
+  rng_seed (seed);
+
+  memset (&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons (server_port);
+  if (inet_pton (AF_INET, server_ip, &server.sin_addr) != 1) {
+    printf ("Invalid server address: %s\n", server_ip);
+    exit (EXIT_FAILURE);
+  }
+
+  if ((listen_sock = socket (AF_INET, SOCK_DGRAM, 0)) < 0) {
+    perror ("Opening UDP socket");
+    exit (EXIT_FAILURE);
+  }
+  setsockopt (listen_sock, SOL_SOCKET, SO_RCVBUFFORCE, &sbuf, sizeof(sbuf));
+  setsockopt (listen_sock, SOL_SOCKET, SO_RCVBUF, &sbuf, sizeof(sbuf));
+
+  memset (&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (listen_port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+  if (bind (listen_sock, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+    perror ("UDP bind");
+    exit (EXIT_FAILURE);
+  }
+
+  signal (SIGINT, sig_handler);
+  signal (SIGTERM, sig_handler);
+
+  while (running) {
+    pfds[0].fd = listen_sock;
+    pfds[0].events = POLLIN;
+    for (i = 0; i < nflows; i++) {
+      pfds[i + 1].fd = flows[i].upstream;
+      pfds[i + 1].events = POLLIN;
+    }
+    nfds = nflows + 1;
+
+    /* Sleep until the next datagram is due, or one arrives */
+    now = now_us ();
+    wait_us = heap_len ? (heap[0]->due > now ? heap[0]->due - now : 0) : 1000000;
+    timeout.tv_sec = wait_us / 1000000;
+    timeout.tv_nsec = (wait_us % 1000000) * 1000;
+
+    if (ppoll (pfds, nfds, &timeout, NULL) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror ("poll");
+      exit (EXIT_FAILURE);
+    }
+
+    now = now_us ();
+
+    if (pfds[0].revents & POLLIN) {
+      for (;;) {
+        client_len = sizeof(client);
+        len = recvfrom (listen_sock, buffer, sizeof(buffer), MSG_DONTWAIT,
+                        (struct sockaddr *) &client, &client_len);
+        if (len < 0) {
+          break;
+        }
+        if ((flow = find_flow (&client, &server))) {
+          enqueue (flow, TO_SERVER, buffer, len, now);
+        }
+      }
+    }
+
+    for (i = 1; i < nfds; i++) {
+      if (!(pfds[i].revents & (POLLIN | POLLERR))) {
+        continue;
+      }
+      /* ECONNREFUSED, if the server is not there (yet), ends the loop too */
+      while ((len = recv (flows[i - 1].upstream, buffer, sizeof(buffer), MSG_DONTWAIT)) >= 0) {
+        enqueue (&flows[i - 1], TO_CLIENT, buffer, len, now);
+      }
+    }
+
+    send_due (listen_sock, now_us ());
+  }
+
+  print_counters ();
+  return 0;
+}
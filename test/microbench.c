@@ -0,0 +1,311 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the per-packet work of microTCP, without any socket I/O:
+ * the CRC-32 of every implementation, the encoding and decoding of a header
+ * and the segmentation of a user buffer into MSS sized segments.
+ *
+ * The library is compiled into this program, so that its static functions can
+ * be called directly. Every case runs until it takes at least -t seconds, and
+ * the best of a few runs is reported, in ns per operation and GB/s.
+ *
+ * Usage: microbench [-c] [-t seconds] [-m mss]
+ */
+
+#include "../lib/microtcp.c"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#define BENCH_RUNS 5
+
+struct bench
+{
+  const char *name;
+  void (*run) (struct bench *b, uint64_t iters);
+  size_t size;                  /* bytes processed per operation */
+  uint32_t (*crc) (uint32_t, const uint8_t *, size_t);
+};
+
+static uint8_t *data;
+static size_t data_len;
+static uint32_t mss = MICROTCP_MSS;
+static microtcp_sock_t sock;
+static snd_state_t snd;
+
+/* Keeps the compiler from dropping the work */
+static volatile uint32_t sink;
+
+static double
+now_seconds (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+run_crc (struct bench *b, uint64_t iters)
+{
+  uint32_t crc = 0xffffffff;
+  uint64_t i;
+
+  for (i = 0; i < iters; i++) {
+    crc = b->crc (crc, data, b->size);
+  }
+  sink = crc;
+}
+
+static uint32_t
+crc_dispatched (uint32_t crc, const uint8_t *buf, size_t len)
+{
+  return update_crc32 (crc, buf, len);
+}
+
+static void
+run_crc32 (struct bench *b, uint64_t iters)
+{
+  uint32_t crc = 0;
+  uint64_t i;
+
+  for (i = 0; i < iters; i++) {
+    crc ^= crc32 (data, b->size);
+  }
+  sink = crc;
+}
+
+static void
+run_encode (struct bench *b, uint64_t iters)
+{
+  microtcp_header_t tcph;
+  uint64_t i;
+
+  (void) b;
+  for (i = 0; i < iters; i++) {
+    sock.ack_number = i;
+    _preapre_send_tcph (&sock, &tcph, i, CTRL_ACK, NULL, 0U);
+    sink = tcph.checksum;
+  }
+}
+
+static void
+run_decode (struct bench *b, uint64_t iters)
+{
+  microtcp_header_t hdrs[64];
+  microtcp_header_t tcph;
+  microtcp_header_t h;
+  uint32_t sum = 0;
+  uint64_t i;
+
+  (void) b;
+  for (i = 0; i < 64; i++) {
+    _preapre_send_tcph (&sock, &hdrs[i], i * mss, FRAGMENT, data, mss);
+  }
+
+  for (i = 0; i < iters; i++) {
+    tcph = hdrs[i & 63];
+    _ntoh_recvd_tcph (h);
+    sum += h.seq_number ^ h.ack_number ^ h.data_len ^ h.checksum ^ h.window;
+  }
+  sink = sum;
+}
+
+/*
+ * The transmission path of a buffer without the sendmmsg(): it is cut into
+ * MSS segments, each with its header and checksum, and gathered into the
+ * batch, which is emptied instead of being sent.
+ */
+static void
+run_segment (struct bench *b, uint64_t iters)
+{
+  iov_batch_t *batch = &snd.tx;
+  const microtcp_header_t *tcph = NULL;
+  uint32_t off;
+  uint32_t seglen;
+  uint64_t i;
+
+  for (i = 0; i < iters; i++) {
+    for (off = 0; off < b->size; off += seglen) {
+      seglen = MIN2 (mss, b->size - off);
+      if (batch->count == IO_BATCH) {
+        batch->count = 0;
+      }
+      tcph = _queue_segment (&sock, batch, data + off, off, seglen,
+                             off + seglen == b->size, 0);
+    }
+  }
+  sink = tcph->checksum;
+}
+
+static double
+time_run (struct bench *b, uint64_t iters)
+{
+  double start = now_seconds ();
+  b->run (b, iters);
+  return now_seconds () - start;
+}
+
+static void
+measure (struct bench *b, double min_time, int csv)
+{
+  uint64_t iters = 1;
+  double elapsed;
+  double best;
+  double ns_op;
+  double gbps;
+  int i;
+
+  /* Grow the iteration count until a run is long enough to time */
+  while ((elapsed = time_run (b, iters)) < min_time) {
+    iters = (elapsed > min_time / 100) ?
+        (uint64_t) (iters * 1.2 * min_time / elapsed) + 1 : iters * 10;
+  }
+
+  best = elapsed;
+  for (i = 1; i < BENCH_RUNS; i++) {
+    elapsed = time_run (b, iters);
+    if (elapsed < best) {
+      best = elapsed;
+    }
+  }
+
+  ns_op = best * 1e9 / iters;
+  gbps = (b->size) ? b->size / ns_op : 0.0;
+
+  if (csv) {
+    printf ("%s,%zu,%" PRIu64 ",%.3f,%.3f\n", b->name, b->size, iters, ns_op, gbps);
+  }
+  else {
+    printf ("%-18s %8zu %12" PRIu64 " %12.2f %10.3f\n", b->name, b->size, iters, ns_op, gbps);
+  }
+  fflush (stdout);
+}
+
+int
+main (int argc, char **argv)
+{
+  static const size_t crc_sizes[] = { 32, 64, 512, 1400, 8940, 65536 };
+  static const size_t seg_sizes[] = { 1400, 65536, 1048576 };
+  struct bench b;
+  double min_time = 0.1;
+  int csv = 0;
+  int opt;
+  size_t i;
+
+  while ((opt = getopt (argc, argv, "hct:m:")) != -1) {
+    switch (opt)
+      {
+      case 'c':
+        csv = 1;
+        break;
+      case 't':
+        min_time = atof (optarg);
+        break;
+      case 'm':
+        mss = atoi (optarg);
+        if (mss == 0 || mss > MICROTCP_MAX_MSS) {
+          printf ("The MSS must be in [1, %u]\n", MICROTCP_MAX_MSS);
+          exit (EXIT_FAILURE);
+        }
+        break;
+      default:
+        printf (
+            "Usage: microbench [-c] [-t seconds] [-m mss]\n"
+            "Options:\n"
+            "   -c                  Prints CSV: name,bytes,iterations,ns_per_op,gb_per_s\n"
+            "   -t <float>          The least duration of a timed run, in seconds (default 0.1)\n"
+            "   -m <int>            The MSS used to encode and segment (default %u)\n"
+            "   -h                  prints this help\n", MICROTCP_MSS);
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  data_len = seg_sizes[sizeof(seg_sizes) / sizeof(*seg_sizes) - 1];
+  data = malloc (data_len);
+  if (!data) {
+    perror ("allocate buffer");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < data_len; i++) {
+    data[i] = i * 2654435761U >> 24;
+  }
+
+  /* Just what the header encoding reads */
+  sock.rcvbuf_len = MICROTCP_RECVBUF_LEN;
+  sock.rcv_mss = mss;
+
+  if (csv) {
+    printf ("name,bytes,iterations,ns_per_op,gb_per_s\n");
+  }
+  else {
+    printf ("%-18s %8s %12s %12s %10s\n", "benchmark", "bytes", "iterations", "ns/op", "GB/s");
+  }
+
+  memset (&b, 0, sizeof(b));
+  for (i = 0; i < sizeof(crc_sizes) / sizeof(*crc_sizes); i++) {
+    b.size = crc_sizes[i];
+
+    b.name = "crc32";
+    b.run = run_crc32;
+    measure (&b, min_time, csv);
+
+    b.run = run_crc;
+    b.name = "update_crc32";
+    b.crc = crc_dispatched;
+    measure (&b, min_time, csv);
+
+    b.name = "crc32_bytewise";
+    b.crc = update_crc32_bytewise;
+    measure (&b, min_time, csv);
+
+    b.name = "crc32_slice16";
+    b.crc = update_crc32_slice16;
+    measure (&b, min_time, csv);
+
+#ifdef CRC32_HAVE_CLMUL
+    if (crc32_impl == update_crc32_clmul) {
+      b.name = "crc32_clmul";
+      b.crc = update_crc32_clmul;
+      measure (&b, min_time, csv);
+    }
+#endif
+  }
+
+  b.name = "encode_header";
+  b.run = run_encode;
+  b.size = MICROTCP_HEADER_SIZE;
+  measure (&b, min_time, csv);
+
+  b.name = "decode_header";
+  b.run = run_decode;
+  measure (&b, min_time, csv);
+
+  b.name = "segment";
+  b.run = run_segment;
+  for (i = 0; i < sizeof(seg_sizes) / sizeof(*seg_sizes); i++) {
+    b.size = seg_sizes[i];
+    measure (&b, min_time, csv);
+  }
+
+  free (data);
+  return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Switches the congestion control of an established connection back and
+ * forth, in this process over the loopback: the client sends a few MB with
+ * each module in turn (BBR first), and after every switch the congestion
+ * window and the slow start threshold must have started over, as on a new
+ * connection, rather than carry the values of the previous module. The
+ * server checks that the whole stream arrived.
+ *
+ * Exits with 0 on success, 1 otherwise, and fails by SIGALRM if it does not
+ * finish in time.
+ *
+ * Usage: test_microtcp_cc [-p port] [-b bytes] [-t seconds]
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+
+static const char *const modules[] = { "bbr", "newreno", "bbr", "cubic", "newreno", "cubic", "bbr" };
+#define NMODULES (sizeof(modules) / sizeof(*modules))
+
+static uint16_t port = 9400;
+static size_t nbytes = 4 << 20;         /* Sent with each module */
+static size_t received;
+
+static uint8_t
+pattern (size_t i)
+{
+  return (uint8_t) (i * 7 + (i >> 11));
+}
+
+/*
+ * Accepts the client and receives until it shuts the connection down
+ */
+static void *
+accept_and_serve (void *arg)
+{
+  microtcp_sock_t *sock = arg;
+  static uint8_t buf[1 << 16];
+  struct sockaddr_in peer;
+  size_t bad = 0;
+  ssize_t ret;
+  ssize_t i;
+
+  if (microtcp_accept (sock, (struct sockaddr *) &peer, sizeof(peer))) {
+    perror ("Accept");
+    return NULL;
+  }
+
+  while ((ret = microtcp_recv (sock, buf, sizeof(buf), 0)) >= 0) {
+    for (i = 0; i < ret; i++) {
+      bad += (buf[i] != pattern (received + i));
+    }
+    received += ret;
+  }
+
+  if (bad) {
+    fprintf (stderr, "Server: %zu bytes differ\n", bad);
+    received = 0;
+  }
+  return NULL;
+}
+
+static void
+usage (void)
+{
+  printf (
+      "Usage: test_microtcp_cc [-p port] [-b bytes] [-t seconds]\n"
+      "Options:\n"
+      "   -p <int>            The port of the server (default 9400)\n"
+      "   -b <int>            The bytes sent with each module (default 4194304)\n"
+      "   -t <int>            Fails if the test takes longer, in seconds (default 60)\n"
+      "   -h                  prints this help\n");
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  const microtcp_cc_ops_t *cc;
+  struct sockaddr_in addr;
+  microtcp_sock_t ssock;
+  microtcp_sock_t csock;
+  microtcp_stats_t st;
+  pthread_t thread;
+  unsigned int timeout = 60;
+  unsigned int failures = 0;
+  uint8_t *buf;
+  size_t init_cwnd;
+  size_t init_ssthresh;
+  size_t i;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "hp:b:t:")) != -1) {
+    switch (opt)
+      {
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'b':
+        nbytes = strtoul (optarg, NULL, 10);
+        break;
+      case 't':
+        timeout = atoi (optarg);
+        break;
+      default:
+        usage ();
+      }
+  }
+
+  alarm (timeout);
+
+  buf = malloc (nbytes * NMODULES);
+  if (!buf) {
+    perror ("allocate");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nbytes * NMODULES; i++) {
+    buf[i] = pattern (i);
+  }
+
+  memset (&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  ssock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  csock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (ssock.sd < 0 || csock.sd < 0
+      || microtcp_bind (&ssock, (struct sockaddr *) &addr, sizeof(addr))) {
+    perror ("Socket");
+    exit (EXIT_FAILURE);
+  }
+
+  if (pthread_create (&thread, NULL, accept_and_serve, &ssock)
+      || microtcp_connect (&csock, (struct sockaddr *) &addr, sizeof(addr))) {
+    perror ("Connect");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NMODULES; i++) {
+    cc = microtcp_cc_by_name (modules[i]);
+    if (!cc || microtcp_setsockopt (&csock, MICROTCP_SO_CONGESTION, &cc, sizeof(cc))
+        || microtcp_get_stats (&csock, &st)) {
+      perror (modules[i]);
+      exit (EXIT_FAILURE);
+    }
+
+    /* BBR keeps no slow start threshold, the others start over from the initial windows */
+    init_cwnd = MICROTCP_INIT_CWND > 2UL * st.mss ? MICROTCP_INIT_CWND : 2UL * st.mss;
+    init_ssthresh = strcmp (modules[i], "bbr") ? MICROTCP_INIT_SSTHRESH : SIZE_MAX;
+    if (st.ssthresh != init_ssthresh
+        || (strcmp (modules[i], "bbr") && st.cwnd != init_cwnd)) {
+      fprintf (stderr, "Switch to %s: cwnd %zu, ssthresh %zu instead of %zu, %zu\n",
+               modules[i], st.cwnd, st.ssthresh, init_cwnd, init_ssthresh);
+      failures++;
+    }
+
+    if (microtcp_send (&csock, buf + i * nbytes, nbytes, 0) != (ssize_t) nbytes
+        || microtcp_get_stats (&csock, &st)) {
+      perror ("Send");
+      exit (EXIT_FAILURE);
+    }
+    printf ("%-8s cwnd %zu, ssthresh %zu after %zu bytes\n", modules[i], st.cwnd,
+            st.ssthresh, nbytes);
+  }
+
+  if (microtcp_shutdown (&csock, SHUTDOWN_CLIENT)) {
+    perror ("Shutdown");
+    failures++;
+  }
+  pthread_join (thread, NULL);
+
+  if (received != nbytes * NMODULES) {
+    fprintf (stderr, "Server: %zu of %zu bytes intact\n", received, nbytes * NMODULES);
+    failures++;
+  }
+
+  free (buf);
+  if (failures) {
+    printf ("FAIL: %u errors\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf ("PASS: %zu switches of %zu bytes\n", NMODULES - 1, nbytes);
+  return EXIT_SUCCESS;
+}
@@ -36,7 +36,7 @@
 
 #define TEST_BYTES 2805
 
-void send_file(FILE *fp, microtcp_sock_t sockfp);
+void send_file(FILE *fp, microtcp_sock_t *sockfp);
 
 
 int main(int argc, char **argv) {
@@ -78,7 +78,7 @@ int main(int argc, char **argv) {
             // read(fd, frag_test, TEST_BYTES);
             // *(char *)(frag_test + TEST_BYTES) = 0;
         
-            send_file(fp, csock);
+            send_file(fp, &csock);
 
             break;
         case 2 :
@@ -101,21 +101,18 @@ int main(int argc, char **argv) {
 }
 
 
-void send_file(FILE *fp, microtcp_sock_t sockfp) {
+void send_file(FILE *fp, microtcp_sock_t *sockfp) {
     
     struct stat finfo;
+    char data[3];
+
     fstat(fileno(fp), &finfo);  
     
-    char data[finfo.st_size];
-    
-    fread(data, finfo.st_size, 1, fp);
-    microtcp_send(&sockfp, data, finfo.st_size, 0);
-    
-    bzero(data, finfo.st_size);
+    microtcp_sendfile(sockfp, fileno(fp), 0, finfo.st_size);
 
     data[0] = '6';
     data[1] = '9';
     data[2] = 0;
 
-    microtcp_send(&sockfp, data, 3UL, 0);
+    microtcp_send(sockfp, data, 3UL, 0);
 }
\ No newline at end of file
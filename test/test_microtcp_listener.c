@@ -0,0 +1,319 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Many concurrent clients of one microTCP listener, all in this process: a
+ * listener on the loopback, one thread per accepted connection, and one
+ * thread per client. Every client sends its own pattern, and every other
+ * client idles for a while after connecting, so that the server blocks on
+ * quiet connections while the others transfer. The server checks that each
+ * client's data arrived whole.
+ *
+ * With -s, the server is a microtcp_runtime_t of that many shards instead,
+ * which should be given more clients than shards.
+ *
+ * Exits with 0 if every transfer was intact, 1 otherwise, and fails by
+ * SIGALRM if it does not finish in time.
+ *
+ * Usage: test_microtcp_listener [-p port] [-c clients] [-b bytes] [-i ms] [-s shards] [-t seconds]
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+
+#define SEND_CHUNK (64 * 1024)
+
+static uint16_t port = 9300;
+static unsigned int nclients = 64;
+static size_t nbytes = 1 << 20;
+static unsigned int idle_ms = 100;
+
+static pthread_barrier_t start;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static unsigned int *received;          /* Intact transfers, per client */
+static unsigned int served;             /* Connections closed by the server */
+static unsigned int failures;
+
+/* Byte 'i' of the data of client 'id'; its first 4 bytes are the id itself */
+static uint8_t
+pattern (uint32_t id, size_t i)
+{
+  return (uint8_t) (id * 131 + i * 7 + (i >> 9));
+}
+
+static void
+fill (uint8_t *buf, uint32_t id)
+{
+  size_t i;
+
+  for (i = 0; i < nbytes; i++) {
+    buf[i] = pattern (id, i);
+  }
+  memcpy (buf, &id, sizeof(id));
+}
+
+/*
+ * Receives one connection until the peer closes it and checks what arrived
+ */
+static void
+check_transfer (microtcp_sock_t *sock)
+{
+  uint8_t *buf = malloc (nbytes + 1);
+  size_t total = 0;
+  ssize_t ret;
+  uint32_t id;
+  size_t i;
+  int ok;
+
+  while (buf && (ret = microtcp_recv (sock, buf + total, nbytes + 1 - total, 0)) >= 0) {
+    total += ret;
+  }
+
+  ok = buf && (total == nbytes);
+  if (ok) {
+    memcpy (&id, buf, sizeof(id));
+    ok = (id < nclients);
+    for (i = sizeof(id); ok && i < nbytes; i++) {
+      ok = (buf[i] == pattern (id, i));
+    }
+  }
+
+  pthread_mutex_lock (&lock);
+  if (ok) {
+    received[id]++;
+  }
+  else {
+    fprintf (stderr, "Server: a transfer of %zu bytes arrived damaged\n", total);
+    failures++;
+  }
+  served++;
+  pthread_cond_signal (&done);
+  pthread_mutex_unlock (&lock);
+
+  free (buf);
+}
+
+static void *
+serve (void *arg)
+{
+  check_transfer (arg);
+  free (arg);
+  return NULL;
+}
+
+static int
+handler (microtcp_sock_t *sock, const struct sockaddr *peer, socklen_t peer_len, void *arg)
+{
+  (void) peer;
+  (void) peer_len;
+  (void) arg;
+  check_transfer (sock);
+  return 0;
+}
+
+static void *
+client (void *arg)
+{
+  uint32_t id = (uintptr_t) arg;
+  struct sockaddr_in addr;
+  microtcp_sock_t sock;
+  uint8_t *buf = malloc (nbytes);
+  size_t off;
+  int ok;
+
+  memset (&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  pthread_barrier_wait (&start);
+
+  ok = buf && (sock.sd >= 0)
+      && !microtcp_connect (&sock, (struct sockaddr *) &addr, sizeof(addr));
+  if (ok) {
+    fill (buf, id);
+    if (id % 2) {
+      usleep (idle_ms * 1000);
+    }
+    for (off = 0; ok && off < nbytes; off += SEND_CHUNK) {
+      ok = (microtcp_send (&sock, buf + off, nbytes - off < SEND_CHUNK ? nbytes - off : SEND_CHUNK, 0) >= 0);
+    }
+    ok = !microtcp_shutdown (&sock, SHUTDOWN_CLIENT) && ok;
+  }
+
+  if (!ok) {
+    perror ("Client");
+    pthread_mutex_lock (&lock);
+    failures++;
+    pthread_mutex_unlock (&lock);
+  }
+
+  free (buf);
+  return NULL;
+}
+
+static void
+usage (void)
+{
+  printf (
+      "Usage: test_microtcp_listener [-p port] [-c clients] [-b bytes] [-i ms] [-s shards] [-t seconds]\n"
+      "Options:\n"
+      "   -p <int>            The port of the listener (default 9300)\n"
+      "   -c <int>            The number of concurrent clients (default 64)\n"
+      "   -b <int>            The bytes each client sends (default 1048576)\n"
+      "   -i <int>            How long every other client idles after connecting, in ms (default 100)\n"
+      "   -s <int>            Serves with a runtime of that many shards, instead of a listener\n"
+      "   -t <int>            Fails if the test takes longer, in seconds (default 60)\n"
+      "   -h                  prints this help\n");
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_in addr;
+  microtcp_listener_t listener;
+  microtcp_runtime_t rt;
+  microtcp_sock_t *sock;
+  pthread_t *clients;
+  pthread_t thread;
+  unsigned int timeout = 60;
+  unsigned int shards = 0;
+  unsigned int i;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "hp:c:b:i:s:t:")) != -1) {
+    switch (opt)
+      {
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'c':
+        nclients = atoi (optarg);
+        break;
+      case 'b':
+        nbytes = strtoul (optarg, NULL, 10);
+        break;
+      case 'i':
+        idle_ms = atoi (optarg);
+        break;
+      case 's':
+        shards = atoi (optarg);
+        break;
+      case 't':
+        timeout = atoi (optarg);
+        break;
+      default:
+        usage ();
+      }
+  }
+
+  if (nclients == 0 || nbytes < sizeof(uint32_t)) {
+    usage ();
+  }
+
+  received = calloc (nclients, sizeof(*received));
+  clients = calloc (nclients, sizeof(*clients));
+  if (!received || !clients) {
+    perror ("allocate");
+    exit (EXIT_FAILURE);
+  }
+
+  alarm (timeout);
+
+  memset (&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (shards) {
+    if (microtcp_runtime_start (&rt, (struct sockaddr *) &addr, sizeof(addr), shards, handler, NULL)) {
+      perror ("Runtime");
+      exit (EXIT_FAILURE);
+    }
+  }
+  else if (microtcp_listen (&listener, (struct sockaddr *) &addr, sizeof(addr))) {
+    perror ("Listen");
+    exit (EXIT_FAILURE);
+  }
+
+  pthread_barrier_init (&start, NULL, nclients);
+  for (i = 0; i < nclients; i++) {
+    pthread_create (&clients[i], NULL, client, (void *) (uintptr_t) i);
+  }
+
+  /* A thread of its own for every connection, as soon as it is accepted */
+  for (i = 0; !shards && i < nclients; i++) {
+    sock = malloc (sizeof(*sock));
+    if (!sock || microtcp_listener_accept (&listener, sock, NULL, 0)) {
+      perror ("Accept");
+      exit (EXIT_FAILURE);
+    }
+    pthread_create (&thread, NULL, serve, sock);
+    pthread_detach (thread);
+  }
+
+  for (i = 0; i < nclients; i++) {
+    pthread_join (clients[i], NULL);
+  }
+
+  /* The servers finish their shutdown after the clients return */
+  pthread_mutex_lock (&lock);
+  while (served < nclients) {
+    pthread_cond_wait (&done, &lock);
+  }
+  pthread_mutex_unlock (&lock);
+
+  for (i = 0; i < nclients; i++) {
+    if (received[i] != 1) {
+      fprintf (stderr, "Client %u: %u intact transfers\n", i, received[i]);
+      failures++;
+    }
+  }
+
+  if (shards) {
+    for (i = 0; i < rt.nshards; i++) {
+      printf ("Shard %u: %lu connections\n", i, (unsigned long) rt.shards[i].conns);
+    }
+    microtcp_runtime_stop (&rt);
+  }
+  else {
+    microtcp_listener_close (&listener);
+  }
+
+  if (failures) {
+    printf ("FAIL: %u of %u clients\n", failures, nclients);
+    return EXIT_FAILURE;
+  }
+  printf ("PASS: %u clients of %zu bytes\n", nclients, nbytes);
+  return EXIT_SUCCESS;
+}
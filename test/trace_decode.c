@@ -0,0 +1,150 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Renders a trace written by microtcp_trace_dump() in the format of the
+ * ENABLE_DEBUG_MSG build, one header per segment. Sequence numbers are shown
+ * relative to the first segment each side sent, as well as absolute.
+ *
+ * Usage: trace_decode <trace file>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../lib/microtcp.h"
+
+static const char * event_name[] = {
+    [MICROTCP_TRACE_RX]       = "received",
+    [MICROTCP_TRACE_TX]       = "sent",
+    [MICROTCP_TRACE_RTX]      = "retransmitted",
+    [MICROTCP_TRACE_BAD_CSUM] = "wrong checksum",
+};
+
+static void
+print_ctrl(uint8_t cbits)
+{
+    if ( cbits & CTRL_FIN )
+        printf("[\033[94mFIN\033[0m]");
+
+    if ( cbits & CTRL_SYN )
+        printf("[\033[94mSYN\033[0m]");
+
+    if ( cbits & CTRL_RST )
+        printf("[\033[94mRST\033[0m]");
+
+    if ( cbits & CTRL_ACK )
+        printf("[\033[94mACK\033[0m]");
+
+    if ( cbits & CTRL_NAK )
+        printf("[\033[94mNAK\033[0m]");
+
+    if ( cbits & FRAGMENT )
+        printf("[\033[94mFRG\033[0m]");
+
+    printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    microtcp_trace_hdr_t hdr;
+    microtcp_trace_rec_t rec;
+    FILE *fp;
+    double ns_per_tick;
+    double t;
+    uint32_t i;
+    uint32_t packetno = 0;
+    uint32_t local_base = 0, peer_base = 0;
+    int local_known = 0, peer_known = 0;
+    uint32_t seqbase, ackbase;
+    int refack;
+    int rx;
+
+    if ( argc != 2 ) {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if ( !(fp = fopen(argv[1], "rb")) ) {
+        perror("open trace");
+        exit(EXIT_FAILURE);
+    }
+
+    if ( (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+         || memcmp(hdr.magic, MICROTCP_TRACE_MAGIC, sizeof(hdr.magic))
+         || (hdr.rec_size != sizeof(rec)) ) {
+        fprintf(stderr, "%s: not a microTCP trace\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    ns_per_tick = ( hdr.tsc1 > hdr.tsc0 ) ?
+                  (double) (hdr.ns1 - hdr.ns0) / (double) (hdr.tsc1 - hdr.tsc0) : 1.0;
+
+    for ( i = 0; i < hdr.count; i++ ) {
+        if ( fread(&rec, sizeof(rec), 1, fp) != 1 ) {
+            fprintf(stderr, "%s: truncated after %u records\n", argv[1], i);
+            exit(EXIT_FAILURE);
+        }
+
+        t = (double) (int64_t) (rec.tsc - hdr.tsc0) * ns_per_tick / 1e9;
+
+        if ( rec.event == MICROTCP_TRACE_TIMEOUT || rec.event == MICROTCP_TRACE_FAST_RTX ) {
+            printf("\n\033[1m[%.6f]\033[0m %s, retransmitting from \033[3m%u\033[0m --- ( %u ), cwnd = %u\n",
+                   t, ( rec.event == MICROTCP_TRACE_TIMEOUT ) ? "timeout" : "3 duplicate ACKs",
+                   rec.seq_number - local_base, rec.seq_number, rec.cwnd);
+            continue;
+        }
+
+        if ( rec.event > MICROTCP_TRACE_BAD_CSUM ) {
+            printf("\n\033[1m[%.6f]\033[0m unknown event %u\n", t, rec.event);
+            continue;
+        }
+
+        /* The first segment of either side gives the base of its sequence numbers */
+        rx = ( rec.event == MICROTCP_TRACE_RX || rec.event == MICROTCP_TRACE_BAD_CSUM );
+
+        if ( rx && !peer_known ) {
+            peer_base = rec.seq_number;
+            peer_known = 1;
+        }
+        else if ( !rx && !local_known ) {
+            local_base = rec.seq_number;
+            local_known = 1;
+        }
+
+        seqbase = ( rx ) ? peer_base : local_base;
+        ackbase = ( rx ) ? local_base : peer_base;
+        refack = rec.ack_number - ackbase;
+
+        printf("\n\033[1mTCP-header\033[31m#%u\033[0m [%.6f] %s\n", ++packetno, t, event_name[rec.event]);
+        printf("  - \033[4mseq#\033[0m = \033[3m%u\033[0m --- ( %u )\n", rec.seq_number - seqbase, rec.seq_number);
+        printf("  - \033[4mack#\033[0m = \033[3m%u\033[0m --- ( %u )\n", ( refack > -1 ) ? refack : 0, rec.ack_number);
+        printf("  - \033[4mctrl\033[0m = %u --- ", rec.control);
+        print_ctrl(rec.control);
+        printf("  - \033[4mwind\033[0m = %u\n", rec.window);
+        printf("  - \033[4mdata\033[0m = %u\n", rec.data_len);
+        printf("  - \033[4mcsum\033[0m = %u\n", rec.checksum);
+        printf("  - \033[4mcwnd\033[0m = %u\n\n", rec.cwnd);
+    }
+
+    fclose(fp);
+    return 0;
+}
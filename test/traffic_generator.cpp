@@ -33,8 +33,9 @@ extern "C" {
 #include "../lib/microtcp.h"
 #include "../utils/log.h"
 }
+#include "traffic_generator.h"
 
-#define BUF_LEN 2048
+#define BUF_LEN TRAFFIC_MSG_LEN
 
 static bool stop_traffic = false;
 
@@ -55,6 +56,7 @@ main (int argc, char **argv)
   int                   ret;
   int                   port;
   int                   mean_inter;
+  int                   cork = 0;
   microtcp_sock_t       sock;
   struct sockaddr_in    sin;
   struct sockaddr       client_addr;
@@ -62,13 +64,14 @@ main (int argc, char **argv)
   struct sockaddr_in    *addr_in;
   char                  ip_addr[INET_ADDRSTRLEN];
   char                  buffer[BUF_LEN];
+  uint64_t              seq = 0;
 
   /* Create the random generator */
   std::random_device rd;
   std::mt19937 gen(rd());
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hp:i:")) != -1) {
+  while ((opt = getopt (argc, argv, "hcp:i:")) != -1) {
     switch (opt)
       {
       case 'p':
@@ -82,12 +85,17 @@ main (int argc, char **argv)
          */
         mean_inter = atoi (optarg);
         break;
+      case 'c':
+        /* Join the messages into full segments */
+        cork = 1;
+        break;
       default:
         printf (
             "Usage: bandwidth_test -p port -i packet inter-arrival ms"
             "Options:\n"
             "   -p <int>            the port to wait for a peer"
             "   -i <int>            the mean inter-arrival time in milliseconds of the poisson distribution"
+            "   -c                  join the messages into full segments (MICROTCP_SO_CORK)"
             "   -h                  prints this help\n");
         exit (EXIT_FAILURE);
       }
@@ -135,17 +143,27 @@ main (int argc, char **argv)
   addr_in = (struct sockaddr_in *) &client_addr;
   inet_ntop(AF_INET, &(addr_in->sin_addr), ip_addr, INET_ADDRSTRLEN);
   LOG_INFO("Peer %s connected.", ip_addr);
+
+  /* The client reads fixed size messages, so it does not need the boundaries */
+  if (cork && microtcp_setsockopt(&sock, MICROTCP_SO_CORK, &cork, sizeof(cork)) < 0) {
+    LOG_ERROR("Failed to cork the connection");
+    return -EXIT_FAILURE;
+  }
   std::this_thread::sleep_for (std::chrono::seconds(1));
   LOG_INFO("Start generating traffic...");
 
+  memset(buffer, 0, BUF_LEN);
   while(stop_traffic == false) {
     std::this_thread::sleep_for(std::chrono::milliseconds(dpoisson(gen)));
+    /* Stamped right before it is handed to microTCP */
+    traffic_stamp_write(buffer, seq++);
     microtcp_send(&sock, buffer, BUF_LEN, 0);
   }
 
   LOG_INFO("Going to terminate microtcp connection...");
 
-  /* SHUT_RDWR can be omitted internally */
-  microtcp_shutdown(&sock, SHUT_RDWR);
+  /* The generator is the sender: it starts the termination, the client
+     sees it as the end of the stream */
+  microtcp_shutdown(&sock, SHUTDOWN_CLIENT);
 
 }
@@ -0,0 +1,73 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * What the traffic generator and its client agree on: every message starts
+ * with a stamp, the rest is filler.
+ */
+
+#ifndef TEST_TRAFFIC_GENERATOR_H_
+#define TEST_TRAFFIC_GENERATOR_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+
+#define TRAFFIC_MSG_LEN 2048
+
+/*
+ * Start of every message, big endian. The time is CLOCK_REALTIME, so that
+ * the one-way latency is right across hosts whose clocks are synchronized
+ * (and exact on the same host).
+ */
+struct traffic_stamp
+{
+  uint64_t seq;
+  uint64_t sent_ns;
+};
+
+static inline uint64_t
+traffic_now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+traffic_stamp_write (void *msg, uint64_t seq)
+{
+  struct traffic_stamp stamp;
+  stamp.seq = htobe64 (seq);
+  stamp.sent_ns = htobe64 (traffic_now_ns ());
+  memcpy (msg, &stamp, sizeof(stamp));
+}
+
+static inline void
+traffic_stamp_read (const void *msg, uint64_t *seq, uint64_t *sent_ns)
+{
+  struct traffic_stamp stamp;
+  memcpy (&stamp, msg, sizeof(stamp));
+  *seq = be64toh (stamp.seq);
+  *sent_ns = be64toh (stamp.sent_ns);
+}
+
+#endif /* TEST_TRAFFIC_GENERATOR_H_ */
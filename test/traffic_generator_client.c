@@ -18,43 +18,199 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Receives the messages of the traffic generator and measures the one-way
+ * latency of each one, from the stamp the generator put in it. The
+ * latencies go to a histogram with HDR-style buckets (every power of 2 split
+ * in HIST_SUB_BUCKETS, so the error stays below 1%). On Ctrl+C, or when the
+ * generator shuts the connection down, it prints the percentiles and writes
+ * the histogram as CSV. Ctrl+C is taken by a thread of its own, since the
+ * main one may be blocked in microtcp_recv() for good.
+ */
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <pthread.h>
 #include <time.h>
 
 #include "../lib/microtcp.h"
 #include "../utils/log.h"
+#include "traffic_generator.h"
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1U << HIST_SUB_BITS)
+/* Values of 64 bits, the first 2 * HIST_SUB_BUCKETS of them exact */
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) * HIST_SUB_BUCKETS)
+
+struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+};
+
+static struct histogram hist;
+static uint64_t lost;
+static const char *csv;
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+check_args(int argc, char** argv) {
+  if(argc < 3 || argc > 4) {
+    printf("Invalid Syntax: %s <server-ip> <port> [csv-file]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static inline unsigned int
+hist_index(uint64_t v) {
+  unsigned int shift;
+
+  if(v < 2 * HIST_SUB_BUCKETS) {
+    return v;
+  }
+  /* Keep the HIST_SUB_BITS + 1 most significant bits */
+  shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+  return shift * HIST_SUB_BUCKETS + (v >> shift);
+}
+
+/* The smallest value of bucket 'i' */
+static inline uint64_t
+hist_lowest(unsigned int i) {
+  unsigned int shift;
+
+  if(i < 2 * HIST_SUB_BUCKETS) {
+    return i;
+  }
+  shift = i / HIST_SUB_BUCKETS - 1;
+  return (uint64_t) (i - shift * HIST_SUB_BUCKETS) << shift;
+}
+
+/* The largest value of bucket 'i' */
+static inline uint64_t
+hist_highest(unsigned int i) {
+  return (i + 1 < HIST_BUCKETS) ? hist_lowest(i + 1) - 1 : UINT64_MAX;
+}
+
+static void
+hist_record(struct histogram *h, uint64_t v) {
+  h->counts[hist_index(v)]++;
+  if(!h->total || v < h->min) {
+    h->min = v;
+  }
+  if(v > h->max) {
+    h->max = v;
+  }
+  h->total++;
+}
+
+/* The value below which a fraction 'q' of the samples fall */
+static uint64_t
+hist_percentile(const struct histogram *h, double q) {
+  uint64_t rank = (uint64_t) (q * h->total + 0.5);
+  uint64_t seen = 0;
+  unsigned int i;
 
-static char running = 1;
+  if(rank < 1) {
+    rank = 1;
+  }
+  for(i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if(seen >= rank) {
+      return (hist_highest(i) < h->max) ? hist_highest(i) : h->max;
+    }
+  }
+  return h->max;
+}
+
+static void
+hist_write_csv(const struct histogram *h, const char *path) {
+  FILE *fp;
+  uint64_t seen = 0;
+  unsigned int i;
+
+  if(!(fp = fopen(path, "w"))) {
+    LOG_ERROR("Failed to open %s", path);
+    return;
+  }
+  fprintf(fp, "lowest_ns,highest_ns,count,cumulative\n");
+  for(i = 0; i < HIST_BUCKETS; i++) {
+    if(!h->counts[i]) {
+      continue;
+    }
+    seen += h->counts[i];
+    fprintf(fp, "%lu,%lu,%lu,%.6f\n", (unsigned long) hist_lowest(i),
+            (unsigned long) hist_highest(i), (unsigned long) h->counts[i],
+            (double) seen / h->total);
+  }
+  fclose(fp);
+}
 
 static void
-sig_handler(int signal)
-{
-  if(signal == SIGINT) {
-    LOG_INFO("Stopping traffic generator client...");
-    running = 0;
+print_latency(const struct histogram *h, uint64_t missing) {
+  if(!h->total) {
+    printf("No messages received\n");
+    return;
   }
+  printf("Messages: %lu, missing: %lu\n", (unsigned long) h->total, (unsigned long) missing);
+  printf("One-way latency (us): min %.1f  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+         h->min / 1e3, hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.99) / 1e3,
+         hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+static void
+report(void) {
+  pthread_mutex_lock(&hist_lock);
+  print_latency(&hist, lost);
+  hist_write_csv(&hist, csv);
+  pthread_mutex_unlock(&hist_lock);
+}
+
+/* Waits for Ctrl+C, which every other thread blocks */
+static void *
+sigint_thread(void *arg) {
+  sigset_t *set = arg;
+  int sig;
+
+  sigwait(set, &sig);
+  LOG_INFO("Stopping traffic generator client...");
+  report();
+  exit(EXIT_SUCCESS);
 }
 
 int
 main(int argc, char **argv) {
-  /*
-   * Register a signal handler so we can terminate the client with
-   * Ctrl+C
-   */
-  signal(SIGINT, sig_handler);
   check_args(argc, argv);
   microtcp_sock_t socket;
   struct sockaddr_in addr;
   uint16_t port=atoi(argv[2]);
   uint32_t iaddr;
-  uint8_t  buff[1500];
+  uint8_t  buff[TRAFFIC_MSG_LEN];
+  ssize_t received;
+  size_t filled = 0;
+  uint64_t seq;
+  uint64_t sent_ns;
+  uint64_t now_ns;
+  uint64_t expected = 0;
+  sigset_t sigint;
+  pthread_t waiter;
 
+  csv = (argc > 3) ? argv[3] : "latency.csv";
+
+  /*
+   * Block Ctrl+C here, and in the threads of microTCP, so that it goes to
+   * the thread that reports the measurements
+   */
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigint, NULL);
+  pthread_create(&waiter, NULL, sigint_thread, &sigint);
 
   socket = microtcp_socket(AF_INET, SOCK_DGRAM, 0);
   inet_pton(AF_INET, argv[1], &iaddr);
@@ -62,28 +218,39 @@ main(int argc, char **argv) {
   addr.sin_port        = htons(port);
   addr.sin_family      = AF_INET;
 
-  microtcp_connect(&socket, (struct sockaddr*)&addr, sizeof(addr));
-
-
-  LOG_INFO("Start receiving traffic from port %u", port);
-  /*TODO: Connect using microtcp_connect() */
-  while(running) {
-    /* TODO: Measure time */
-    time_t now = time(0);
-    /* TODO: Receive using microtcp_recv()*/
-    microtcp_recv(&socket, buff, 1500UL, 0);
-    /* TODO: Measure time */
-    time_t later = time(0);
-    double elapsed_time = difftime(later, now);
-    /* TODO: Do other stuff... */
+  if(microtcp_connect(&socket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    LOG_ERROR("Failed to connect");
+    return -EXIT_FAILURE;
   }
 
-  /* Ctrl+C pressed! Store properly time measurements for plotting */
-}
+  LOG_INFO("Start receiving traffic from port %u", port);
+  for(;;) {
+    /*
+     * microtcp_recv() stops at the end of a message: one message per call,
+     * unless the generator corks the connection (-c), which joins them
+     */
+    received = microtcp_recv(&socket, buff + filled, sizeof(buff) - filled, 0);
+    now_ns = traffic_now_ns();
+    if(received < 0) {  /* the generator shut the connection down */
+      break;
+    }
+    filled += received;
+    if(filled < sizeof(buff)) {
+      continue;
+    }
+    filled = 0;
 
-check_args(int argc, char** argv) {
-  if(argc < 4 || argc >=5) {
-    printf("Invalid Syntax: ./traffic_generator_client <server-ip> <port>");
-    exit(0);
+    traffic_stamp_read(buff, &seq, &sent_ns);
+    pthread_mutex_lock(&hist_lock);
+    if(seq > expected) {
+      lost += seq - expected;
+    }
+    expected = seq + 1;
+    hist_record(&hist, (now_ns > sent_ns) ? now_ns - sent_ns : 0);
+    pthread_mutex_unlock(&hist_lock);
   }
+
+  /* Store properly time measurements for plotting */
+  report();
+  return 0;
 }
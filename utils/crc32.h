@@ -21,9 +21,88 @@
 #ifndef UTILS_CRC32_H_
 #define UTILS_CRC32_H_
 
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32_HAVE_CLMUL 1
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_neon.h>
+#define CRC32_HAVE_CLMUL 1
+#endif
+
+/*
+ * CRC-32 (IEEE 802.3), polynomial 0x104C11DB7, reflected. Three implementations,
+ * which return identical results:
+ *  - update_crc32_bytewise(): the classic one-table, byte-at-a-time loop
+ *  - update_crc32_slice16(): slicing-by-16, 16 bytes per iteration with 16 tables
+ *  - update_crc32_clmul(): folding with carry-less multiplication (PCLMULQDQ on x86,
+ *    PMULL on ARMv8), 64 bytes per iteration
+ * update_crc32() goes through the fastest one the CPU supports, chosen at startup.
+ */
+
+static const uint32_t crc32_lut[256] =
+  { 0x00000000L, 0x77073096L, 0xEE0E612CL, 0x990951BAL, 0x076DC419L,
+      0x706AF48FL, 0xE963A535L, 0x9E6495A3L, 0x0EDB8832L, 0x79DCB8A4L,
+      0xE0D5E91EL, 0x97D2D988L, 0x09B64C2BL, 0x7EB17CBDL, 0xE7B82D07L,
+      0x90BF1D91L, 0x1DB71064L, 0x6AB020F2L, 0xF3B97148L, 0x84BE41DEL,
+      0x1ADAD47DL, 0x6DDDE4EBL, 0xF4D4B551L, 0x83D385C7L, 0x136C9856L,
+      0x646BA8C0L, 0xFD62F97AL, 0x8A65C9ECL, 0x14015C4FL, 0x63066CD9L,
+      0xFA0F3D63L, 0x8D080DF5L, 0x3B6E20C8L, 0x4C69105EL, 0xD56041E4L,
+      0xA2677172L, 0x3C03E4D1L, 0x4B04D447L, 0xD20D85FDL, 0xA50AB56BL,
+      0x35B5A8FAL, 0x42B2986CL, 0xDBBBC9D6L, 0xACBCF940L, 0x32D86CE3L,
+      0x45DF5C75L, 0xDCD60DCFL, 0xABD13D59L, 0x26D930ACL, 0x51DE003AL,
+      0xC8D75180L, 0xBFD06116L, 0x21B4F4B5L, 0x56B3C423L, 0xCFBA9599L,
+      0xB8BDA50FL, 0x2802B89EL, 0x5F058808L, 0xC60CD9B2L, 0xB10BE924L,
+      0x2F6F7C87L, 0x58684C11L, 0xC1611DABL, 0xB6662D3DL, 0x76DC4190L,
+      0x01DB7106L, 0x98D220BCL, 0xEFD5102AL, 0x71B18589L, 0x06B6B51FL,
+      0x9FBFE4A5L, 0xE8B8D433L, 0x7807C9A2L, 0x0F00F934L, 0x9609A88EL,
+      0xE10E9818L, 0x7F6A0DBBL, 0x086D3D2DL, 0x91646C97L, 0xE6635C01L,
+      0x6B6B51F4L, 0x1C6C6162L, 0x856530D8L, 0xF262004EL, 0x6C0695EDL,
+      0x1B01A57BL, 0x8208F4C1L, 0xF50FC457L, 0x65B0D9C6L, 0x12B7E950L,
+      0x8BBEB8EAL, 0xFCB9887CL, 0x62DD1DDFL, 0x15DA2D49L, 0x8CD37CF3L,
+      0xFBD44C65L, 0x4DB26158L, 0x3AB551CEL, 0xA3BC0074L, 0xD4BB30E2L,
+      0x4ADFA541L, 0x3DD895D7L, 0xA4D1C46DL, 0xD3D6F4FBL, 0x4369E96AL,
+      0x346ED9FCL, 0xAD678846L, 0xDA60B8D0L, 0x44042D73L, 0x33031DE5L,
+      0xAA0A4C5FL, 0xDD0D7CC9L, 0x5005713CL, 0x270241AAL, 0xBE0B1010L,
+      0xC90C2086L, 0x5768B525L, 0x206F85B3L, 0xB966D409L, 0xCE61E49FL,
+      0x5EDEF90EL, 0x29D9C998L, 0xB0D09822L, 0xC7D7A8B4L, 0x59B33D17L,
+      0x2EB40D81L, 0xB7BD5C3BL, 0xC0BA6CADL, 0xEDB88320L, 0x9ABFB3B6L,
+      0x03B6E20CL, 0x74B1D29AL, 0xEAD54739L, 0x9DD277AFL, 0x04DB2615L,
+      0x73DC1683L, 0xE3630B12L, 0x94643B84L, 0x0D6D6A3EL, 0x7A6A5AA8L,
+      0xE40ECF0BL, 0x9309FF9DL, 0x0A00AE27L, 0x7D079EB1L, 0xF00F9344L,
+      0x8708A3D2L, 0x1E01F268L, 0x6906C2FEL, 0xF762575DL, 0x806567CBL,
+      0x196C3671L, 0x6E6B06E7L, 0xFED41B76L, 0x89D32BE0L, 0x10DA7A5AL,
+      0x67DD4ACCL, 0xF9B9DF6FL, 0x8EBEEFF9L, 0x17B7BE43L, 0x60B08ED5L,
+      0xD6D6A3E8L, 0xA1D1937EL, 0x38D8C2C4L, 0x4FDFF252L, 0xD1BB67F1L,
+      0xA6BC5767L, 0x3FB506DDL, 0x48B2364BL, 0xD80D2BDAL, 0xAF0A1B4CL,
+      0x36034AF6L, 0x41047A60L, 0xDF60EFC3L, 0xA867DF55L, 0x316E8EEFL,
+      0x4669BE79L, 0xCB61B38CL, 0xBC66831AL, 0x256FD2A0L, 0x5268E236L,
+      0xCC0C7795L, 0xBB0B4703L, 0x220216B9L, 0x5505262FL, 0xC5BA3BBEL,
+      0xB2BD0B28L, 0x2BB45A92L, 0x5CB36A04L, 0xC2D7FFA7L, 0xB5D0CF31L,
+      0x2CD99E8BL, 0x5BDEAE1DL, 0x9B64C2B0L, 0xEC63F226L, 0x756AA39CL,
+      0x026D930AL, 0x9C0906A9L, 0xEB0E363FL, 0x72076785L, 0x05005713L,
+      0x95BF4A82L, 0xE2B87A14L, 0x7BB12BAEL, 0x0CB61B38L, 0x92D28E9BL,
+      0xE5D5BE0DL, 0x7CDCEFB7L, 0x0BDBDF21L, 0x86D3D2D4L, 0xF1D4E242L,
+      0x68DDB3F8L, 0x1FDA836EL, 0x81BE16CDL, 0xF6B9265BL, 0x6FB077E1L,
+      0x18B74777L, 0x88085AE6L, 0xFF0F6A70L, 0x66063BCAL, 0x11010B5CL,
+      0x8F659EFFL, 0xF862AE69L, 0x616BFFD3L, 0x166CCF45L, 0xA00AE278L,
+      0xD70DD2EEL, 0x4E048354L, 0x3903B3C2L, 0xA7672661L, 0xD06016F7L,
+      0x4969474DL, 0x3E6E77DBL, 0xAED16A4AL, 0xD9D65ADCL, 0x40DF0B66L,
+      0x37D83BF0L, 0xA9BCAE53L, 0xDEBB9EC5L, 0x47B2CF7FL, 0x30B5FFE9L,
+      0xBDBDF21CL, 0xCABAC28AL, 0x53B39330L, 0x24B4A3A6L, 0xBAD03605L,
+      0xCDD70693L, 0x54DE5729L, 0x23D967BFL, 0xB3667A2EL, 0xC4614AB8L,
+      0x5D681B02L, 0x2A6F2B94L, 0xB40BBE37L, 0xC30C8EA1L, 0x5A05DF1BL,
+      0x2D02EF8DL };
+
+static uint32_t crc32_slice[16][256];  /* crc32_slice[k][i]: CRC of byte i, followed by k zero bytes */
+
 /**
- * CRC-32 calculation using lookup tables, supporting progressive CRC calculation
- * polynomial: 0x104C11DB7
+ * CRC-32 calculation using a lookup table, one byte at a time
  *
  * @param crc the initial feed
  * @param data the buffer containing the data
@@ -31,69 +110,201 @@
  * @return the CRC-32 result
  */
 static inline uint32_t
-update_crc32 (uint32_t crc, const uint8_t * data, uint32_t len)
+update_crc32_bytewise (uint32_t crc, const uint8_t * data, size_t len)
 {
-  static const uint32_t crc32_lut[256] =
-    { 0x00000000L, 0x77073096L, 0xEE0E612CL, 0x990951BAL, 0x076DC419L,
-        0x706AF48FL, 0xE963A535L, 0x9E6495A3L, 0x0EDB8832L, 0x79DCB8A4L,
-        0xE0D5E91EL, 0x97D2D988L, 0x09B64C2BL, 0x7EB17CBDL, 0xE7B82D07L,
-        0x90BF1D91L, 0x1DB71064L, 0x6AB020F2L, 0xF3B97148L, 0x84BE41DEL,
-        0x1ADAD47DL, 0x6DDDE4EBL, 0xF4D4B551L, 0x83D385C7L, 0x136C9856L,
-        0x646BA8C0L, 0xFD62F97AL, 0x8A65C9ECL, 0x14015C4FL, 0x63066CD9L,
-        0xFA0F3D63L, 0x8D080DF5L, 0x3B6E20C8L, 0x4C69105EL, 0xD56041E4L,
-        0xA2677172L, 0x3C03E4D1L, 0x4B04D447L, 0xD20D85FDL, 0xA50AB56BL,
-        0x35B5A8FAL, 0x42B2986CL, 0xDBBBC9D6L, 0xACBCF940L, 0x32D86CE3L,
-        0x45DF5C75L, 0xDCD60DCFL, 0xABD13D59L, 0x26D930ACL, 0x51DE003AL,
-        0xC8D75180L, 0xBFD06116L, 0x21B4F4B5L, 0x56B3C423L, 0xCFBA9599L,
-        0xB8BDA50FL, 0x2802B89EL, 0x5F058808L, 0xC60CD9B2L, 0xB10BE924L,
-        0x2F6F7C87L, 0x58684C11L, 0xC1611DABL, 0xB6662D3DL, 0x76DC4190L,
-        0x01DB7106L, 0x98D220BCL, 0xEFD5102AL, 0x71B18589L, 0x06B6B51FL,
-        0x9FBFE4A5L, 0xE8B8D433L, 0x7807C9A2L, 0x0F00F934L, 0x9609A88EL,
-        0xE10E9818L, 0x7F6A0DBBL, 0x086D3D2DL, 0x91646C97L, 0xE6635C01L,
-        0x6B6B51F4L, 0x1C6C6162L, 0x856530D8L, 0xF262004EL, 0x6C0695EDL,
-        0x1B01A57BL, 0x8208F4C1L, 0xF50FC457L, 0x65B0D9C6L, 0x12B7E950L,
-        0x8BBEB8EAL, 0xFCB9887CL, 0x62DD1DDFL, 0x15DA2D49L, 0x8CD37CF3L,
-        0xFBD44C65L, 0x4DB26158L, 0x3AB551CEL, 0xA3BC0074L, 0xD4BB30E2L,
-        0x4ADFA541L, 0x3DD895D7L, 0xA4D1C46DL, 0xD3D6F4FBL, 0x4369E96AL,
-        0x346ED9FCL, 0xAD678846L, 0xDA60B8D0L, 0x44042D73L, 0x33031DE5L,
-        0xAA0A4C5FL, 0xDD0D7CC9L, 0x5005713CL, 0x270241AAL, 0xBE0B1010L,
-        0xC90C2086L, 0x5768B525L, 0x206F85B3L, 0xB966D409L, 0xCE61E49FL,
-        0x5EDEF90EL, 0x29D9C998L, 0xB0D09822L, 0xC7D7A8B4L, 0x59B33D17L,
-        0x2EB40D81L, 0xB7BD5C3BL, 0xC0BA6CADL, 0xEDB88320L, 0x9ABFB3B6L,
-        0x03B6E20CL, 0x74B1D29AL, 0xEAD54739L, 0x9DD277AFL, 0x04DB2615L,
-        0x73DC1683L, 0xE3630B12L, 0x94643B84L, 0x0D6D6A3EL, 0x7A6A5AA8L,
-        0xE40ECF0BL, 0x9309FF9DL, 0x0A00AE27L, 0x7D079EB1L, 0xF00F9344L,
-        0x8708A3D2L, 0x1E01F268L, 0x6906C2FEL, 0xF762575DL, 0x806567CBL,
-        0x196C3671L, 0x6E6B06E7L, 0xFED41B76L, 0x89D32BE0L, 0x10DA7A5AL,
-        0x67DD4ACCL, 0xF9B9DF6FL, 0x8EBEEFF9L, 0x17B7BE43L, 0x60B08ED5L,
-        0xD6D6A3E8L, 0xA1D1937EL, 0x38D8C2C4L, 0x4FDFF252L, 0xD1BB67F1L,
-        0xA6BC5767L, 0x3FB506DDL, 0x48B2364BL, 0xD80D2BDAL, 0xAF0A1B4CL,
-        0x36034AF6L, 0x41047A60L, 0xDF60EFC3L, 0xA867DF55L, 0x316E8EEFL,
-        0x4669BE79L, 0xCB61B38CL, 0xBC66831AL, 0x256FD2A0L, 0x5268E236L,
-        0xCC0C7795L, 0xBB0B4703L, 0x220216B9L, 0x5505262FL, 0xC5BA3BBEL,
-        0xB2BD0B28L, 0x2BB45A92L, 0x5CB36A04L, 0xC2D7FFA7L, 0xB5D0CF31L,
-        0x2CD99E8BL, 0x5BDEAE1DL, 0x9B64C2B0L, 0xEC63F226L, 0x756AA39CL,
-        0x026D930AL, 0x9C0906A9L, 0xEB0E363FL, 0x72076785L, 0x05005713L,
-        0x95BF4A82L, 0xE2B87A14L, 0x7BB12BAEL, 0x0CB61B38L, 0x92D28E9BL,
-        0xE5D5BE0DL, 0x7CDCEFB7L, 0x0BDBDF21L, 0x86D3D2D4L, 0xF1D4E242L,
-        0x68DDB3F8L, 0x1FDA836EL, 0x81BE16CDL, 0xF6B9265BL, 0x6FB077E1L,
-        0x18B74777L, 0x88085AE6L, 0xFF0F6A70L, 0x66063BCAL, 0x11010B5CL,
-        0x8F659EFFL, 0xF862AE69L, 0x616BFFD3L, 0x166CCF45L, 0xA00AE278L,
-        0xD70DD2EEL, 0x4E048354L, 0x3903B3C2L, 0xA7672661L, 0xD06016F7L,
-        0x4969474DL, 0x3E6E77DBL, 0xAED16A4AL, 0xD9D65ADCL, 0x40DF0B66L,
-        0x37D83BF0L, 0xA9BCAE53L, 0xDEBB9EC5L, 0x47B2CF7FL, 0x30B5FFE9L,
-        0xBDBDF21CL, 0xCABAC28AL, 0x53B39330L, 0x24B4A3A6L, 0xBAD03605L,
-        0xCDD70693L, 0x54DE5729L, 0x23D967BFL, 0xB3667A2EL, 0xC4614AB8L,
-        0x5D681B02L, 0x2A6F2B94L, 0xB40BBE37L, 0xC30C8EA1L, 0x5A05DF1BL,
-        0x2D02EF8DL };
-
-  register uint32_t i;
+  size_t i;
   for (i = 0; i < len; i++)
     crc = (crc >> 8) ^ crc32_lut[(crc ^ data[i]) & 0xff];
 
   return crc;
 }
 
+/* Little endian load, whatever the byte order of the host */
+static inline uint32_t
+crc32_load32 (const uint8_t * p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16)
+      | ((uint32_t) p[3] << 24);
+}
+
+/**
+ * CRC-32 calculation using slicing-by-16: 16 table lookups per 16 bytes,
+ * independent of each other
+ */
+static inline uint32_t
+update_crc32_slice16 (uint32_t crc, const uint8_t * data, size_t len)
+{
+  uint32_t w0, w1, w2, w3;
+
+  while (len >= 16) {
+    w0 = crc32_load32 (data) ^ crc;
+    w1 = crc32_load32 (data + 4);
+    w2 = crc32_load32 (data + 8);
+    w3 = crc32_load32 (data + 12);
+
+    crc = crc32_slice[15][w0 & 0xff] ^ crc32_slice[14][(w0 >> 8) & 0xff]
+        ^ crc32_slice[13][(w0 >> 16) & 0xff] ^ crc32_slice[12][w0 >> 24]
+        ^ crc32_slice[11][w1 & 0xff] ^ crc32_slice[10][(w1 >> 8) & 0xff]
+        ^ crc32_slice[9][(w1 >> 16) & 0xff] ^ crc32_slice[8][w1 >> 24]
+        ^ crc32_slice[7][w2 & 0xff] ^ crc32_slice[6][(w2 >> 8) & 0xff]
+        ^ crc32_slice[5][(w2 >> 16) & 0xff] ^ crc32_slice[4][w2 >> 24]
+        ^ crc32_slice[3][w3 & 0xff] ^ crc32_slice[2][(w3 >> 8) & 0xff]
+        ^ crc32_slice[1][(w3 >> 16) & 0xff] ^ crc32_slice[0][w3 >> 24];
+
+    data += 16;
+    len -= 16;
+  }
+
+  return update_crc32_bytewise (crc, data, len);
+}
+
+#ifdef CRC32_HAVE_CLMUL
+/*
+ * Folding constants, x^n mod P(x) bit-reflected (see "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction", Intel, 2009): k1, k2 fold 512 bits forward,
+ * k3, k4 fold 128 bits forward. The last 128 bits are reduced with the tables.
+ */
+#define CRC32_K1 0x154442bd4ULL
+#define CRC32_K2 0x1c6e41596ULL
+#define CRC32_K3 0x1751997d0ULL
+#define CRC32_K4 0x0ccaa009eULL
+
+#if defined(__x86_64__) || defined(__i386__)
+
+typedef __m128i crc32_v128;
+
+#define CRC32_CLMUL_TARGET __attribute__((target ("pclmul,sse2")))
+
+CRC32_CLMUL_TARGET static inline crc32_v128
+crc32_fold (crc32_v128 x, crc32_v128 k, crc32_v128 next)
+{
+  return _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x, k, 0x00),
+                                       _mm_clmulepi64_si128 (x, k, 0x11)), next);
+}
+
+#define crc32_v128_load(p) _mm_loadu_si128 ((const __m128i *) (p))
+#define crc32_v128_store(p, x) _mm_storeu_si128 ((__m128i *) (p), (x))
+#define crc32_v128_const(lo, hi) _mm_set_epi64x ((long long) (hi), (long long) (lo))
+#define crc32_v128_xor32(x, v) _mm_xor_si128 ((x), _mm_cvtsi32_si128 ((int) (v)))
+
+#else /* __aarch64__ */
+
+typedef uint64x2_t crc32_v128;
+
+#define CRC32_CLMUL_TARGET __attribute__((target ("+crypto")))
+
+CRC32_CLMUL_TARGET static inline crc32_v128
+crc32_fold (crc32_v128 x, crc32_v128 k, crc32_v128 next)
+{
+  poly128_t lo = vmull_p64 ((poly64_t) vgetq_lane_u64 (x, 0), (poly64_t) vgetq_lane_u64 (k, 0));
+  poly128_t hi = vmull_high_p64 (vreinterpretq_p64_u64 (x), vreinterpretq_p64_u64 (k));
+
+  return veorq_u64 (veorq_u64 (vreinterpretq_u64_p128 (lo), vreinterpretq_u64_p128 (hi)), next);
+}
+
+#define crc32_v128_load(p) vreinterpretq_u64_u8 (vld1q_u8 ((const uint8_t *) (p)))
+#define crc32_v128_store(p, x) vst1q_u8 ((uint8_t *) (p), vreinterpretq_u8_u64 (x))
+#define crc32_v128_const(lo, hi) vcombine_u64 (vcreate_u64 (lo), vcreate_u64 (hi))
+#define crc32_v128_xor32(x, v) veorq_u64 ((x), vcombine_u64 (vcreate_u64 ((uint64_t) (v)), vcreate_u64 (0)))
+
+#endif
+
+/**
+ * CRC-32 calculation by folding 4 x 128 bits at a time with carry-less multiplication.
+ * The CPU must support it (PCLMULQDQ / PMULL), see crc32_init().
+ */
+CRC32_CLMUL_TARGET static inline uint32_t
+update_crc32_clmul (uint32_t crc, const uint8_t * data, size_t len)
+{
+  crc32_v128 x0, x1, x2, x3, k;
+  uint8_t rem[16];
+
+  if (len < 64)
+    return update_crc32_slice16 (crc, data, len);
+
+  x0 = crc32_v128_xor32 (crc32_v128_load (data), crc);  /* the feed goes into the first bytes */
+  x1 = crc32_v128_load (data + 16);
+  x2 = crc32_v128_load (data + 32);
+  x3 = crc32_v128_load (data + 48);
+  data += 64;
+  len -= 64;
+
+  k = crc32_v128_const (CRC32_K1, CRC32_K2);
+  while (len >= 64) {
+    x0 = crc32_fold (x0, k, crc32_v128_load (data));
+    x1 = crc32_fold (x1, k, crc32_v128_load (data + 16));
+    x2 = crc32_fold (x2, k, crc32_v128_load (data + 32));
+    x3 = crc32_fold (x3, k, crc32_v128_load (data + 48));
+    data += 64;
+    len -= 64;
+  }
+
+  k = crc32_v128_const (CRC32_K3, CRC32_K4);
+  x0 = crc32_fold (x0, k, x1);
+  x0 = crc32_fold (x0, k, x2);
+  x0 = crc32_fold (x0, k, x3);
+  while (len >= 16) {
+    x0 = crc32_fold (x0, k, crc32_v128_load (data));
+    data += 16;
+    len -= 16;
+  }
+
+  /* 128 bits left, with the same CRC as everything folded so far */
+  crc32_v128_store (rem, x0);
+  crc = update_crc32_slice16 (0, rem, sizeof(rem));
+
+  return update_crc32_bytewise (crc, data, len);
+}
+#endif /* CRC32_HAVE_CLMUL */
+
+static uint32_t (*crc32_impl) (uint32_t, const uint8_t *, size_t) = update_crc32_bytewise;
+
+/**
+ * Builds the slicing tables and picks the fastest implementation for this CPU.
+ * Runs before main().
+ */
+__attribute__((constructor)) static void
+crc32_init (void)
+{
+  uint32_t i, k;
+
+  for (i = 0; i < 256; i++)
+    crc32_slice[0][i] = crc32_lut[i];
+
+  for (k = 1; k < 16; k++)
+    for (i = 0; i < 256; i++)
+      crc32_slice[k][i] = (crc32_slice[k - 1][i] >> 8) ^ crc32_lut[crc32_slice[k - 1][i] & 0xff];
+
+  crc32_impl = update_crc32_slice16;
+
+#if defined(__x86_64__) || defined(__i386__)
+  {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid (1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (edx & bit_SSE2))
+      crc32_impl = update_crc32_clmul;
+  }
+#elif defined(__aarch64__)
+  if (getauxval (AT_HWCAP) & HWCAP_PMULL)
+    crc32_impl = update_crc32_clmul;
+#endif
+}
+
+/**
+ * CRC-32 calculation, supporting progressive CRC calculation
+ * polynomial: 0x104C11DB7
+ *
+ * @param crc the initial feed
+ * @param data the buffer containing the data
+ * @param len the length of the buffer
+ * @return the CRC-32 result
+ */
+static inline uint32_t
+update_crc32 (uint32_t crc, const uint8_t * data, uint32_t len)
+{
+  return crc32_impl (crc, data, len);
+}
+
 /**
  * Calculates the CRC-32 of the buffer buf.
  * @param buf The buffer containing the data